@@ -0,0 +1,410 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include "capture_store.h"
+#include "consts.h"
+#include "mapped_file.h"
+
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t capture_hash(uint64_t hash, const byte *bytes, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// Writes all of `n` bytes, printing an error naming `what` on failure
+static bool write_all(int fd, const void *data, size_t n, const char *what) {
+  const byte *p = (const byte *)data;
+
+  while (n > 0) {
+    ssize_t written = write(fd, p, n);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      perror(what);
+      return false;
+    }
+    p += written;
+    n -= written;
+  }
+  return true;
+}
+
+static bool make_dir(const std::string &path) {
+  if (mkdir(path.c_str(), 0777) == 0 || errno == EEXIST)
+    return true;
+  perror(path.c_str());
+  return false;
+}
+
+CaptureStore::CaptureStore()
+  : pack_fd(-1), index_fd(-1), pack_size(0), pending_objects(0)
+{
+}
+
+CaptureStore::~CaptureStore() {
+  close();
+}
+
+bool CaptureStore::open(const char *store_dir) {
+  close();
+  dir = store_dir;
+  if (!make_dir(dir) || !make_dir(dir + "/" CAPTURE_MANIFEST_DIR))
+    return false;
+
+  std::string pack_path = dir + "/" CAPTURE_PACK_FILE;
+  std::string index_path = dir + "/" CAPTURE_INDEX_FILE;
+  pack_fd = ::open(pack_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (pack_fd < 0) {
+    perror(pack_path.c_str());
+    return false;
+  }
+  index_fd = ::open(index_path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+  if (index_fd < 0) {
+    perror(index_path.c_str());
+    close();
+    return false;
+  }
+  if (!load_index()) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void CaptureStore::close() {
+  if (pack_fd >= 0) {
+    flush();
+    ::close(pack_fd);
+  }
+  if (index_fd >= 0)
+    ::close(index_fd);
+  pack_fd = index_fd = -1;
+  pack_size = 0;
+  objects.clear();
+  by_hash.clear();
+}
+
+/*
+ * Reads the index. Objects are written to the pack before the index, so
+ * after a crash the pack may hold objects the index doesn't, which are
+ * never used, but the index never refers to bytes the pack doesn't have.
+ * A partly written last record is dropped.
+ */
+bool CaptureStore::load_index() {
+  struct stat st;
+
+  if (fstat(pack_fd, &st) < 0) {
+    perror(CAPTURE_PACK_FILE);
+    return false;
+  }
+  pack_size = st.st_size;
+
+  if (fstat(index_fd, &st) < 0) {
+    perror(CAPTURE_INDEX_FILE);
+    return false;
+  }
+  size_t num_objects = st.st_size / sizeof(StoredObject);
+  objects.resize(num_objects);
+  if (num_objects > 0
+      && pread(index_fd, objects.data(), num_objects * sizeof(StoredObject), 0)
+         != (ssize_t)(num_objects * sizeof(StoredObject))) {
+    perror(CAPTURE_INDEX_FILE);
+    return false;
+  }
+  while (!objects.empty() && objects.back().offset + objects.back().length > pack_size)
+    objects.pop_back();
+  if ((off_t)(objects.size() * sizeof(StoredObject)) != st.st_size
+      && ftruncate(index_fd, objects.size() * sizeof(StoredObject)) < 0) {
+    perror(CAPTURE_INDEX_FILE);
+    return false;
+  }
+
+  by_hash.reserve(objects.size());
+  for (size_t i = 0; i < objects.size(); ++i)
+    by_hash.insert(std::make_pair(objects[i].hash, i));
+  return true;
+}
+
+void CaptureStore::begin(Capture &capture) {
+  capture.extents.clear();
+  capture.size = capture.messages = 0;
+  capture.hash = CAPTURE_HASH_START;
+  capture.new_messages = capture.new_bytes = 0;
+}
+
+bool CaptureStore::add(Capture &capture, const byte *bytes, size_t n) {
+  if (n == 0)
+    return true;
+
+  uint64_t hash = capture_hash(CAPTURE_HASH_START, bytes, n);
+  long found = find_object(hash, bytes, n);
+  uint64_t offset;
+  if (found >= 0)
+    offset = objects[found].offset;
+  else {
+    offset = pack_size;
+    StoredObject object = {hash, offset, n};
+    by_hash.insert(std::make_pair(hash, objects.size()));
+    objects.push_back(object);
+    ++pending_objects;
+    pending.insert(pending.end(), bytes, bytes + n);
+    pack_size += n;
+    ++capture.new_messages;
+    capture.new_bytes += n;
+    if (pending.size() >= CAPTURE_PACK_BUFSIZ && !flush())
+      return false;
+  }
+
+  if (!capture.extents.empty()
+      && capture.extents.back().offset + capture.extents.back().length == offset)
+    capture.extents.back().length += n;
+  else {
+    PackExtent extent = {offset, n};
+    capture.extents.push_back(extent);
+  }
+  capture.size += n;
+  ++capture.messages;
+  capture.hash = capture_hash(capture.hash, bytes, n);
+  return true;
+}
+
+// Returns the index in `objects` of the object holding `bytes`, or -1
+long CaptureStore::find_object(uint64_t hash, const byte *bytes, size_t n) {
+  auto range = by_hash.equal_range(hash);
+  for (auto iter = range.first; iter != range.second; ++iter)
+    if (objects[iter->second].length == n && same_bytes(objects[iter->second], bytes, n))
+      return iter->second;
+  return -1;
+}
+
+bool CaptureStore::same_bytes(const StoredObject &object, const byte *bytes, size_t n) {
+  uint64_t written = pack_size - pending.size();
+  if (object.offset >= written)
+    return memcmp(&pending[object.offset - written], bytes, n) == 0;
+
+  scratch.resize(n);
+  if (pread(pack_fd, scratch.data(), n, object.offset) != (ssize_t)n)
+    return false;
+  return memcmp(scratch.data(), bytes, n) == 0;
+}
+
+/*
+ * Writes new objects to the pack, then their records to the index. If
+ * either write fails the new objects are forgotten and whatever part of
+ * them was written is cut off again, so that the offsets of later objects
+ * still match where the pack puts them.
+ */
+bool CaptureStore::flush() {
+  if (pending_objects == 0)
+    return true;
+
+  size_t first = objects.size() - pending_objects;
+  uint64_t written = pack_size - pending.size();
+  bool ok = write_all(pack_fd, pending.data(), pending.size(), CAPTURE_PACK_FILE)
+    && write_all(index_fd, &objects[first], pending_objects * sizeof(StoredObject),
+                 CAPTURE_INDEX_FILE);
+  pending.clear();
+  pending_objects = 0;
+  if (!ok)
+    forget_objects(first, written);
+  return ok;
+}
+
+// Drops `objects` from `first` on, which start at `offset` in the pack
+void CaptureStore::forget_objects(size_t first, uint64_t offset) {
+  for (size_t i = first; i < objects.size(); ++i) {
+    auto range = by_hash.equal_range(objects[i].hash);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+      if (iter->second == i) {
+        by_hash.erase(iter);
+        break;
+      }
+    }
+  }
+  objects.resize(first);
+
+  if (ftruncate(index_fd, first * sizeof(StoredObject)) < 0)
+    perror(CAPTURE_INDEX_FILE);
+  // If the pack can't be cut back, new objects go after what's left
+  struct stat st;
+  if (ftruncate(pack_fd, offset) < 0)
+    perror(CAPTURE_PACK_FILE);
+  pack_size = fstat(pack_fd, &st) == 0 ? (uint64_t)st.st_size : offset;
+}
+
+/*
+ * Writes the manifest to a temporary file and renames it into place, so
+ * an existing capture of the same name is only replaced by a whole one.
+ */
+bool CaptureStore::finish(Capture &capture, const char *name) {
+  if (!flush())
+    return false;
+
+  ManifestHeader header;
+  memcpy(header.magic, CAPTURE_MANIFEST_MAGIC, sizeof(header.magic));
+  header.version = CAPTURE_MANIFEST_VERSION;
+  header.size = capture.size;
+  header.messages = capture.messages;
+  header.hash = capture.hash;
+  header.num_extents = capture.extents.size();
+
+  std::string path = manifest_path(name);
+  std::string tmp_path = path + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    perror(tmp_path.c_str());
+    return false;
+  }
+  bool ok = write_all(fd, &header, sizeof(header), tmp_path.c_str())
+    && write_all(fd, capture.extents.data(), capture.extents.size() * sizeof(PackExtent),
+                 tmp_path.c_str());
+  ::close(fd);
+  if (ok && rename(tmp_path.c_str(), path.c_str()) < 0) {
+    perror(path.c_str());
+    ok = false;
+  }
+  if (!ok)
+    unlink(tmp_path.c_str());
+  return ok;
+}
+
+bool CaptureStore::import(const char *name, const char *path, Capture &capture) {
+  MappedFile file;
+  if (!file.open(path))
+    return false;
+
+  const byte *p = file.data();
+  const byte *end = p + file.size();
+  begin(capture);
+  while (p < end) {
+    const byte *next;
+    if (*p == SYSEX) {
+      next = (const byte *)memchr(p, EOX, end - p);
+      next = next == nullptr ? end : next + 1;
+    }
+    else {
+      next = (const byte *)memchr(p, SYSEX, end - p);
+      if (next == nullptr)
+        next = end;
+    }
+    if (!add(capture, p, next - p))
+      return false;
+    p = next;
+  }
+  return finish(capture, name);
+}
+
+/*
+ * Copies each extent straight out of a mapping of the pack, hashing as it
+ * goes to catch a damaged store.
+ */
+bool CaptureStore::extract(const char *name, const char *path) {
+  ManifestHeader header;
+  std::vector<PackExtent> extents;
+
+  if (!flush() || !read_manifest(name, header, &extents))
+    return false;
+
+  MappedFile pack;
+  if (!pack.open((dir + "/" CAPTURE_PACK_FILE).c_str()))
+    return false;
+
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    perror(path);
+    return false;
+  }
+  uint64_t hash = CAPTURE_HASH_START, size = 0;
+  bool ok = true;
+  for (const PackExtent &extent : extents) {
+    if (extent.offset + extent.length > pack.size()) {
+      fprintf(stderr, "# capture %s refers past the end of the store\n", name);
+      ok = false;
+      break;
+    }
+    const byte *bytes = pack.data() + extent.offset;
+    if (!write_all(fd, bytes, extent.length, path)) {
+      ok = false;
+      break;
+    }
+    hash = capture_hash(hash, bytes, extent.length);
+    size += extent.length;
+  }
+  ::close(fd);
+  if (ok && (size != header.size || hash != header.hash)) {
+    fprintf(stderr, "# capture %s doesn't match its checksum\n", name);
+    ok = false;
+  }
+  return ok;
+}
+
+bool CaptureStore::list(std::vector<CaptureInfo> &captures) {
+  std::string manifest_dir = dir + "/" CAPTURE_MANIFEST_DIR;
+  DIR *d = opendir(manifest_dir.c_str());
+  if (d == nullptr) {
+    perror(manifest_dir.c_str());
+    return false;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(d)) != nullptr) {
+    CaptureInfo info;
+    if (!valid_name(entry->d_name))
+      continue;
+    size_t len = strlen(entry->d_name);
+    if (len > 4 && strcmp(&entry->d_name[len - 4], ".tmp") == 0)
+      continue;
+    info.name = entry->d_name;
+    if (read_manifest(entry->d_name, info.header, nullptr))
+      captures.push_back(info);
+  }
+  closedir(d);
+
+  std::sort(captures.begin(), captures.end(),
+            [](const CaptureInfo &a, const CaptureInfo &b) { return a.name < b.name; });
+  return true;
+}
+
+bool CaptureStore::read_manifest(const char *name, ManifestHeader &header,
+                                 std::vector<PackExtent> *extents)
+{
+  std::string path = manifest_path(name);
+  FILE *fp = fopen(path.c_str(), "r");
+  if (fp == nullptr) {
+    if (errno == ENOENT)
+      fprintf(stderr, "# no capture named %s\n", name);
+    else
+      perror(path.c_str());
+    return false;
+  }
+
+  bool ok = fread(&header, sizeof(header), 1, fp) == 1
+    && memcmp(header.magic, CAPTURE_MANIFEST_MAGIC, sizeof(header.magic)) == 0
+    && header.version == CAPTURE_MANIFEST_VERSION;
+  if (ok && extents != nullptr) {
+    extents->resize(header.num_extents);
+    ok = header.num_extents == 0
+      || fread(extents->data(), sizeof(PackExtent), header.num_extents, fp) == header.num_extents;
+  }
+  fclose(fp);
+  if (!ok)
+    fprintf(stderr, "# %s is not a capture manifest\n", path.c_str());
+  return ok;
+}
+
+std::string CaptureStore::manifest_path(const char *name) const {
+  return dir + "/" CAPTURE_MANIFEST_DIR "/" + name;
+}
+
+bool CaptureStore::valid_name(const char *name) {
+  return name[0] != 0 && name[0] != '.' && strchr(name, '/') == nullptr;
+}
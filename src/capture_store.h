@@ -0,0 +1,134 @@
+#ifndef CAPTURE_STORE_H
+#define CAPTURE_STORE_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+typedef unsigned char byte;
+
+#define CAPTURE_PACK_FILE "objects.pack"
+#define CAPTURE_INDEX_FILE "objects.idx"
+#define CAPTURE_MANIFEST_DIR "captures"
+#define CAPTURE_MANIFEST_MAGIC "PMCS"
+#define CAPTURE_MANIFEST_VERSION 1
+// New objects are collected and appended to the pack this much at a time
+#define CAPTURE_PACK_BUFSIZ (256 * 1024)
+
+// 64-bit FNV-1a, continuing from `hash`. Start with CAPTURE_HASH_START.
+#define CAPTURE_HASH_START 0xcbf29ce484222325ULL
+uint64_t capture_hash(uint64_t hash, const byte *bytes, size_t n);
+
+// An object in the pack file. Stored in the index file as is.
+typedef struct StoredObject {
+  uint64_t hash;
+  uint64_t offset;
+  uint64_t length;
+} StoredObject;
+
+// A run of bytes in the pack file. Manifests are lists of these.
+typedef struct PackExtent {
+  uint64_t offset;
+  uint64_t length;
+} PackExtent;
+
+// Starts a manifest file, followed by its extents
+typedef struct ManifestHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t size;                // of the capture
+  uint64_t messages;
+  uint64_t hash;                // capture_hash of the whole capture
+  uint64_t num_extents;
+} ManifestHeader;
+
+// A capture being added to the store
+typedef struct Capture {
+  std::vector<PackExtent> extents;
+  uint64_t size;
+  uint64_t messages;
+  uint64_t hash;
+  uint64_t new_messages;        // not already in the store
+  uint64_t new_bytes;
+} Capture;
+
+typedef struct CaptureInfo {
+  std::string name;
+  ManifestHeader header;
+} CaptureInfo;
+
+/*
+ * Stores captured sysex by content, so that captures holding the same
+ * messages share storage, as nightly backups of the same devices mostly
+ * do. The store is a directory holding
+ *
+ *   objects.pack     every distinct message, back to back
+ *   objects.idx      a StoredObject for each, in pack order
+ *   captures/NAME    a ManifestHeader and the PackExtents making up NAME
+ *
+ * Messages are looked up by hash, and a match is only used if its bytes
+ * are the same, so a hash collision costs a comparison and never data.
+ * Extents that follow on from each other in the pack are merged, so a
+ * capture that repeats an earlier one in full, or is all new, takes one
+ * extent, and extracting it is a single copy out of the pack.
+ *
+ * Files added with `import` are split into sysex messages, and any bytes
+ * between them are stored as objects of their own, so every capture
+ * comes back exactly as it went in.
+ */
+class CaptureStore {
+public:
+  CaptureStore();
+  ~CaptureStore();
+
+  // Opens the store in `dir`, creating it if it doesn't exist. Prints an
+  // error and returns false on failure.
+  bool open(const char *dir);
+  bool is_open() const { return pack_fd >= 0; }
+  void close();
+
+  void begin(Capture &capture);
+  // Adds a message, or any other run of bytes, to `capture`
+  bool add(Capture &capture, const byte *bytes, size_t n);
+  // Saves the manifest of `capture` as `name`, replacing any capture
+  // already using it
+  bool finish(Capture &capture, const char *name);
+
+  // Adds the file at `path` as capture `name`
+  bool import(const char *name, const char *path, Capture &capture);
+  // Writes capture `name` to `path`, checking its hash
+  bool extract(const char *name, const char *path);
+  // Reads the manifest headers of all captures, sorted by name
+  bool list(std::vector<CaptureInfo> &captures);
+  // Bytes of distinct messages stored
+  uint64_t stored_bytes() const { return pack_size; }
+  uint64_t stored_objects() const { return objects.size(); }
+
+  // Capture names must be usable as file names
+  static bool valid_name(const char *name);
+
+private:
+  std::string dir;
+  int pack_fd;
+  int index_fd;
+  uint64_t pack_size;           // including `pending`
+  std::vector<StoredObject> objects;
+  std::unordered_multimap<uint64_t, size_t> by_hash; // index into objects
+  std::vector<byte> pending;    // new objects not yet written to the pack
+  size_t pending_objects;       // the last this many of `objects`
+  std::vector<byte> scratch;
+
+  bool load_index();
+  long find_object(uint64_t hash, const byte *bytes, size_t n);
+  bool same_bytes(const StoredObject &object, const byte *bytes, size_t n);
+  bool flush();
+  void forget_objects(size_t first, uint64_t offset);
+  bool read_manifest(const char *name, ManifestHeader &header, std::vector<PackExtent> *extents);
+  std::string manifest_path(const char *name) const;
+
+  CaptureStore(const CaptureStore &);
+  CaptureStore &operator=(const CaptureStore &);
+};
+
+#endif /* CAPTURE_STORE_H */
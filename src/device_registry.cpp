@@ -0,0 +1,147 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/inotify.h>
+#endif
+#include "device_registry.h"
+#include "porttime.h"
+
+static std::string lower_case(const std::string &str) {
+  std::string lower(str);
+  for (char &c : lower)
+    c = tolower((unsigned char)c);
+  return lower;
+}
+
+static bool has_direction(const Device &device, bool input) {
+  return input ? device.input : device.output;
+}
+
+DeviceRegistry::DeviceRegistry(MidiBackend *midi) : midi(midi), watch_fd(-1) {
+  refresh();
+}
+
+DeviceRegistry::~DeviceRegistry() {
+  if (watch_fd >= 0)
+    close(watch_fd);
+}
+
+void DeviceRegistry::refresh() {
+  int num_devices = midi->count_devices();
+
+  devices.clear();
+  by_name.clear();
+  for (int i = 0; i < num_devices; ++i) {
+    const PmDeviceInfo *info = midi->device_info(i);
+    if (info == nullptr)
+      continue;
+    Device device = {i, info->name, info->interf ? info->interf : "",
+                     info->input != 0, info->output != 0};
+    by_name.insert(std::make_pair(lower_case(device.name), (int)devices.size()));
+    devices.push_back(device);
+  }
+}
+
+const Device *DeviceRegistry::device(int id) const {
+  for (const Device &device : devices)
+    if (device.id == id)
+      return &device;
+  return nullptr;
+}
+
+int DeviceRegistry::find(const char *name, bool input) const {
+  if (isdigit(name[0]))
+    return atoi(name);
+
+  auto alias = aliases.find(name);
+  std::string key = lower_case(alias == aliases.end() ? name : alias->second);
+  std::vector<int> matches;
+
+  auto range = by_name.equal_range(key);
+  for (auto iter = range.first; iter != range.second; ++iter)
+    if (has_direction(devices[iter->second], input))
+      matches.push_back(devices[iter->second].id);
+  if (!matches.empty())
+    return pick(matches);
+
+  // Names sharing a prefix sort together
+  for (auto iter = by_name.lower_bound(key);
+       iter != by_name.end() && iter->first.compare(0, key.size(), key) == 0; ++iter)
+    if (has_direction(devices[iter->second], input))
+      matches.push_back(devices[iter->second].id);
+  if (!matches.empty())
+    return pick(matches);
+
+  for (auto &entry : by_name)
+    if (entry.first.find(key) != std::string::npos && has_direction(devices[entry.second], input))
+      matches.push_back(devices[entry.second].id);
+  return matches.empty() ? DEVICE_NOT_FOUND : pick(matches);
+}
+
+int DeviceRegistry::find_exact(const std::string &name, bool input) const {
+  for (const Device &device : devices)
+    if (device.name == name && has_direction(device, input))
+      return device.id;
+  return DEVICE_NOT_FOUND;
+}
+
+std::string DeviceRegistry::aliases_for(int device, bool input) const {
+  std::string names;
+
+  for (auto &alias : aliases) {
+    if (find(alias.first.c_str(), input) != device)
+      continue;
+    if (!names.empty())
+      names += ',';
+    names += alias.first;
+  }
+  return names;
+}
+
+int DeviceRegistry::pick(const std::vector<int> &matches) const {
+  return matches.size() == 1 ? matches[0] : DEVICE_AMBIGUOUS;
+}
+
+// Only Linux is watched; elsewhere use "d rescan"
+bool DeviceRegistry::watch_hotplug(const char *dir) {
+#if defined(__linux__)
+  watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch_fd < 0)
+    return false;
+  if (inotify_add_watch(watch_fd, dir, IN_CREATE | IN_DELETE) < 0) {
+    close(watch_fd);
+    watch_fd = -1;
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool DeviceRegistry::hotplug_seen() {
+  if (watch_fd < 0 || !drain_hotplug())
+    return false;
+
+  // A device's nodes appear one at a time, and the MIDI system notices
+  // them a little after that
+  do {
+    Pt_Sleep(HOTPLUG_SETTLE_MILLISECS);
+  } while (drain_hotplug());
+  return true;
+}
+
+// Reads and discards all pending events. Returns true if there were any.
+bool DeviceRegistry::drain_hotplug() {
+#if defined(__linux__)
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool seen = false;
+
+  while (read(watch_fd, buf, sizeof(buf)) > 0)
+    seen = true;
+  return seen;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,82 @@
+#ifndef DEVICE_REGISTRY_H
+#define DEVICE_REGISTRY_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "midi_backend.h"
+
+// What DeviceRegistry::find returns when it can't pick a device
+#define DEVICE_NOT_FOUND -1
+#define DEVICE_AMBIGUOUS -2
+
+// Where device nodes come and go when MIDI hardware is plugged in
+#define HOTPLUG_WATCH_DIR "/dev/snd"
+// How long to let the system finish adding or removing a device
+#define HOTPLUG_SETTLE_MILLISECS 500
+
+typedef struct Device {
+  int id;                       // the backend's device number
+  std::string name;
+  std::string interf;
+  bool input;
+  bool output;
+} Device;
+
+/*
+ * The backend's devices, read once and again after a rescan instead of on
+ * every lookup, indexed by lower-cased name for exact and prefix matches.
+ *
+ * Aliases map short names of your own to device names. They refer to
+ * devices by name, not number, so they keep working when a rescan
+ * renumbers the devices.
+ *
+ * On Linux it can also watch for devices being plugged in and unplugged.
+ */
+class DeviceRegistry {
+public:
+  DeviceRegistry(MidiBackend *midi);
+  ~DeviceRegistry();
+
+  // Rereads the device list. Call after the backend rescans.
+  void refresh();
+  const std::vector<Device> &all() const { return devices; }
+  // Returns the device with number `id`, or nullptr
+  const Device *device(int id) const;
+
+  // Finds an input or output by device number, alias, or name. Names
+  // match ignoring case, first exactly, then as a prefix, then anywhere
+  // in the device name. Returns its device number, or DEVICE_NOT_FOUND
+  // or DEVICE_AMBIGUOUS if no single device matches at the first level
+  // that matches any.
+  int find(const char *name, bool input) const;
+  // Finds the input or output with exactly this name, or DEVICE_NOT_FOUND
+  int find_exact(const std::string &name, bool input) const;
+
+  void add_alias(const std::string &alias, const std::string &name) { aliases[alias] = name; }
+  bool remove_alias(const std::string &alias) { return aliases.erase(alias) > 0; }
+  const std::map<std::string, std::string> &all_aliases() const { return aliases; }
+  // The aliases that find `device`, comma-separated
+  std::string aliases_for(int device, bool input) const;
+
+  // Starts watching for hotplug, by watching `dir` for device nodes
+  // coming and going. Returns false if that isn't possible.
+  bool watch_hotplug(const char *dir = HOTPLUG_WATCH_DIR);
+  // A descriptor that's readable when devices may have changed, or -1
+  int hotplug_fd() const { return watch_fd; }
+  // Returns true if devices were plugged in or unplugged since the last
+  // call, after giving the system time to finish setting them up
+  bool hotplug_seen();
+
+private:
+  MidiBackend *midi;
+  std::vector<Device> devices;
+  std::multimap<std::string, int> by_name; // lower-cased name to index in devices
+  std::map<std::string, std::string> aliases;
+  int watch_fd;
+
+  int pick(const std::vector<int> &matches) const;
+  bool drain_hotplug();
+};
+
+#endif /* DEVICE_REGISTRY_H */
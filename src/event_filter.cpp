@@ -0,0 +1,220 @@
+#include <iostream>
+#include <string>
+#include <stdlib.h>
+#include <string.h>
+#include "consts.h"
+#include "event_filter.h"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+
+#define PM_FILT_START (1 << 0x0A)
+#define PM_FILT_CONTINUE (1 << 0x0B)
+#define PM_FILT_STOP (1 << 0x0C)
+
+// Names match the monitor's. Groups come after the single types so that
+// printing prefers the single names.
+static const struct {
+  const char *name;
+  int32_t bits;
+} FILTER_TYPE_NAMES[] = {
+  {"note", PM_FILT_NOTE},
+  {"ppress", PM_FILT_POLY_AFTERTOUCH},
+  {"cntrl", PM_FILT_CONTROL},
+  {"pchg", PM_FILT_PROGRAM},
+  {"cpress", PM_FILT_CHANNEL_AFTERTOUCH},
+  {"pbend", PM_FILT_PITCHBEND},
+  {"sysex", PM_FILT_SYSEX},
+  {"mtc", PM_FILT_MTC},
+  {"songptr", PM_FILT_SONG_POSITION},
+  {"songsel", PM_FILT_SONG_SELECT},
+  {"tunereq", PM_FILT_TUNE},
+  {"clock", PM_FILT_CLOCK},
+  {"tick", PM_FILT_TICK},
+  {"start", PM_FILT_START},
+  {"cont", PM_FILT_CONTINUE},
+  {"stop", PM_FILT_STOP},
+  {"asense", PM_FILT_ACTIVE},
+  {"reset", PM_FILT_RESET},
+  {"common", PM_FILT_SYSTEMCOMMON},
+  {"realtime", PM_FILT_REALTIME & ~PM_FILT_SYSEX},
+  {nullptr, 0}
+};
+
+// PortMidi's filter has one bit per status high nibble for channel
+// messages and one per status for system messages
+static int32_t pm_filter_bit(byte status) {
+  if (status >= SYSEX)
+    return 1 << (status & 0x0f);
+  return 1 << (0x10 + (status >> 4));
+}
+
+void EventFilter::clear() {
+  drop_types = PM_FILT_ACTIVE;
+  channel_mask = 0xffff;
+  for (int i = 0; i < 128; ++i)
+    controllers[i] = true;
+  low_note = 0;
+  high_note = 127;
+  compile();
+}
+
+void EventFilter::set_controllers(const bool *keep) {
+  memcpy(controllers, keep, sizeof(controllers));
+}
+
+void EventFilter::compile() {
+  bool all_controllers = true;
+
+  for (int i = 0; i < 128; ++i) {
+    data1_keep[0][i] = i >= low_note && i <= high_note;
+    data1_keep[1][i] = controllers[i];
+    all_controllers = all_controllers && controllers[i];
+  }
+  bool all_notes = low_note == 0 && high_note == 127;
+
+  keep_all = true;
+  for (int status = 0; status < 256; ++status) {
+    byte action;
+    int high_nibble = status & 0xf0;
+
+    if (status < NOTE_OFF)      // sysex continuation
+      action = (drop_types & PM_FILT_SYSEX) ? FILTER_DROP : FILTER_KEEP;
+    else if (drop_types & pm_filter_bit(status))
+      action = FILTER_DROP;
+    else if (status >= SYSEX)
+      action = FILTER_KEEP;
+    else if ((channel_mask & Pm_Channel(status & 0x0f)) == 0)
+      action = FILTER_DROP;
+    else if (!all_notes
+             && (high_nibble == NOTE_OFF || high_nibble == NOTE_ON || high_nibble == POLY_PRESSURE))
+      action = FILTER_CHECK_NOTE;
+    else if (!all_controllers && high_nibble == CONTROLLER)
+      action = FILTER_CHECK_CC;
+    else
+      action = FILTER_KEEP;
+
+    status_actions[status] = action;
+    if (action != FILTER_KEEP)
+      keep_all = false;
+  }
+}
+
+int EventFilter::apply(PmEvent *events, int num_events, int *port_ids) const {
+  int num_kept = 0;
+
+  for (int i = 0; i < num_events; ++i) {
+    if (!keep(events[i].message))
+      continue;
+    events[num_kept] = events[i];
+    if (port_ids != nullptr)
+      port_ids[num_kept] = port_ids[i];
+    ++num_kept;
+  }
+  return num_kept;
+}
+
+// Prints `set` (indexed from `min`) as a list like "1-4,10"
+static void print_number_list(const bool *set, int min, int max) {
+  bool first = true;
+
+  for (int i = min; i <= max; ++i) {
+    if (!set[i - min])
+      continue;
+    int end = i;
+    while (end < max && set[end + 1 - min])
+      ++end;
+    cout << (first ? "" : ",") << i;
+    if (end > i)
+      cout << '-' << end;
+    first = false;
+    i = end;
+  }
+}
+
+void EventFilter::print() const {
+  int32_t remaining = drop_types;
+  bool channels[MIDI_CHANNELS];
+  bool first = true;
+
+  cout << "filter drop ";
+  for (int i = 0; FILTER_TYPE_NAMES[i].name != nullptr && remaining != 0; ++i) {
+    int32_t bits = FILTER_TYPE_NAMES[i].bits;
+    if ((remaining & bits) == bits) {
+      cout << (first ? "" : ",") << FILTER_TYPE_NAMES[i].name;
+      remaining &= ~bits;
+      first = false;
+    }
+  }
+  if (first)
+    cout << "none";
+
+  for (int i = 0; i < MIDI_CHANNELS; ++i)
+    channels[i] = (channel_mask & Pm_Channel(i)) != 0;
+  cout << " channels ";
+  print_number_list(channels, 1, MIDI_CHANNELS);
+  cout << " cc ";
+  print_number_list(controllers, 0, 127);
+  cout << " notes " << low_note << '-' << high_note << endl;
+}
+
+bool parse_filter_types(const char *names, int32_t *bits) {
+  *bits = 0;
+  if (strcmp(names, "none") == 0)
+    return true;
+
+  while (*names) {
+    size_t len = strcspn(names, ",");
+    int i;
+    for (i = 0; FILTER_TYPE_NAMES[i].name != nullptr; ++i) {
+      if (strlen(FILTER_TYPE_NAMES[i].name) == len
+          && strncmp(FILTER_TYPE_NAMES[i].name, names, len) == 0)
+        break;
+    }
+    if (FILTER_TYPE_NAMES[i].name == nullptr) {
+      cerr << "# unknown message type " << std::string(names, len) << endl;
+      return false;
+    }
+    *bits |= FILTER_TYPE_NAMES[i].bits;
+    names += len;
+    if (*names == ',')
+      ++names;
+  }
+  return true;
+}
+
+bool parse_number_list(const char *list, int min, int max, bool *set) {
+  const char *p = list;
+
+  for (int i = min; i <= max; ++i)
+    set[i - min] = false;
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p)
+      break;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p)
+        break;
+    }
+    if (first < min || last > max || first > last)
+      break;
+    for (long i = first; i <= last; ++i)
+      set[i - min] = true;
+    p = end;
+    if (*p == ',')
+      ++p;
+    else if (*p != 0)
+      break;
+  }
+  if (*p != 0 || p == list) {
+    cerr << "# bad list " << list << ", expected numbers or ranges from "
+         << min << " to " << max << " like 1-4,10" << endl;
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,79 @@
+#ifndef EVENT_FILTER_H
+#define EVENT_FILTER_H
+
+#include <stdint.h>
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+// What EventFilter does with each status byte
+#define FILTER_DROP 0
+#define FILTER_KEEP 1
+#define FILTER_CHECK_NOTE 2     // keep if data1 is in the note range
+#define FILTER_CHECK_CC 3       // keep if data1 is a wanted controller
+
+// Decides which input events to keep. Message types and channels are
+// handed to PortMidi (Pm_SetFilter and Pm_SetChannelMask) so that
+// unwanted traffic is dropped before it is queued at all. Criteria
+// PortMidi can't handle, controller numbers and note ranges, are compiled
+// into lookup tables so that checking an event costs two table lookups.
+// The tables cover the types and channels too, for events that were
+// queued before the filter changed.
+class EventFilter {
+public:
+  EventFilter() { clear(); }
+
+  // Back to PortMidi's default, which drops only active sensing
+  void clear();
+
+  // Criteria. Call `compile` after changing them.
+  // `pm_filter_bits` are PM_FILT_* bits of message types to drop.
+  void set_drop_types(int32_t pm_filter_bits) { drop_types = pm_filter_bits; }
+  // Bit per channel, as made by Pm_Channel
+  void set_channels(int mask) { channel_mask = mask; }
+  // `keep` has 128 entries
+  void set_controllers(const bool *keep);
+  void set_note_range(int low, int high) { low_note = low; high_note = high; }
+  void compile();
+
+  int32_t pm_filter() const { return drop_types; }
+  int pm_channel_mask() const { return channel_mask; }
+  bool keeps_everything() const { return keep_all; }
+
+  bool keep(PmMessage msg) const {
+    byte action = status_actions[Pm_MessageStatus(msg)];
+    if (action < FILTER_CHECK_NOTE)
+      return action == FILTER_KEEP;
+    return data1_keep[action - FILTER_CHECK_NOTE][Pm_MessageData1(msg) & 0x7f];
+  }
+
+  // Removes unwanted events from `events`, moving `port_ids` (if not
+  // null) along with them, and returns the number left
+  int apply(PmEvent *events, int num_events, int *port_ids) const;
+
+  // Prints the criteria as a filter command would take them
+  void print() const;
+
+private:
+  int32_t drop_types;
+  int channel_mask;
+  bool controllers[128];
+  int low_note;
+  int high_note;
+
+  bool keep_all;
+  byte status_actions[256];
+  bool data1_keep[2][128];      // notes, controllers
+};
+
+// Parses a comma-separated list of message type names ("clock,asense") into
+// PM_FILT_* bits. "none" is no types. Returns false and prints an error
+// for unknown names.
+bool parse_filter_types(const char *names, int32_t *bits);
+
+// Parses a comma-separated list of numbers and ranges ("1-4,10") between
+// `min` and `max` into `set`, which is indexed from `min`. Returns false
+// and prints an error if the list is malformed or out of range.
+bool parse_number_list(const char *list, int min, int max, bool *set);
+
+#endif /* EVENT_FILTER_H */
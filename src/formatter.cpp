@@ -0,0 +1,168 @@
+#include <string.h>
+#include "formatter.h"
+
+#define FORMATTER_BUFSIZ (64 * 1024)
+#define FLUSH_INTERVAL_MILLISECS 20
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static const char * NOTE_NAMES[] = {
+  "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
+};
+
+// "C-1" through "G9", built once
+static struct NoteNameTable {
+  char names[128][5];
+
+  NoteNameTable() {
+    for (int num = 0; num < 128; ++num)
+      snprintf(names[num], 5, "%s%d", NOTE_NAMES[num % 12], (num / 12) - 1);
+  }
+} note_name_table;
+
+Formatter::Formatter(FILE *out)
+  : out(out), buf(new char[FORMATTER_BUFSIZ]), capacity(FORMATTER_BUFSIZ),
+    used(0), last_flush(steady_clock::now())
+{
+}
+
+Formatter::~Formatter() {
+  flush();
+  delete[] buf;
+}
+
+void Formatter::put(const char *str) {
+  while (*str)
+    put(*str++);
+}
+
+void Formatter::put_uint(unsigned int n) {
+  char digits[10];
+  int i = 0;
+
+  do {
+    digits[i++] = '0' + (n % 10);
+    n /= 10;
+  } while (n > 0);
+  while (i > 0)
+    put(digits[--i]);
+}
+
+void Formatter::put_hex_byte(byte b) {
+  put(HEX_DIGITS[b >> 4]);
+  put(HEX_DIGITS[b & 0x0f]);
+}
+
+void Formatter::put_note_name(int note_num) {
+  put(note_name_table.names[note_num & 0x7f]);
+}
+
+void Formatter::note(const char * const name, PmMessage msg) {
+  put(name);
+  put("\tch ");
+  put_uint((Pm_MessageStatus(msg) & 0x0f) + 1);
+  put('\t');
+  put_note_name(Pm_MessageData1(msg));
+  put('\t');
+  put_uint(Pm_MessageData2(msg));
+  put('\n');
+}
+
+void Formatter::three_byte_chan(const char * const name, PmMessage msg) {
+  put(name);
+  put("\tch ");
+  put_uint((Pm_MessageStatus(msg) & 0x0f) + 1);
+  put('\t');
+  put_uint(Pm_MessageData1(msg));
+  put('\t');
+  put_uint(Pm_MessageData2(msg));
+  put('\n');
+}
+
+void Formatter::two_byte(const char * const name, PmMessage msg) {
+  put(name);
+  put("\tch ");
+  put_uint((Pm_MessageStatus(msg) & 0x0f) + 1);
+  put('\t');
+  put_uint(Pm_MessageData1(msg));
+  put('\n');
+}
+
+void Formatter::four_bytes(PmMessage msg) {
+  put(' ');
+  for (int i = 0; i < 4; ++i) {
+    put(' ');
+    put_hex_byte((msg >> (i * 8)) & 0xff);
+  }
+  put('\n');
+}
+
+// {"time":1234,"type":"on","bytes":[144,60,127]}
+void Formatter::json_event(PmTimestamp timestamp, const char * const type,
+                           const byte *bytes, int num_bytes)
+{
+  put("{\"time\":");
+  put_uint((unsigned int)timestamp);
+  put(",\"type\":\"");
+  put(type);
+  put("\",\"bytes\":[");
+  for (int i = 0; i < num_bytes; ++i) {
+    if (i > 0)
+      put(',');
+    put_uint(bytes[i]);
+  }
+  put("]}\n");
+}
+
+// Timestamp then message, each 32 bits little-endian. The message's status
+// is its low byte, as in PmMessage.
+void Formatter::binary_event(const PmEvent &event) {
+  unsigned int timestamp = (unsigned int)event.timestamp;
+  unsigned int message = (unsigned int)event.message;
+
+  for (int i = 0; i < 32; i += 8)
+    put((char)((timestamp >> i) & 0xff));
+  for (int i = 0; i < 32; i += 8)
+    put((char)((message >> i) & 0xff));
+}
+
+void Formatter::hexdump_line(size_t offset, const byte *bytes, int num_bytes) {
+  for (int shift = 28; shift >= 0; shift -= 4)
+    put(HEX_DIGITS[(offset >> shift) & 0x0f]);
+  put(':');
+  for (int i = 0; i < num_bytes; ++i) {
+    if (i == 8)
+      put("  ");
+    put(' ');
+    put_hex_byte(bytes[i]);
+  }
+  put("  ");
+  for (int i = 0; i < num_bytes; ++i) {
+    if (i == 8)
+      put("  ");
+    byte b = bytes[i];
+    put((b >= 32 && b <= 127) ? (char)b : '.');
+  }
+  put('\n');
+}
+
+void Formatter::flush() {
+  if (out == nullptr)
+    return;
+  if (used > 0) {
+    fwrite(buf, 1, used, out);
+    used = 0;
+  }
+  fflush(out);
+  last_flush = steady_clock::now();
+}
+
+void Formatter::flush_if_due(bool caught_up) {
+  if (used == 0)
+    return;
+  if (caught_up || steady_clock::now() - last_flush >= milliseconds(FLUSH_INTERVAL_MILLISECS))
+    flush();
+}
@@ -0,0 +1,70 @@
+#ifndef FORMATTER_H
+#define FORMATTER_H
+
+#include <chrono>
+#include <stdio.h>
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+// Renders monitor and sysex dump text into a reusable buffer and writes it
+// out in large pieces, instead of flushing the stream after every line.
+//
+// With a null `out` nothing is written: text stays in the buffer, where
+// `data` and `size` find it, until `clear`. Text past the end of the
+// buffer is lost.
+class Formatter {
+public:
+  Formatter(FILE *out);
+  ~Formatter();
+
+  void put(char c) {
+    if (used == capacity) {
+      flush();
+      if (used == capacity)
+        return;
+    }
+    buf[used++] = c;
+  }
+  void put(const char *str);
+  void put_uint(unsigned int n);
+  void put_hex_byte(byte b);
+  void put_note_name(int note_num);
+
+  // Monitor lines
+  void note(const char * const name, PmMessage msg);
+  void three_byte_chan(const char * const name, PmMessage msg);
+  void two_byte(const char * const name, PmMessage msg);
+  void four_bytes(PmMessage msg);
+  void line(const char * const text) { put(text); put('\n'); }
+
+  // Machine-readable records
+  void json_event(PmTimestamp timestamp, const char * const type,
+                  const byte *bytes, int num_bytes);
+  void binary_event(const PmEvent &event);
+
+  // One hexdump line of up to 16 bytes
+  void hexdump_line(size_t offset, const byte *bytes, int num_bytes);
+
+  const char *data() const { return buf; }
+  size_t size() const { return used; }
+  void clear() { used = 0; }
+
+  // Writes everything buffered so far
+  void flush();
+  // Flushes if `caught_up` (there is no more input waiting) or if it has
+  // been a while since the last flush
+  void flush_if_due(bool caught_up);
+
+private:
+  FILE *out;
+  char *buf;
+  size_t capacity;
+  size_t used;
+  std::chrono::steady_clock::time_point last_flush;
+
+  Formatter(const Formatter &);
+  Formatter &operator=(const Formatter &);
+};
+
+#endif /* FORMATTER_H */
@@ -0,0 +1,253 @@
+#include "hex.h"
+
+// SSE2 is always there on x86-64. SSSE3 is checked for at run time.
+#if defined(__SSE2__) && defined(__GNUC__)
+#define HEX_SIMD
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+// Character classes. Anything above 0x0f is not a hex digit.
+#define HEX_SPACE 0xfe
+#define HEX_COMMENT 0xfd
+#define NOT_HEX 0xff
+
+// Bytes of room hex_decode_buffer starts with, doubled as needed
+#define HEX_FIRST_ROOM 256
+
+// Nibble value of each character, or its class
+static const byte HEX_VALUES[256] = {
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfe, 0xfe, 0xff, 0xff, 0xfe, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xfe, 0xff, 0xff, 0xfd, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+#define is_nibble(v) ((v) <= 0x0f)
+
+#if defined(HEX_SIMD)
+
+static const bool HAVE_SSSE3 = __builtin_cpu_supports("ssse3");
+
+/*
+ * Converts 16 hex digit characters to nibbles. Clears bits in
+ * `*valid_mask` for any that aren't hex digits.
+ */
+static inline __m128i hex_nibbles(__m128i c, int *valid_mask) {
+  __m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+  __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+                                   _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+  __m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                   _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+  *valid_mask &= _mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha));
+
+  __m128i digits = _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0')));
+  __m128i alphas = _mm_and_si128(is_alpha, _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10)));
+  return _mm_or_si128(digits, alphas);
+}
+
+/*
+ * Decodes 32 run-together hex digits into 16 bytes. Returns false without
+ * storing anything if any of them isn't a hex digit, so that the scalar
+ * code can find and report it.
+ */
+static inline bool decode_32_digits(const char *src, byte *out) {
+  int valid = 0xffff;
+  __m128i words[2];
+
+  for (int i = 0; i < 2; ++i) {
+    __m128i nibbles = hex_nibbles(_mm_loadu_si128((const __m128i *)(src + i * 16)), &valid);
+    // Each 16-bit lane holds a high nibble in its low byte and a low
+    // nibble in its high byte. Combine them into the lane's low byte.
+    words[i] = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(nibbles, 4), _mm_set1_epi16(0x00f0)),
+                            _mm_srli_epi16(nibbles, 8));
+  }
+  if (valid != 0xffff)
+    return false;
+  _mm_storeu_si128((__m128i *)out, _mm_packus_epi16(words[0], words[1]));
+  return true;
+}
+
+/*
+ * Decodes 48 characters of the usual "hh hh hh ..." layout (16 two-digit
+ * words, each followed by whitespace) into 16 bytes. Returns false without
+ * storing anything if the characters aren't laid out that way.
+ */
+__attribute__((target("ssse3")))
+static bool decode_16_spaced_words(const char *src, byte *out) {
+  __m128i a = _mm_loadu_si128((const __m128i *)src);
+  __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+  __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+
+  // Word k's high digit is at 3k, its low digit at 3k + 1, and the space
+  // after it at 3k + 2. Gather each into lane k; -1 zeroes a lane.
+  __m128i high = _mm_or_si128(
+    _mm_or_si128(_mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                 _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+    _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+  __m128i low = _mm_or_si128(
+    _mm_or_si128(_mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                 _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+    _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+  __m128i space = _mm_or_si128(
+    _mm_or_si128(_mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+                 _mm_shuffle_epi8(b, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+    _mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+
+  int valid = _mm_movemask_epi8(
+    _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(space, _mm_set1_epi8(' ')),
+                              _mm_cmpeq_epi8(space, _mm_set1_epi8('\n'))),
+                 _mm_or_si128(_mm_cmpeq_epi8(space, _mm_set1_epi8('\t')),
+                              _mm_cmpeq_epi8(space, _mm_set1_epi8('\r')))));
+  __m128i high_nibbles = hex_nibbles(high, &valid);
+  __m128i low_nibbles = hex_nibbles(low, &valid);
+  if (valid != 0xffff)
+    return false;
+
+  // Nibbles are at most 0x0f so shifting 16-bit lanes can't carry between
+  // bytes
+  _mm_storeu_si128((__m128i *)out, _mm_or_si128(_mm_slli_epi16(high_nibbles, 4), low_nibbles));
+  return true;
+}
+
+#endif
+
+HexStatus hex_decode_word(const char *word, size_t len, byte *out, size_t *num_out) {
+  *num_out = 0;
+  if (len == 0)
+    return HEX_OK;
+
+  if (len == 1) {
+    byte nibble = HEX_VALUES[(byte)word[0]];
+    if (!is_nibble(nibble))
+      return HEX_BAD_DIGIT;
+    out[0] = nibble;
+    *num_out = 1;
+    return HEX_OK;
+  }
+
+  const char *p = word;
+  const char *end = word + (len & ~(size_t)1);
+  byte *q = out;
+
+#if defined(HEX_SIMD)
+  while (end - p >= 32 && decode_32_digits(p, q)) {
+    p += 32;
+    q += 16;
+  }
+#endif
+
+  for (; p < end; p += 2) {
+    byte high = HEX_VALUES[(byte)p[0]];
+    byte low = HEX_VALUES[(byte)p[1]];
+    if ((high | low) & 0xf0) {    // either is not a digit
+      *num_out = q - out;
+      return HEX_BAD_DIGIT;
+    }
+    *q++ = (byte)((high << 4) | low);
+  }
+  *num_out = q - out;
+  if (len & 1)
+    return is_nibble(HEX_VALUES[(byte)word[len - 1]]) ? HEX_ODD_DIGITS : HEX_BAD_DIGIT;
+  return HEX_OK;
+}
+
+HexResult hex_decode_buffer(const char *buf, size_t len, std::vector<byte> &bytes) {
+  HexResult result = {HEX_OK, len, len};
+  size_t old_size = bytes.size();
+  size_t num_bytes = 0;
+  size_t i = 0;
+
+  // Room grows with what's decoded rather than starting at len / 2 + 1,
+  // the most `buf` could hold, since callers that stop at every delay or
+  // other non-hex word would otherwise clear that much each time.
+  size_t room = HEX_FIRST_ROOM;
+  bytes.resize(old_size + room);
+  byte *out = bytes.data() + old_size;
+  auto make_room = [&](size_t n) {
+    if (num_bytes + n <= room)
+      return;
+    room = room * 2 > num_bytes + n ? room * 2 : num_bytes + n;
+    bytes.resize(old_size + room);
+    out = bytes.data() + old_size;
+  };
+
+  while (i < len) {
+    byte first = HEX_VALUES[(byte)buf[i]];
+    if (first == HEX_SPACE) {
+      ++i;
+      continue;
+    }
+    if (first == HEX_COMMENT) {
+      while (i < len && buf[i] != '\n')
+        ++i;
+      continue;
+    }
+
+#if defined(HEX_SIMD)
+    // Fast path for lines of two-digit words, sixteen at a time
+    if (HAVE_SSSE3 && is_nibble(first) && i + 48 <= len
+        && HEX_VALUES[(byte)buf[i+2]] == HEX_SPACE) {
+      bool decoded = false;
+      while (i + 48 <= len) {
+        make_room(16);
+        if (!decode_16_spaced_words(buf + i, out + num_bytes))
+          break;
+        i += 48;
+        num_bytes += 16;
+        decoded = true;
+      }
+      if (decoded)
+        continue;
+    }
+#endif
+
+    // Fast path for the usual two-digit word
+    if (is_nibble(first) && i + 1 < len) {
+      byte second = HEX_VALUES[(byte)buf[i+1]];
+      if (is_nibble(second) && (i + 2 == len || HEX_VALUES[(byte)buf[i+2]] == HEX_SPACE)) {
+        make_room(1);
+        out[num_bytes++] = (byte)((first << 4) | second);
+        i += 2;
+        continue;
+      }
+    }
+
+    size_t start = i;
+    while (i < len && HEX_VALUES[(byte)buf[i]] != HEX_SPACE)
+      ++i;
+
+    if (!is_nibble(first)) {
+      result.status = HEX_NOT_HEX;
+      result.word_start = start;
+      result.word_end = i;
+      break;
+    }
+
+    size_t num_out;
+    make_room((i - start + 1) / 2);
+    HexStatus status = hex_decode_word(buf + start, i - start, out + num_bytes, &num_out);
+    num_bytes += num_out;
+    if (status != HEX_OK) {
+      result.status = status;
+      result.word_start = start;
+      result.word_end = i;
+      break;
+    }
+  }
+
+  bytes.resize(old_size + num_bytes);
+  return result;
+}
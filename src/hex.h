@@ -0,0 +1,43 @@
+#ifndef HEX_H
+#define HEX_H
+
+#include <stddef.h>
+#include <vector>
+
+typedef unsigned char byte;
+
+typedef enum HexStatus {
+  HEX_OK,
+  HEX_NOT_HEX,                  // word doesn't start with a hex digit
+  HEX_BAD_DIGIT,                // word contains a non-hex character
+  HEX_ODD_DIGITS                // last digit of a long word ignored
+} HexStatus;
+
+// Where and why hex_decode_buffer stopped
+typedef struct HexResult {
+  HexStatus status;
+  size_t word_start;            // offsets into the buffer of the
+  size_t word_end;              // offending word
+} HexResult;
+
+/*
+ * Decodes the `len` hex digits at `word` into `out`, which must have room
+ * for (len + 1) / 2 bytes, and stores the number of bytes decoded in
+ * `*num_out`. A one-digit word is a single byte. If a longer word has an
+ * odd number of digits, the last one is ignored and HEX_ODD_DIGITS is
+ * returned.
+ */
+HexStatus hex_decode_word(const char *word, size_t len, byte *out, size_t *num_out);
+
+/*
+ * Decodes whitespace-separated hex words from `buf` and appends them to
+ * `bytes`. '#' starts a comment that runs to the end of the line.
+ *
+ * Stops at the first word that can't be decoded and returns its status
+ * and location. Bytes decoded before it (including a word's digits before
+ * a bad one) are kept. Call again with the rest of the buffer to
+ * continue.
+ */
+HexResult hex_decode_buffer(const char *buf, size_t len, std::vector<byte> &bytes);
+
+#endif /* HEX_H */
@@ -0,0 +1,57 @@
+#include <iostream>
+#include <string.h>
+#include "histogram.h"
+
+using std::cout;
+using std::endl;
+
+void Histogram::reset() {
+  memset(counts, 0, sizeof(counts));
+  total = 0;
+  sum = 0;
+  min_value = UINT64_MAX;
+  max_value = 0;
+}
+
+uint64_t Histogram::bucket_high(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS)
+    return (uint64_t)index;
+  int i = index - HISTOGRAM_SUB_BUCKETS;
+  int shift = i / HISTOGRAM_HALF_SUB_BUCKETS + 1;
+  uint64_t sub_bucket = (uint64_t)(i % HISTOGRAM_HALF_SUB_BUCKETS + HISTOGRAM_HALF_SUB_BUCKETS);
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+uint64_t Histogram::percentile(double percent) const {
+  if (total == 0)
+    return 0;
+
+  long wanted = (long)(percent / 100.0 * total + 0.5);
+  if (wanted < 1)
+    wanted = 1;
+  long seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += counts[i];
+    if (seen >= wanted) {
+      uint64_t high = bucket_high(i);
+      return high < max_value ? high : max_value;
+    }
+  }
+  return max_value;
+}
+
+void Histogram::print(const char *name, const char *unit) const {
+  cout << name << ": ";
+  if (total == 0) {
+    cout << "no samples" << endl;
+    return;
+  }
+  cout << total << " samples, min " << min() << ' ' << unit
+       << ", p50 " << percentile(50)
+       << ", p90 " << percentile(90)
+       << ", p99 " << percentile(99)
+       << ", p99.9 " << percentile(99.9)
+       << ", max " << max() << ' ' << unit
+       << ", mean " << mean() << ' ' << unit
+       << endl;
+}
@@ -0,0 +1,63 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Values below 2^HISTOGRAM_SUB_BUCKET_BITS are counted exactly. Above
+// that each power of two is split into half that many buckets, so any
+// value is known to within about 3%.
+#define HISTOGRAM_SUB_BUCKET_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_HALF_SUB_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+#define HISTOGRAM_BUCKETS \
+  (HISTOGRAM_SUB_BUCKETS + (64 - HISTOGRAM_SUB_BUCKET_BITS) * HISTOGRAM_HALF_SUB_BUCKETS)
+
+// A log-linear ("HDR" style) histogram of non-negative integers. Recording
+// is a couple of shifts and an increment, with no allocation, so it can
+// be done for every event.
+class Histogram {
+public:
+  Histogram() { reset(); }
+
+  void reset();
+  void record(uint64_t value, long count = 1) {
+    counts[bucket_index(value)] += count;
+    total += count;
+    sum += (double)value * count;
+    if (value < min_value)
+      min_value = value;
+    if (value > max_value)
+      max_value = value;
+  }
+
+  long count() const { return total; }
+  uint64_t min() const { return total == 0 ? 0 : min_value; }
+  uint64_t max() const { return max_value; }
+  double mean() const { return total == 0 ? 0 : sum / total; }
+  // The highest value in the bucket holding the `percent`th percentile,
+  // but no more than the largest value recorded
+  uint64_t percentile(double percent) const;
+
+  // Prints one line of summary statistics, labelled with `name` and
+  // `unit`
+  void print(const char *name, const char *unit) const;
+
+  static int bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS)
+      return (int)value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    return HISTOGRAM_SUB_BUCKETS + (shift - 1) * HISTOGRAM_HALF_SUB_BUCKETS
+      + (int)(value >> shift) - HISTOGRAM_HALF_SUB_BUCKETS;
+  }
+  static uint64_t bucket_high(int index);
+
+private:
+  long counts[HISTOGRAM_BUCKETS];
+  long total;
+  double sum;
+  uint64_t min_value;
+  uint64_t max_value;
+};
+
+#endif /* HISTOGRAM_H */
@@ -0,0 +1,180 @@
+#include <chrono>
+#include <stdint.h>
+#include <unistd.h>
+#include "input_reader.h"
+#include "porttime.h"
+
+// How long the reader thread sleeps when there is nothing to read
+#define IDLE_SLEEP_MILLISECS 1
+
+using std::atomic_thread_fence;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::memory_order_relaxed;
+using std::memory_order_seq_cst;
+using std::mutex;
+using std::unique_lock;
+
+InputReader::InputReader(MidiBackend *midi, size_t ring_size)
+  : midi(midi), ring(ring_size), running(false), waiting(false), notify_fd(-1),
+    notify_armed(false), num_overflows(0), num_read_errors(0)
+{
+  reset_batch_sizes();
+}
+
+InputReader::~InputReader() {
+  stop();
+}
+
+// The thread is stopped while the list of streams changes, so that the
+// thread never needs a lock to read it. Events already in the ring are
+// kept.
+void InputReader::add(PortMidiStream *stream, int port_id) {
+  stop_thread();
+  sources.push_back({stream, port_id});
+  start_thread();
+}
+
+void InputReader::remove(PortMidiStream *stream) {
+  stop_thread();
+  for (auto iter = sources.begin(); iter != sources.end(); ++iter) {
+    if (iter->stream == stream) {
+      sources.erase(iter);
+      break;
+    }
+  }
+  if (!sources.empty())
+    start_thread();
+}
+
+void InputReader::stop() {
+  stop_thread();
+  sources.clear();
+}
+
+void InputReader::start_thread() {
+  running = true;
+  thread = std::thread(&InputReader::drain, this);
+}
+
+void InputReader::stop_thread() {
+  if (!thread.joinable())
+    return;
+
+  running = false;
+  {
+    lock_guard<mutex> lock(state_mutex);
+  }
+  state_changed.notify_all();
+  thread.join();
+}
+
+bool InputReader::wait(long timeout_ms) {
+  if (has_input())
+    return true;
+
+  unique_lock<mutex> lock(state_mutex);
+  waiting.store(true);
+  // Pairs with the fence in `drain` so that either we see the new events
+  // or the reader sees `waiting` and wakes us.
+  atomic_thread_fence(memory_order_seq_cst);
+  // With no streams left, say after a rescan found an input unplugged,
+  // nothing will wake us, but sleeping out the timeout keeps callers'
+  // loops from spinning
+  state_changed.wait_for(lock, milliseconds(timeout_ms), [this]{ return has_input(); });
+  waiting.store(false);
+  return has_input();
+}
+
+void InputReader::arm_notify() {
+  notify_armed.store(true);
+  // Pairs with the fence in `drain`, as in `wait`. Callers check
+  // `has_input` after arming.
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+int InputReader::read(PmEvent *events, int max_events, int *port_ids) {
+  InputEvent buf[INPUT_READ_BUFSIZ];
+  int num_read = 0;
+
+  while (num_read < max_events) {
+    int want = max_events - num_read;
+    int n = (int)ring.pop(buf, want < INPUT_READ_BUFSIZ ? want : INPUT_READ_BUFSIZ);
+    for (int i = 0; i < n; ++i) {
+      events[num_read + i] = buf[i].event;
+      if (port_ids != nullptr)
+        port_ids[num_read + i] = buf[i].port_id;
+    }
+    num_read += n;
+    if (n < INPUT_READ_BUFSIZ)
+      break;
+  }
+  return num_read;
+}
+
+void InputReader::batch_sizes(Histogram &histogram) const {
+  histogram.reset();
+  for (int i = 1; i <= INPUT_READ_BUFSIZ; ++i) {
+    long count = batch_counts[i].load(memory_order_relaxed);
+    if (count > 0)
+      histogram.record(i, count);
+  }
+}
+
+void InputReader::reset_batch_sizes() {
+  for (int i = 0; i <= INPUT_READ_BUFSIZ; ++i)
+    batch_counts[i].store(0, memory_order_relaxed);
+}
+
+void InputReader::drain() {
+  PmEvent events[INPUT_READ_BUFSIZ];
+  InputEvent tagged[INPUT_READ_BUFSIZ];
+
+  while (running) {
+    bool idle = true;
+
+    for (const Source &source : sources) {
+      int num_read = midi->read(source.stream, events, INPUT_READ_BUFSIZ);
+      if (num_read == pmBufferOverflow) {
+        // PortMidi doesn't say how many it lost
+        num_overflows.fetch_add(1, memory_order_relaxed);
+        idle = false;
+        continue;
+      }
+      if (num_read < 0) {
+        num_read_errors.fetch_add(1, memory_order_relaxed);
+        continue;
+      }
+      if (num_read == 0)
+        continue;
+
+      idle = false;
+      batch_counts[num_read].fetch_add(1, memory_order_relaxed);
+      for (int i = 0; i < num_read; ++i) {
+        tagged[i].event = events[i];
+        tagged[i].port_id = source.port_id;
+      }
+      size_t num_pushed = ring.push(tagged, num_read);
+      if (num_pushed < (size_t)num_read)
+        num_overflows.fetch_add(num_read - num_pushed, memory_order_relaxed);
+    }
+
+    if (idle) {
+      Pt_Sleep(IDLE_SLEEP_MILLISECS);
+      continue;
+    }
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (waiting.load()) {
+      lock_guard<mutex> lock(state_mutex);
+      state_changed.notify_all();
+    }
+    if (notify_armed.load() && notify_armed.exchange(false)) {
+      // Can only fail if the counter is about to overflow, in which case
+      // it's signalled already
+      uint64_t one = 1;
+      ssize_t written = write(notify_fd.load(), &one, sizeof(one));
+      (void)written;
+    }
+  }
+}
@@ -0,0 +1,97 @@
+#ifndef INPUT_READER_H
+#define INPUT_READER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "histogram.h"
+#include "midi_backend.h"
+#include "portmidi.h"
+#include "ring_buffer.h"
+
+// Most events read from a stream by one read call
+#define INPUT_READ_BUFSIZ 256
+
+// An input event and the id of the port it arrived on
+typedef struct InputEvent {
+  PmEvent event;
+  int port_id;
+} InputEvent;
+
+// Drains any number of input streams from one background thread into a
+// large ring buffer so that PortMidi's own (small) queues never overflow
+// while the main thread is busy printing or reading commands. The main
+// thread consumes events with `read` and can sleep in `wait` until some
+// arrive on any stream.
+//
+// PortMidi does not expose an OS handle that we could block on, so the
+// reader thread polls the streams once per millisecond when they are all
+// idle. Once a stream has been added only the reader thread touches it;
+// remove it before closing it.
+class InputReader {
+public:
+  InputReader(MidiBackend *midi, size_t ring_size);
+  ~InputReader();
+
+  // Events read from `stream` are tagged with `port_id`
+  void add(PortMidiStream *stream, int port_id);
+  void remove(PortMidiStream *stream);
+  // Removes every stream. Events already read from them stay in the ring.
+  void stop();
+  // Drops events that haven't been read yet
+  void clear() { ring.clear(); }
+
+  // Blocks until events are available or `timeout_ms` milliseconds have
+  // elapsed. Returns true if events are available.
+  bool wait(long timeout_ms);
+
+  // Copies up to `max_events` events into `events` and returns the number
+  // copied. If `port_ids` is not null, the id of each event's port is
+  // copied into it. Never blocks.
+  int read(PmEvent *events, int max_events, int *port_ids = nullptr);
+  bool has_input() const { return !ring.empty(); }
+
+  // Makes the reader thread write to the eventfd `fd` when events arrive
+  // after `arm_notify`, once per call, so that an epoll loop can wait for
+  // input alongside other file descriptors. -1 turns this off.
+  void set_notify_fd(int fd) { notify_fd.store(fd); }
+  void arm_notify();
+
+  // Number of events lost because the ring or PortMidi's queue was full
+  long overflows() const { return num_overflows.load(std::memory_order_relaxed); }
+  // Number of reads that failed with any other error
+  long read_errors() const { return num_read_errors.load(std::memory_order_relaxed); }
+
+  // Sizes of the batches reads have returned, counted by the reader
+  // thread
+  void batch_sizes(Histogram &histogram) const;
+  void reset_batch_sizes();
+
+private:
+  typedef struct Source {
+    PortMidiStream *stream;
+    int port_id;
+  } Source;
+
+  MidiBackend *midi;
+  std::vector<Source> sources;
+  RingBuffer<InputEvent> ring;
+  std::thread thread;
+  std::atomic<bool> running;
+  std::atomic<bool> waiting;
+  std::atomic<int> notify_fd;
+  std::atomic<bool> notify_armed;
+  std::atomic<long> num_overflows;
+  std::atomic<long> num_read_errors;
+  std::atomic<long> batch_counts[INPUT_READ_BUFSIZ + 1];
+  std::mutex state_mutex;
+  std::condition_variable state_changed;
+
+  void start_thread();
+  void stop_thread();
+  void drain();
+};
+
+#endif /* INPUT_READER_H */
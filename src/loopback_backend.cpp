@@ -0,0 +1,390 @@
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include "consts.h"
+#include "loopback_backend.h"
+#include "porttime.h"
+#include "util.h"
+
+// Default generator rates, in messages per second. CC is about as dense
+// as a 5-pin DIN cable allows and clock is 120 BPM.
+#define DEFAULT_CC_RATE 1000
+#define DEFAULT_CLOCK_RATE 48
+#define DEFAULT_SYSEX_RATE 1
+#define DEFAULT_SYSEX_SIZE (64 * 1024)
+// F0, manufacturer id, F7
+#define MIN_SYSEX_SIZE 3
+// Non-commercial manufacturer id
+#define SYSEX_MANUFACTURER 0x7d
+
+using std::cerr;
+using std::endl;
+using std::lock_guard;
+using std::mutex;
+
+static const struct {
+  const char *name;
+  GeneratorType type;
+  long rate;
+} GENERATOR_TYPES[] = {
+  {"cc", GENERATOR_CC, DEFAULT_CC_RATE},
+  {"clock", GENERATOR_CLOCK, DEFAULT_CLOCK_RATE},
+  {"sysex", GENERATOR_SYSEX, DEFAULT_SYSEX_RATE},
+  {nullptr, GENERATOR_CC, 0}
+};
+
+bool parse_generator_stream(const char *spec, GeneratorStream *stream) {
+  size_t len = strcspn(spec, ":");
+  int i;
+
+  for (i = 0; GENERATOR_TYPES[i].name != nullptr; ++i)
+    if (strlen(GENERATOR_TYPES[i].name) == len
+        && strncmp(GENERATOR_TYPES[i].name, spec, len) == 0)
+      break;
+  if (GENERATOR_TYPES[i].name == nullptr) {
+    cerr << "# unknown generator type in " << spec << endl;
+    return false;
+  }
+
+  stream->type = GENERATOR_TYPES[i].type;
+  stream->rate = GENERATOR_TYPES[i].rate;
+  stream->size = DEFAULT_SYSEX_SIZE;
+  spec += len;
+  if (*spec == ':') {
+    char *end;
+    stream->rate = strtol(spec + 1, &end, 10);
+    if (end == spec + 1 || stream->rate < 0) {
+      cerr << "# bad generator rate in " << spec << endl;
+      return false;
+    }
+    spec = end;
+  }
+  if (*spec == ':' && stream->type == GENERATOR_SYSEX) {
+    stream->size = parse_size(spec + 1);
+    if (stream->size < MIN_SYSEX_SIZE)
+      stream->size = MIN_SYSEX_SIZE;
+    spec += strlen(spec);
+  }
+  if (*spec != 0) {
+    cerr << "# unexpected \"" << spec << "\" in generator" << endl;
+    return false;
+  }
+  return true;
+}
+
+LoopbackBackend::LoopbackBackend() {
+  // Generated and looped back events are timestamped using PortTime, as
+  // PortMidi's are
+  if (!Pt_Started())
+    Pt_Start(1, 0, 0);
+
+  devices[LOOPBACK_INPUT] = {1, "loopback", "loopback", 1, 0, 0};
+  devices[LOOPBACK_OUTPUT] = {1, "loopback", "loopback", 0, 1, 0};
+  devices[LOOPBACK_GENERATOR] = {1, "loopback", "generator", 1, 0, 0};
+  for (int i = 0; i < LOOPBACK_DEVICES; ++i) {
+    streams[i] = nullptr;
+    plugged_in[i] = listed[i] = true;
+  }
+}
+
+LoopbackBackend::~LoopbackBackend() {
+  for (int i = 0; i < LOOPBACK_DEVICES; ++i)
+    delete streams[i];
+}
+
+void LoopbackBackend::set_plugged_in(int device, bool plugged) {
+  lock_guard<mutex> lock(state_mutex);
+  if (device >= 0 && device < LOOPBACK_DEVICES)
+    plugged_in[device] = plugged;
+}
+
+const PmDeviceInfo *LoopbackBackend::device_info(int device) {
+  lock_guard<mutex> lock(state_mutex);
+  if (device < 0 || device >= LOOPBACK_DEVICES || !listed[device])
+    return nullptr;
+  return &devices[device];
+}
+
+PmError LoopbackBackend::rescan() {
+  lock_guard<mutex> lock(state_mutex);
+  for (int i = 0; i < LOOPBACK_DEVICES; ++i)
+    listed[i] = plugged_in[i];
+  return pmNoError;
+}
+
+PmError LoopbackBackend::open_input(PortMidiStream **stream, int device, int buffer_size) {
+  if (device < 0 || device >= LOOPBACK_DEVICES || !devices[device].input
+      || !listed[device] || streams[device] != nullptr)
+    return pmInvalidDeviceId;
+
+  Stream *s = new Stream();
+  s->device = device;
+  s->buffer_size = buffer_size;
+  s->in_sysex = false;
+  s->start_time = Pt_Time();
+  s->next_generator = 0;
+  s->overflowed = false;
+  if (device == LOOPBACK_GENERATOR)
+    for (GeneratorStream &config : generator_streams)
+      s->generators.push_back({config, 0, 0});
+
+  lock_guard<mutex> lock(state_mutex);
+  if (device == LOOPBACK_INPUT)
+    loopback_queue.clear();
+  streams[device] = s;
+  devices[device].opened = 1;
+  *stream = s;
+  return pmNoError;
+}
+
+// Output is never delayed, so the latency is ignored
+PmError LoopbackBackend::open_output(PortMidiStream **stream, int device, int buffer_size,
+                                     int latency_ms)
+{
+  if (device < 0 || device >= LOOPBACK_DEVICES || !devices[device].output
+      || !listed[device] || streams[device] != nullptr)
+    return pmInvalidDeviceId;
+
+  Stream *s = new Stream();
+  s->device = device;
+  s->buffer_size = buffer_size;
+  s->in_sysex = false;
+  s->start_time = Pt_Time();
+  s->next_generator = 0;
+  s->overflowed = false;
+
+  lock_guard<mutex> lock(state_mutex);
+  streams[device] = s;
+  devices[device].opened = 1;
+  *stream = s;
+  return pmNoError;
+}
+
+PmError LoopbackBackend::close(PortMidiStream *stream) {
+  lock_guard<mutex> lock(state_mutex);
+  Stream *s = find(stream, -1);
+  if (s == nullptr)
+    return pmBadPtr;
+
+  streams[s->device] = nullptr;
+  devices[s->device].opened = 0;
+  delete s;
+  return pmNoError;
+}
+
+PmError LoopbackBackend::set_filter(PortMidiStream *stream, int32_t filters) {
+  lock_guard<mutex> lock(state_mutex);
+  Stream *s = find(stream, -1);
+  if (s == nullptr)
+    return pmBadPtr;
+
+  s->filter.set_drop_types(filters);
+  s->filter.compile();
+  return pmNoError;
+}
+
+PmError LoopbackBackend::set_channel_mask(PortMidiStream *stream, int mask) {
+  lock_guard<mutex> lock(state_mutex);
+  Stream *s = find(stream, -1);
+  if (s == nullptr)
+    return pmBadPtr;
+
+  s->filter.set_channels(mask);
+  s->filter.compile();
+  return pmNoError;
+}
+
+int LoopbackBackend::read(PortMidiStream *stream, PmEvent *events, int max_events) {
+  lock_guard<mutex> lock(state_mutex);
+  Stream *s = find(stream, -1);
+  if (s == nullptr || !devices[s->device].input)
+    return pmBadPtr;
+
+  if (s->device != LOOPBACK_GENERATOR)
+    return read_loopback(s, events, max_events);
+
+  int n = read_generator(s, events, max_events);
+  if (s->overflowed) {
+    s->overflowed = false;
+    return pmBufferOverflow;
+  }
+  return n;
+}
+
+PmError LoopbackBackend::write(PortMidiStream *stream, PmEvent *events, int num_events) {
+  lock_guard<mutex> lock(state_mutex);
+  if (find(stream, LOOPBACK_OUTPUT) == nullptr)
+    return pmBadPtr;
+
+  for (int i = 0; i < num_events; ++i)
+    loop_back(events[i]);
+  return pmNoError;
+}
+
+PmError LoopbackBackend::write_short(PortMidiStream *stream, PmTimestamp when, PmMessage msg) {
+  lock_guard<mutex> lock(state_mutex);
+  if (find(stream, LOOPBACK_OUTPUT) == nullptr)
+    return pmBadPtr;
+
+  loop_back({msg, when});
+  return pmNoError;
+}
+
+/*
+ * Packs the message into events four bytes at a time, the way PortMidi
+ * delivers sysex on input.
+ */
+PmError LoopbackBackend::write_sysex(PortMidiStream *stream, PmTimestamp when, byte *msg) {
+  lock_guard<mutex> lock(state_mutex);
+  if (find(stream, LOOPBACK_OUTPUT) == nullptr)
+    return pmBadPtr;
+
+  bool done = false;
+  for (size_t i = 0; !done; i += 4) {
+    PmMessage packed = 0;
+    for (int j = 0; j < 4 && !done; ++j) {
+      packed |= (PmMessage)msg[i + j] << (j * 8);
+      done = msg[i + j] == EOX;
+    }
+    loop_back({packed, when});
+  }
+  return pmNoError;
+}
+
+// Returns our stream for `stream`, or nullptr if it isn't one or (if
+// `device` isn't -1) is open on another device. Call with state_mutex
+// held.
+LoopbackBackend::Stream *LoopbackBackend::find(PortMidiStream *stream, int device) {
+  for (int i = 0; i < LOOPBACK_DEVICES; ++i)
+    if (streams[i] != nullptr && streams[i] == stream)
+      return (device == -1 || device == i) ? streams[i] : nullptr;
+  return nullptr;
+}
+
+// Queues `event` for the loopback input, timestamped now, if the input is
+// open. Call with state_mutex held.
+void LoopbackBackend::loop_back(PmEvent event) {
+  if (streams[LOOPBACK_INPUT] == nullptr)
+    return;
+  event.timestamp = Pt_Time();
+  loopback_queue.push_back(event);
+}
+
+int LoopbackBackend::read_loopback(Stream *stream, PmEvent *events, int max_events) {
+  int n = 0;
+
+  while (n < max_events && !loopback_queue.empty()) {
+    PmEvent event = loopback_queue.front();
+    loopback_queue.pop_front();
+    if (keep(stream, event.message))
+      events[n++] = event;
+  }
+  return n;
+}
+
+/*
+ * Gives each generator stream a turn, starting with a different one each
+ * time so that none of them starve when they're all running flat out. A
+ * sysex message in progress holds off everything but clock, as it would
+ * on a real cable.
+ */
+int LoopbackBackend::read_generator(Stream *stream, PmEvent *events, int max_events) {
+  size_t num_generators = stream->generators.size();
+  PmTimestamp now = Pt_Time();
+  int n = 0;
+
+  if (num_generators == 0)
+    return 0;
+
+  for (size_t i = 0; i < num_generators && n < max_events; ++i) {
+    Generator &gen = stream->generators[(stream->next_generator + i) % num_generators];
+    bool sysex_busy = false;
+    for (Generator &other : stream->generators)
+      if (&other != &gen && other.sysex_offset > 0)
+        sysex_busy = true;
+    n += generate(stream, gen, now, sysex_busy, &events[n], max_events - n);
+  }
+  stream->next_generator = (stream->next_generator + 1) % num_generators;
+  return n;
+}
+
+/*
+ * Generates the events that `gen` owes by `now`, up to `max_events`. A
+ * rate-limited stream that is more than the buffer size behind loses the
+ * oldest messages and marks the stream overflowed, which loses this read.
+ */
+int LoopbackBackend::generate(Stream *stream, Generator &gen, PmTimestamp now,
+                              bool sysex_busy, PmEvent *events, int max_events)
+{
+  const GeneratorStream &config = gen.config;
+  int n = 0;
+
+  while (n < max_events) {
+    PmTimestamp when = now;
+
+    if (gen.sysex_offset == 0) {
+      if (sysex_busy && config.type != GENERATOR_CLOCK)
+        break;
+      if (config.rate > 0) {
+        long due = (long)((long long)(now - stream->start_time) * config.rate / 1000);
+        if (gen.sent >= due)
+          break;
+        if (due - gen.sent > stream->buffer_size) {
+          gen.sent = due - stream->buffer_size;
+          stream->overflowed = true;
+          break;
+        }
+        when = stream->start_time + (PmTimestamp)((long long)gen.sent * 1000 / config.rate);
+      }
+      ++gen.sent;
+    }
+
+    PmMessage msg = 0;
+    switch (config.type) {
+    case GENERATOR_CC: {
+      long i = gen.sent - 1;
+      msg = Pm_Message(CONTROLLER + (i / 128) % MIDI_CHANNELS, CC_MOD_WHEEL, i % 128);
+      break;
+    }
+    case GENERATOR_CLOCK:
+      msg = Pm_Message(CLOCK, 0, 0);
+      break;
+    case GENERATOR_SYSEX:
+      for (int j = 0; j < 4 && gen.sysex_offset < config.size; ++j, ++gen.sysex_offset) {
+        size_t offset = gen.sysex_offset;
+        byte b = offset == 0 ? SYSEX
+          : offset == 1 ? SYSEX_MANUFACTURER
+          : offset == config.size - 1 ? EOX
+          : (byte)(offset & 0x7f);
+        msg |= (PmMessage)b << (j * 8);
+      }
+      if (gen.sysex_offset == config.size)
+        gen.sysex_offset = 0;
+      break;
+    }
+
+    if (keep(stream, msg))
+      events[n++] = {msg, when};
+  }
+  return n;
+}
+
+/*
+ * Applies the stream's filter the way PortMidi does: by status for short
+ * messages and realtime, and to whole sysex messages at once.
+ */
+bool LoopbackBackend::keep(Stream *stream, PmMessage msg) {
+  byte status = Pm_MessageStatus(msg);
+
+  if (status >= CLOCK)
+    return stream->filter.keep(msg);
+  if (status == SYSEX || (stream->in_sysex && (status < NOTE_OFF || status == EOX))) {
+    stream->in_sysex = true;
+    for (int i = 0; i < 4; ++i)
+      if (((msg >> (i * 8)) & 0xff) == EOX)
+        stream->in_sysex = false;
+    return (stream->filter.pm_filter() & PM_FILT_SYSEX) == 0;
+  }
+  stream->in_sysex = false;
+  return stream->filter.keep(msg);
+}
@@ -0,0 +1,110 @@
+#ifndef LOOPBACK_BACKEND_H
+#define LOOPBACK_BACKEND_H
+
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "event_filter.h"
+#include "midi_backend.h"
+
+// Device numbers
+#define LOOPBACK_INPUT 0
+#define LOOPBACK_OUTPUT 1
+#define LOOPBACK_GENERATOR 2
+#define LOOPBACK_DEVICES 3
+
+// What a generator stream sends
+typedef enum GeneratorType {
+  GENERATOR_CC,                 // mod wheel sweeps, moving through the channels
+  GENERATOR_CLOCK,              // MIDI clock
+  GENERATOR_SYSEX               // non-commercial sysex messages of `size` bytes
+} GeneratorType;
+
+// One synthetic stream on the generator input
+typedef struct GeneratorStream {
+  GeneratorType type;
+  long rate;                    // messages per second; 0 is as fast as they're read
+  size_t size;                  // sysex message size, F0 and F7 included
+} GeneratorStream;
+
+// Parses TYPE[:RATE[:SIZE]], where TYPE is cc, clock or sysex. SIZE may
+// end in k or m. Prints an error and returns false if `spec` is bad.
+bool parse_generator_stream(const char *spec, GeneratorStream *stream);
+
+// An in-memory backend with three devices: an input and an output named
+// "loopback", where everything written to the output arrives on the
+// input, and an input named "generator" that produces synthetic streams
+// at set rates. Used to test and load test the receive, monitor and route
+// paths without hardware.
+//
+// Loopback output is delivered immediately, however fast it's written.
+// Generator streams that fall further behind than the input's buffer size
+// lose messages and report pmBufferOverflow, as PortMidi does.
+class LoopbackBackend : public MidiBackend {
+public:
+  LoopbackBackend();
+  ~LoopbackBackend();
+
+  // Streams take effect the next time the generator is opened
+  void add_generator_stream(const GeneratorStream &stream) { generator_streams.push_back(stream); }
+  void clear_generator_streams() { generator_streams.clear(); }
+
+  // A device unplugged here leaves the device list at the next rescan, as
+  // with PortMidi, and is back after the first rescan once it's plugged in
+  // again. Streams already open on it carry on working.
+  void set_plugged_in(int device, bool plugged_in);
+
+  int count_devices() { return LOOPBACK_DEVICES; }
+  // Null for devices not listed
+  const PmDeviceInfo *device_info(int device);
+  PmError rescan();
+
+  PmError open_input(PortMidiStream **stream, int device, int buffer_size);
+  PmError open_output(PortMidiStream **stream, int device, int buffer_size, int latency_ms);
+  PmError close(PortMidiStream *stream);
+
+  PmError set_filter(PortMidiStream *stream, int32_t filters);
+  PmError set_channel_mask(PortMidiStream *stream, int mask);
+
+  int read(PortMidiStream *stream, PmEvent *events, int max_events);
+  PmError write(PortMidiStream *stream, PmEvent *events, int num_events);
+  PmError write_short(PortMidiStream *stream, PmTimestamp when, PmMessage msg);
+  PmError write_sysex(PortMidiStream *stream, PmTimestamp when, byte *msg);
+
+private:
+  // A generator stream's progress
+  typedef struct Generator {
+    GeneratorStream config;
+    long sent;                  // messages started
+    size_t sysex_offset;        // 0 when not in a sysex message
+  } Generator;
+
+  typedef struct Stream {
+    int device;
+    int buffer_size;
+    EventFilter filter;         // emulates Pm_SetFilter and Pm_SetChannelMask
+    bool in_sysex;              // filtering is in the middle of a sysex message
+    PmTimestamp start_time;
+    std::vector<Generator> generators;
+    size_t next_generator;      // round robin start
+    bool overflowed;
+  } Stream;
+
+  PmDeviceInfo devices[LOOPBACK_DEVICES];
+  Stream *streams[LOOPBACK_DEVICES];
+  bool plugged_in[LOOPBACK_DEVICES];
+  bool listed[LOOPBACK_DEVICES];  // plugged in as of the last rescan
+  std::vector<GeneratorStream> generator_streams;
+  std::deque<PmEvent> loopback_queue;
+  std::mutex state_mutex;       // guards the streams and loopback_queue
+
+  Stream *find(PortMidiStream *stream, int device);
+  void loop_back(PmEvent event);
+  int read_loopback(Stream *stream, PmEvent *events, int max_events);
+  int read_generator(Stream *stream, PmEvent *events, int max_events);
+  int generate(Stream *stream, Generator &gen, PmTimestamp now, bool sysex_busy,
+               PmEvent *events, int max_events);
+  bool keep(Stream *stream, PmMessage msg);
+};
+
+#endif /* LOOPBACK_BACKEND_H */
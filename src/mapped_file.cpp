@@ -0,0 +1,46 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mapped_file.h"
+
+bool MappedFile::open(const char * const path) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd == -1) {
+    perror(path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    perror(path);
+    ::close(fd);
+    return false;
+  }
+  if (st.st_size == 0) {
+    ::close(fd);
+    return true;
+  }
+
+  void *addr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);                  // the mapping keeps the file open
+  if (addr == MAP_FAILED) {
+    perror(path);
+    return false;
+  }
+  madvise(addr, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+  data_start = (byte *)addr;
+  data_size = (size_t)st.st_size;
+  return true;
+}
+
+void MappedFile::close() {
+  if (data_start != nullptr)
+    munmap(data_start, data_size);
+  data_start = nullptr;
+  data_size = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+
+typedef unsigned char byte;
+
+// A read-only memory mapping of a whole file, unmapped when destroyed.
+class MappedFile {
+public:
+  MappedFile() : data_start(nullptr), data_size(0) {}
+  ~MappedFile() { close(); }
+
+  // Returns false and prints an error if the file can't be mapped. An
+  // empty file maps successfully with a size of zero.
+  bool open(const char * const path);
+  void close();
+
+  const byte *data() const { return data_start; }
+  size_t size() const { return data_size; }
+
+private:
+  byte *data_start;
+  size_t data_size;
+
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+};
+
+#endif /* MAPPED_FILE_H */
@@ -0,0 +1,47 @@
+#include <errno.h>
+#include "midi_backend.h"
+#include "porttime.h"
+
+static PmTimestamp pm_time(void *time_info) {
+  return Pt_Time();
+}
+
+PortMidiBackend::PortMidiBackend() {
+  Pm_Initialize();
+  // PortMidi timestamps input using PortTime. Start it now so that we can
+  // compare those timestamps with Pt_Time().
+  if (!Pt_Started())
+    Pt_Start(1, 0, 0);
+
+  // Pm_Initialize(), when it looks for default devices, can set errno to a
+  // non-zero value. Reinitialize it here.
+  errno = 0;
+}
+
+PortMidiBackend::~PortMidiBackend() {
+  Pm_Terminate();
+}
+
+PmError PortMidiBackend::rescan() {
+  Pm_Terminate();
+  PmError err = Pm_Initialize();
+  errno = 0;                    // as in the constructor
+  return err;
+}
+
+PmError PortMidiBackend::open_input(PortMidiStream **stream, int device, int buffer_size) {
+  return Pm_OpenInput(stream, device, 0, buffer_size, 0, 0);
+}
+
+PmError PortMidiBackend::open_output(PortMidiStream **stream, int device, int buffer_size,
+                                     int latency_ms)
+{
+  if (latency_ms > 0)
+    return Pm_OpenOutput(stream, device, 0, buffer_size, pm_time, 0, latency_ms);
+  return Pm_OpenOutput(stream, device, 0, buffer_size, 0, 0, 0);
+}
+
+MidiBackend *portmidi_backend() {
+  static PortMidiBackend backend;
+  return &backend;
+}
@@ -0,0 +1,80 @@
+#ifndef MIDI_BACKEND_H
+#define MIDI_BACKEND_H
+
+#include <stdint.h>
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+// The MIDI system calls that Server, InputReader, Router and SysexPacer
+// make, so that they can run against something other than PortMidi.
+// Streams are opaque PortMidiStream pointers whatever the backend, and
+// timestamps always come from PortTime's clock.
+//
+// Like PortMidi, one thread may read a stream while another writes a
+// different one.
+class MidiBackend {
+public:
+  virtual ~MidiBackend() {}
+
+  virtual int count_devices() = 0;
+  virtual const PmDeviceInfo *device_info(int device) = 0;
+  // Looks for devices again, so that ones plugged in or unplugged since
+  // the last look are seen. Every stream must be closed first, and device
+  // numbers may change.
+  virtual PmError rescan() = 0;
+
+  virtual PmError open_input(PortMidiStream **stream, int device, int buffer_size) = 0;
+  // A non-zero `latency_ms` delivers output at its timestamp plus that
+  // latency
+  virtual PmError open_output(PortMidiStream **stream, int device, int buffer_size,
+                              int latency_ms) = 0;
+  virtual PmError close(PortMidiStream *stream) = 0;
+
+  virtual PmError set_filter(PortMidiStream *stream, int32_t filters) = 0;
+  virtual PmError set_channel_mask(PortMidiStream *stream, int mask) = 0;
+
+  // Returns the number of events read, or a negative PmError
+  virtual int read(PortMidiStream *stream, PmEvent *events, int max_events) = 0;
+  virtual PmError write(PortMidiStream *stream, PmEvent *events, int num_events) = 0;
+  virtual PmError write_short(PortMidiStream *stream, PmTimestamp when, PmMessage msg) = 0;
+  virtual PmError write_sysex(PortMidiStream *stream, PmTimestamp when, byte *msg) = 0;
+};
+
+// Passes everything straight to PortMidi
+class PortMidiBackend : public MidiBackend {
+public:
+  // Initializes PortMidi and starts PortTime
+  PortMidiBackend();
+  ~PortMidiBackend();
+
+  int count_devices() { return Pm_CountDevices(); }
+  const PmDeviceInfo *device_info(int device) { return Pm_GetDeviceInfo(device); }
+  // PortMidi only looks for devices when it's initialized
+  PmError rescan();
+
+  PmError open_input(PortMidiStream **stream, int device, int buffer_size);
+  PmError open_output(PortMidiStream **stream, int device, int buffer_size, int latency_ms);
+  PmError close(PortMidiStream *stream) { return Pm_Close(stream); }
+
+  PmError set_filter(PortMidiStream *stream, int32_t filters) { return Pm_SetFilter(stream, filters); }
+  PmError set_channel_mask(PortMidiStream *stream, int mask) { return Pm_SetChannelMask(stream, mask); }
+
+  int read(PortMidiStream *stream, PmEvent *events, int max_events) {
+    return Pm_Read(stream, events, max_events);
+  }
+  PmError write(PortMidiStream *stream, PmEvent *events, int num_events) {
+    return Pm_Write(stream, events, num_events);
+  }
+  PmError write_short(PortMidiStream *stream, PmTimestamp when, PmMessage msg) {
+    return Pm_WriteShort(stream, when, msg);
+  }
+  PmError write_sysex(PortMidiStream *stream, PmTimestamp when, byte *msg) {
+    return Pm_WriteSysEx(stream, when, msg);
+  }
+};
+
+// The backend used by default, created on first use
+MidiBackend *portmidi_backend();
+
+#endif /* MIDI_BACKEND_H */
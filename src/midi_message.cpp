@@ -0,0 +1,53 @@
+#include <string.h>
+#include "consts.h"
+#include "midi_message.h"
+
+int short_message_length(byte status) {
+  switch (status & 0xf0) {
+  case NOTE_OFF: case NOTE_ON: case POLY_PRESSURE: case CONTROLLER:
+  case PITCH_BEND:
+    return 3;
+  case PROGRAM_CHANGE: case CHANNEL_PRESSURE:
+    return 2;
+  case 0xf0:
+    break;
+  default:
+    return 0;                   // data byte
+  }
+
+  switch (status) {
+  case SONG_POINTER:
+    return 3;
+  case SONG_SELECT:
+    return 2;
+  case TUNE_REQUEST: case CLOCK: case START: case CONTINUE: case STOP:
+  case ACTIVE_SENSE: case SYSTEM_RESET:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+MessageKind next_message(const byte *bytes, size_t num_bytes, size_t *len) {
+  if (bytes[0] == SYSEX) {
+    const byte *eox = (const byte *)memchr(bytes, EOX, num_bytes);
+    if (eox == nullptr) {
+      *len = num_bytes;
+      return MESSAGE_NO_EOX;
+    }
+    *len = eox + 1 - bytes;
+    return MESSAGE_SYSEX;
+  }
+
+  int message_len = short_message_length(bytes[0]);
+  if (message_len == 0) {
+    *len = 1;
+    return MESSAGE_BAD_STATUS;
+  }
+  if ((size_t)message_len > num_bytes) {
+    *len = num_bytes;
+    return MESSAGE_INCOMPLETE;
+  }
+  *len = message_len;
+  return MESSAGE_SHORT;
+}
@@ -0,0 +1,33 @@
+#ifndef MIDI_MESSAGE_H
+#define MIDI_MESSAGE_H
+
+#include <stddef.h>
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+typedef enum SysexState {
+  SYSEX_WAITING,
+  SYSEX_PROCESSING,
+  SYSEX_DONE
+} SysexState;
+
+// What next_message found at the start of a byte stream
+typedef enum MessageKind {
+  MESSAGE_SHORT,                // a complete short message
+  MESSAGE_SYSEX,                // a complete sysex message, F0 through F7
+  MESSAGE_BAD_STATUS,           // a byte that doesn't start a message
+  MESSAGE_NO_EOX,               // a sysex message without an EOX
+  MESSAGE_INCOMPLETE            // a short message cut off by the end of data
+} MessageKind;
+
+// Returns the length of the message that starts with `status`, or 0 if
+// `status` does not start a message we know how to send as a short
+// message.
+int short_message_length(byte status);
+
+// Finds the message at the start of `bytes` and sets `*len` to its length
+// (1 for MESSAGE_BAD_STATUS).
+MessageKind next_message(const byte *bytes, size_t num_bytes, size_t *len);
+
+#endif /* MIDI_MESSAGE_H */
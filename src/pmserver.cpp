@@ -1,11 +1,24 @@
 #include <iostream>
+#include <ctype.h>
+#include <string.h>
 #include <libgen.h>
 #include <getopt.h>
 #include <unistd.h>
+#include "consts.h"
+#include "loopback_backend.h"
+#include "porttime.h"
+#include "script.h"
 #include "server.h"
+#include "socket_server.h"
 #include "util.h"
 
 #define LINE_BUFSIZ 8192
+#define DEFAULT_BULK_IDLE_MILLISECS 2000
+#define DEFAULT_BATCH_SIZE 256
+#define DEFAULT_PACE_CHUNK_BYTES 64
+#define DEFAULT_TRANSACTION_WINDOW 4
+// Commands that take :handle arguments to choose their ports
+#define PORT_COMMANDS "srwbmxfta"
 
 using std::cout;
 using std::cerr;
@@ -16,38 +29,646 @@ struct opts {
   bool list_devices;
   char input_port[BUFSIZ];
   char output_port[BUFSIZ];
+  WaitMode wait_mode;
+  bool timing;
+  size_t preallocate;
+  int batch_size;
+  int latency;
+  long reply_timeout;
+  bool hotplug;
+  std::vector<std::string> aliases;  // ALIAS=DEVICE
+  bool loopback;
+  std::vector<GeneratorStream> generator_streams;
+  char listen_address[BUFSIZ];
+  char script_path[BUFSIZ];
+  char store_dir[BUFSIZ];
 } opts;
 
 void help() {
   cout << "list                  List all devices" << endl
-       << "open input/output N   Open input or output port" << endl
-       << "send file | b [b...]  Send file or bytes to open output; all b must be hex" << endl
+       << "d rescan              Look for devices plugged in or unplugged since" << endl
+       << "                      startup and reopen ports on devices that are back" << endl
+       << "d alias [NAME DEVICE] Let NAME stand for a device name when opening" << endl
+       << "                      ports; without arguments, list aliases" << endl
+       << "d unalias NAME        Remove an alias" << endl
+       << "open input/output N [:handle]  Open input or output port, named handle" << endl
+       << "                      (default \"in\" or \"out\"); replaces any port using it" << endl
+       << "close :handle         Close the port(s) using handle" << endl
+       << "send file | b [b...]  Send file or bytes to open output; all b must be hex," << endl
+       << "                      +N waits N ms before the next message (needs -L)," << endl
+       << "                      and bytes between { and } are packed 7 to 8 into" << endl
+       << "                      7-bit data bytes, Korg style" << endl
        << "receive               Receive and print sysex bytes from open input" << endl
-       << "w outfile             Receive sysex from open input and write to a file" << endl
-       << "monitor               Receive and print all MIDI messages from open input" << endl
+       << "w outfile [unpack N]  Receive sysex from open input and write to a file;" << endl
+       << "                      unpack N saves 7-bit packed data after an N-byte" << endl
+       << "                      header as 8-bit data instead" << endl
+       << "b outfile [c N] [b N] [i MS] [unpack N]  Receive many sysex messages into" << endl
+       << "                      a file until N messages, N bytes, or MS ms of silence" << endl
+       << "a save NAME [c N] [b N] [i MS]  Receive sysex like b, into the capture" << endl
+       << "                      store (-C) as NAME, storing each distinct message once" << endl
+       << "a put NAME file       Add a sysex file to the capture store as NAME" << endl
+       << "a get NAME file       Write capture NAME out to a file" << endl
+       << "a list                List captures and the space they share" << endl
+       << "monitor [text | json | binary]  Receive and print all MIDI messages from" << endl
+       << "                      open input, as text (the default), JSON lines, or" << endl
+       << "                      8-byte binary records" << endl
+       << "record file.mid [0 | 1]  Record open input to a Type 0 (default) or" << endl
+       << "                      Type 1 MIDI file until ^C" << endl
+       << "route :in :out [channel N] [transpose N] [drop TYPE,...]  Add a route" << endl
+       << "route                 Forward input to outputs using the routes until ^C" << endl
+       << "route list | clear    List or remove all routes" << endl
+       << "filter [drop TYPE,...] [channels LIST] [cc LIST] [notes LO-HI]  Filter all" << endl
+       << "                      inputs; LISTs are like 1-4,10. \"filter off\" resets" << endl
+       << "stats [reset]         Print or reset round trip, interval, jitter and" << endl
+       << "                      read batch histograms" << endl
        << "x file | b [b...]     Send file or bytes, then receive and print" << endl
        << "f outfile file | b [b...]     Send file or bytes, then receive and save in outfile" << endl
+       << "t [window N] [timeout MS] [match PATTERN] file | b [b...]  Send each sysex" << endl
+       << "                      message as a request, N at a time (default 4), and" << endl
+       << "                      print \"INDEX<tab>reply\" for each reply. PATTERN is" << endl
+       << "                      hex like f042??684c==, where ?? matches any byte and" << endl
+       << "                      == the request's byte at the same offset" << endl
        << "p words...            Print words (good for scripts)" << endl
+       << "wait MS               Pause for MS ms" << endl
+       << "repeat N ... end      In scripts run with -s, run the lines in between" << endl
+       << "                      N times" << endl
+       << "pace CHUNK MS         Send sysex CHUNK bytes at a time, MS ms apart" << endl
+       << "pace rate BPS [CHUNK] Send sysex at BPS bytes/sec" << endl
+       << "pace off              Send sysex at full speed (the default)" << endl
+       << "lock :handle          Over a socket, keep other clients from sending to" << endl
+       << "                      the output; unlock :handle releases it" << endl
        << "help                  This help" << endl
        << "quit                  Quit" << endl
        << endl
-       << "all commands can be entered using the shortest unique prefix (1 char)" << endl;
+       << "commands can be shortened to their first letter, except record, route," << endl
+       << "filter, stats, wait, repeat, end, pace, lock and unlock, which must be" << endl
+       << "typed in full" << endl
+       << "commands that read or send take :handle arguments to choose ports, for" << endl
+       << "example \"m :keys\" or \"x :synth f0 ... f7\". Without them they read from" << endl
+       << "all inputs and send to the most recently opened output." << endl;
 }
 
-void run(Server &server, struct opts *opts) {
-  char line[LINE_BUFSIZ],  *words[MAX_WORDS];
+// Parses "count N", "bytes N", and "idle MS" pairs, and "unpack N" if
+// `unpack_header` isn't null.
+bool parse_bulk_limits(char **words, BulkLimits *limits, long *unpack_header) {
+  limits->max_messages = 0;
+  limits->max_bytes = 0;
+  limits->idle_ms = DEFAULT_BULK_IDLE_MILLISECS;
+  if (unpack_header != nullptr)
+    *unpack_header = -1;
+  for (int i = 0; words[i] != 0; i += 2) {
+    if (words[i+1] == 0) {
+      cerr << "# missing value after " << words[i] << endl;
+      return false;
+    }
+    switch (words[i][0]) {
+    case 'c':
+      limits->max_messages = atol(words[i+1]);
+      break;
+    case 'b':
+      limits->max_bytes = parse_size(words[i+1]);
+      break;
+    case 'i':
+      limits->idle_ms = atol(words[i+1]);
+      break;
+    case 'u':
+      if (unpack_header != nullptr) {
+        *unpack_header = atol(words[i+1]);
+        break;
+      }
+      // fall through
+    default:
+      cerr << "# unknown bulk limit " << words[i] << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// a save NAME [limits] | put NAME FILE | get NAME FILE | list
+void archive(Server &server, char **words) {
+  if (words[0] != 0) {
+    switch (words[0][0]) {
+    case 's':
+      if (words[1] == 0)
+        break;
+      if (!server.is_input_open())
+        cerr << "# please select an input port first" << endl;
+      else {
+        BulkLimits limits;
+        if (parse_bulk_limits(&words[2], &limits, nullptr))
+          server.receive_into_store(words[1], limits);
+      }
+      return;
+    case 'p':
+      if (words[1] == 0 || words[2] == 0)
+        break;
+      server.import_capture(words[1], words[2]);
+      return;
+    case 'g':
+      if (words[1] == 0 || words[2] == 0)
+        break;
+      server.extract_capture(words[1], words[2]);
+      return;
+    case 'l':
+      server.list_captures();
+      return;
+    }
+  }
+  cerr << "# a save NAME [count N] [bytes N] [idle MS] | put NAME FILE | get NAME FILE | list" << endl;
+}
+
+// t [window N] [timeout MS] [match PATTERN] file | b [b...]
+void transact(Server &server, char **words) {
+  size_t window = DEFAULT_TRANSACTION_WINDOW;
+  long timeout_ms = 0;
+  ReplyPattern pattern;
+
+  for (; words[0] != 0 && words[1] != 0; words += 2) {
+    if (words[0][0] == 'w')
+      window = atol(words[1]);
+    else if (words[0][0] == 't')
+      timeout_ms = atol(words[1]);
+    else if (words[0][0] == 'm') {
+      if (!parse_reply_pattern(words[1], &pattern))
+        return;
+    }
+    else
+      break;
+  }
+  if (words[0] == 0) {
+    cerr << "# t [window N] [timeout MS] [match PATTERN] file | b [b...]" << endl;
+    return;
+  }
+  server.transact(words, window, timeout_ms, pattern);
+}
+
+// pace [off | CHUNK DELAY_MS | rate BYTES_PER_SEC [CHUNK]]
+void pace(Server &server, char **words) {
+  if (words[0] == 0)
+    ;
+  else if (words[0][0] == 'o')
+    server.set_pacing_delay(0, 0);
+  else if (words[0][0] == 'r' && words[1] != 0)
+    server.set_pacing_rate(words[2] ? parse_size(words[2]) : DEFAULT_PACE_CHUNK_BYTES,
+                           parse_size(words[1]));
+  else if (isdigit(words[0][0]) && words[1] != 0)
+    server.set_pacing_delay(parse_size(words[0]), atol(words[1]));
+  else {
+    cerr << "# pace [off | CHUNK DELAY_MS | rate BYTES_PER_SEC [CHUNK]]" << endl;
+    return;
+  }
+  server.print_pacing();
+}
+
+// open input/output N|name [:handle]
+//
+// Device names may contain spaces, so every word up to the optional handle
+// is part of the name.
+void open_port(Server &server, char **words) {
+  const char *handle = nullptr;
+  std::string name;
+
+  if (words[0] == 0 || (words[0][0] != 'i' && words[0][0] != 'o') || words[1] == 0) {
+    cerr << "# open input/output N [:handle]" << endl;
+    return;
+  }
+  for (int i = 1; words[i] != 0; ++i) {
+    if (words[i][0] == ':' && words[i+1] == 0) {
+      handle = &words[i][1];
+      break;
+    }
+    if (!name.empty())
+      name += ' ';
+    name += words[i];
+  }
+  if (name.empty() || (handle != nullptr && handle[0] == 0)) {
+    cerr << "# open input/output N [:handle]" << endl;
+    return;
+  }
+
+  PmError err = words[0][0] == 'i'
+    ? server.open_input(name.c_str(), handle)
+    : server.open_output(name.c_str(), handle);
+  if (err != pmNoError)
+    cerr << "# error opening " << (words[0][0] == 'i' ? "input" : "output")
+         << " port " << name << ": " << Pm_GetErrorText(err) << endl;
+}
+
+// d rescan | alias [NAME DEVICE] | unalias NAME
+void devices(Server &server, char **words) {
+  if (words[0] != 0 && words[0][0] == 'r') {
+    server.rescan_devices();
+    return;
+  }
+  if (words[0] != 0 && words[0][0] == 'a') {
+    if (words[1] == 0) {
+      server.list_device_aliases();
+      return;
+    }
+    std::string name;
+    for (int i = 2; words[i] != 0; ++i) {
+      if (!name.empty())
+        name += ' ';
+      name += words[i];
+    }
+    if (!name.empty()) {
+      server.add_device_alias(words[1], name.c_str());
+      return;
+    }
+  }
+  else if (words[0] != 0 && words[0][0] == 'u' && words[1] != 0) {
+    if (!server.remove_device_alias(words[1]))
+      cerr << "# no alias named " << words[1] << endl;
+    return;
+  }
+  cerr << "# d rescan | alias [NAME DEVICE] | unalias NAME" << endl;
+}
+
+// Selects the ports named by any ":handle" words following the command
+// and removes those words. Without any, commands read from all inputs and
+// send to the most recently opened output. Returns false if a handle is
+// unknown.
+bool select_ports(Server &server, char **words) {
+  int n = 1;
+
+  server.select_default_ports();
+  for (; words[n] != 0 && words[n][0] == ':'; ++n) {
+    if (!server.select_port(&words[n][1])) {
+      cerr << "# no open port named " << words[n] << endl;
+      return false;
+    }
+  }
+  if (n > 1) {
+    int i = 1;
+    do {
+      words[i] = words[i + n - 1];
+    } while (words[i++] != 0);
+  }
+  return true;
+}
+
+// route [:in :out [channel N] [transpose N] [drop TYPE,...] | clear | list]
+void route(Server &server, char **words) {
+  if (words[0] == 0) {
+    cerr << "# routing, type ^C to stop" << endl;
+    server.route_midi();
+    return;
+  }
+  if (words[0][0] == 'c') {
+    server.clear_routes();
+    return;
+  }
+  if (words[0][0] == 'l') {
+    server.list_routes();
+    return;
+  }
+  if (words[0][0] != ':' || words[1] == 0 || words[1][0] != ':') {
+    cerr << "# route [:in :out [channel N] [transpose N] [drop TYPE,...] | clear | list]" << endl;
+    return;
+  }
+
+  Route r;
+  r.channel = ROUTE_KEEP_CHANNEL;
+  r.transpose = 0;
+  r.drop_types = 0;
+  for (int i = 2; words[i] != 0; i += 2) {
+    if (words[i+1] == 0) {
+      cerr << "# missing value after " << words[i] << endl;
+      return;
+    }
+    switch (words[i][0]) {
+    case 'c':
+      r.channel = atoi(words[i+1]) - 1;
+      if (r.channel < 0 || r.channel >= MIDI_CHANNELS) {
+        cerr << "# channel must be 1-16" << endl;
+        return;
+      }
+      break;
+    case 't':
+      r.transpose = atoi(words[i+1]);
+      break;
+    case 'd':
+      if (!parse_route_types(words[i+1], &r.drop_types))
+        return;
+      break;
+    default:
+      cerr << "# unknown route option " << words[i] << endl;
+      return;
+    }
+  }
+  server.add_route(&words[0][1], &words[1][1], r);
+}
+
+// filter [off | [drop TYPE,...] [channels LIST] [cc LIST] [notes LO-HI]]
+void filter(Server &server, char **words) {
+  EventFilter f;
+  bool channels[MIDI_CHANNELS];
+  bool controllers[128];
+
+  if (words[0] == 0) {
+    server.print_input_filter();
+    return;
+  }
+  if (words[0][0] == 'o') {
+    server.set_input_filter(f);
+    server.print_input_filter();
+    return;
+  }
+
+  for (int i = 0; words[i] != 0; i += 2) {
+    if (words[i+1] == 0) {
+      cerr << "# missing value after " << words[i] << endl;
+      return;
+    }
+    switch (words[i][0]) {
+    case 'd': {
+      int32_t bits;
+      if (!parse_filter_types(words[i+1], &bits))
+        return;
+      f.set_drop_types(bits);
+      break;
+    }
+    case 'c':
+      if (words[i][1] == 'c') {
+        if (!parse_number_list(words[i+1], 0, 127, controllers))
+          return;
+        f.set_controllers(controllers);
+      }
+      else {
+        if (!parse_number_list(words[i+1], 1, MIDI_CHANNELS, channels))
+          return;
+        int mask = 0;
+        for (int chan = 0; chan < MIDI_CHANNELS; ++chan)
+          if (channels[chan])
+            mask |= Pm_Channel(chan);
+        f.set_channels(mask);
+      }
+      break;
+    case 'n': {
+      bool notes[128];
+      if (!parse_number_list(words[i+1], 0, 127, notes))
+        return;
+      int low = 0, high = 127;
+      while (!notes[low])
+        ++low;
+      while (!notes[high])
+        --high;
+      f.set_note_range(low, high);
+      break;
+    }
+    default:
+      cerr << "# unknown filter option " << words[i] << endl;
+      return;
+    }
+  }
+  server.set_input_filter(f);
+  server.print_input_filter();
+}
+
+// record file.mid [0 | 1]
+void record(Server &server, char **words) {
+  int format = 0;
+
+  if (words[0] == 0 || (words[1] != 0 && strcmp(words[1], "0") != 0 && strcmp(words[1], "1") != 0)) {
+    cerr << "# record file.mid [0 | 1]" << endl;
+    return;
+  }
+  if (words[1] != 0)
+    format = atoi(words[1]);
+  cerr << "# recording, type ^C to stop" << endl;
+  server.record_midi(words[0], format);
+}
+
+/*
+ * Runs `words` if it is one of the commands that have to be typed in full
+ * because their first letters were already taken. Returns false if it
+ * isn't one of them.
+ */
+bool run_word_command(Server &server, char **words) {
+  const char *cmd = words[0];
+
+  if (strcmp(cmd, "record") == 0) {
+    if (!server.is_input_open())
+      cerr << "# please select an input port first" << endl;
+    else if (select_ports(server, words))
+      record(server, &words[1]);
+  }
+  else if (strcmp(cmd, "route") == 0) {
+    if (!server.is_input_open())
+      cerr << "# please select an input port first" << endl;
+    else
+      route(server, &words[1]);
+  }
+  else if (strcmp(cmd, "filter") == 0)
+    filter(server, &words[1]);
+  else if (strcmp(cmd, "stats") == 0) {
+    if (words[1] != 0 && words[1][0] == 'r')
+      server.reset_stats();
+    else
+      server.print_stats();
+  }
+  else if (strcmp(cmd, "pace") == 0)
+    pace(server, &words[1]);
+  else if (strcmp(cmd, "wait") == 0)
+    Pt_Sleep(words[1] == 0 ? 0 : atol(words[1]));
+  else if (strcmp(cmd, "repeat") == 0 || strcmp(cmd, "end") == 0)
+    cerr << "# repeat only works in scripts run with -s" << endl;
+  else
+    return false;
+  return true;
+}
+
+// Runs the command in `words`. Returns false if it was quit.
+bool run_command(Server &server, char **words) {
+  server.print_paced_sends();
+  if (run_word_command(server, words))
+    return true;
+
+  // dispatch action based on first character of first word
+  char cmd = words[0][0];
+  if (cmd != 0 && strchr(PORT_COMMANDS, cmd) != nullptr && !select_ports(server, words))
+    return true;
+  switch (cmd) {
+  case 'l':
+    server.list_all_devices();
+    break;
+  case 'd':
+    devices(server, &words[1]);
+    break;
+  case 'a':
+    archive(server, &words[1]);
+    break;
+  case 'o':
+    open_port(server, &words[1]);
+    break;
+  case 'c':
+    if (words[1] == 0 || words[1][0] != ':')
+      cerr << "# close :handle" << endl;
+    else if (!server.close_port(&words[1][1]))
+      cerr << "# no open port named " << words[1] << endl;
+    break;
+  case 's':
+    if (!server.is_output_open())
+      cerr << "# please select an output port first" << endl;
+    else
+      server.send_file_or_bytes(&words[1]);
+    break;
+  case 'r':
+    if (!server.is_input_open())
+      cerr << "# please select an input port first" << endl;
+    else
+      server.receive_and_print_sysex_bytes();
+    break;
+  case 'w':
+    if (!server.is_input_open())
+      cerr << "# please select an input port first" << endl;
+    else if (words[1] == 0 || (words[2] != 0 && (words[2][0] != 'u' || words[3] == 0)))
+      cerr << "# w outfile [unpack N]" << endl;
+    else
+      server.receive_and_save_sysex_bytes(words[1], words[2] == 0 ? -1 : atol(words[3]));
+    break;
+  case 'b':
+    if (!server.is_input_open())
+      cerr << "# please select an input port first" << endl;
+    else if (words[1] == 0)
+      cerr << "# b outfile [count N] [bytes N] [idle MS] [unpack N]" << endl;
+    else {
+      BulkLimits limits;
+      long unpack_header;
+      if (parse_bulk_limits(&words[2], &limits, &unpack_header))
+        server.receive_bulk_sysex(words[1], limits, unpack_header);
+    }
+    break;
+  case 'm':
+    if (!server.is_input_open())
+      cerr << "# please select an input port first" << endl;
+    else {
+      MonitorFormat format;
+      if (parse_monitor_format(words[1], &format)) {
+        // Keep stdout clean for tools reading JSON or binary records
+        if (format == MONITOR_TEXT)
+          cout << "type ^C to stop monitoring" << endl;
+        else
+          cerr << "# type ^C to stop monitoring" << endl;
+        server.monitor_midi(format);
+      }
+    }
+    break;
+  case 'p':
+    for (int i = 1; words[i] != 0; ++i) {
+      if (i > 1) cout << ' ';
+      cout << words[i];
+    }
+    cout << endl;
+    break;
+  case 'x':
+    if (!server.is_input_open() || !server.is_output_open())
+      cerr << "# please select output and input ports first" << endl;
+    else {
+      server.expect_reply();
+      server.send_file_or_bytes(&words[1]);
+      server.receive_and_print_sysex_bytes();
+    }
+    break;
+  case 't':
+    if (!server.is_input_open() || !server.is_output_open())
+      cerr << "# please select output and input ports first" << endl;
+    else
+      transact(server, &words[1]);
+    break;
+  case 'f':
+    if (!server.is_input_open())
+      cerr << "# please select an inport port" << endl;
+    else {
+      server.expect_reply();
+      server.send_file_or_bytes(&words[2]);
+      server.receive_and_save_sysex_bytes(words[1]);
+    }
+    break;
+  case 'h': case '?':
+    help();
+    break;
+  case 'q':
+    return false;
+  case '#':
+    // comment, ignore
+    break;
+  default:
+    if (cmd != 0)
+      cerr << "# unknown command " << words[0] << ", type 'h' for help" << endl;
+    break;
+  }
+  return true;
+}
+
+// Commands that wait for input, run until ^C, or wait for paced output.
+// Socket clients can't use them, since they would hold up every other
+// client.
+bool command_blocks(char **words) {
+  if (strcmp(words[0], "route") == 0)
+    return words[1] == 0;
+  if (strcmp(words[0], "record") == 0 || strcmp(words[0], "pace") == 0
+      || strcmp(words[0], "wait") == 0)
+    return true;
+  if (strcmp(words[0], "filter") == 0 || strcmp(words[0], "stats") == 0)
+    return false;
+
+  switch (words[0][0]) {
+  case 'r': case 'w': case 'b': case 'x': case 't': case 'f':
+    return true;
+  case 'a':
+    return words[1] != 0 && words[1][0] == 's';
+  default:
+    return false;
+  }
+}
+
+// Runs a command for a socket client
+bool run_client_command(Server &server, char **words) {
+  if (command_blocks(words)) {
+    cerr << "# " << words[0] << " can't be used over a socket"
+         << (strcmp(words[0], "pace") == 0 ? "" : "; use monitor") << endl;
+    return true;
+  }
+  return run_command(server, words);
+}
+
+// Applies the command line settings and opens the ports it names
+void configure(Server &server, struct opts *opts) {
   int err;
 
+  server.set_wait_mode(opts->wait_mode);
+  server.set_timing(opts->timing);
+  server.set_preallocate(opts->preallocate);
+  server.set_batch_size(opts->batch_size);
+  server.set_latency(opts->latency);
+  server.set_reply_timeout(opts->reply_timeout);
+  for (std::string &alias : opts->aliases) {
+    size_t equals = alias.find('=');
+    server.add_device_alias(alias.substr(0, equals).c_str(), alias.substr(equals + 1).c_str());
+  }
+  if (opts->store_dir[0] != 0 && !server.open_capture_store(opts->store_dir)) {
+    server.shutdown();
+    exit(1);
+  }
+  if (opts->hotplug && !opts->loopback && !server.watch_hotplug())
+    cerr << "# can't watch for devices being plugged in; use \"d rescan\"" << endl;
+
   if (opts->input_port[0] != 0) {
-    err = server.open_input(opts->input_port);
+    err = server.open_input(opts->input_port, nullptr);
     if (err != 0)
       cerr << "# error opening input port " << opts->input_port << endl;
   }
   if (opts->output_port[0] != 0) {
-    err = server.open_output(opts->output_port);
+    err = server.open_output(opts->output_port, nullptr);
     if (err != 0)
-      cerr << "# error opening input port " << opts->output_port << endl;
+      cerr << "# error opening output port " << opts->output_port << endl;
   }
+}
+
+void run(Server &server) {
+  char line[LINE_BUFSIZ],  *words[MAX_WORDS];
 
   while (1) {
     // get input, quitting if we see EOF
@@ -62,112 +683,52 @@ void run(Server &server, struct opts *opts) {
       continue;
     }
     split_line_into_words(line, words);
-
-    // dispatch action based on first character of first word
-    char cmd = words[0][0];
-    std::string str;
-    switch (cmd) {
-    case 'l':
-      server.list_all_devices();
-      break;
-    case 'o':
-      if (words[1] == 0 || words[1][0] == 0 || words[2] == 0 || words[2] == 0) {
-        cerr <<  "# open input/output N" << endl;
-        break;
-      }
-      switch (words[1][0]) {
-      case 'o':
-        str = std::string(words[2]);
-        for (int i = 3; words[0] != 0; ++i) {
-          str += ' ';
-          str += words[i];
-          i += 1;
-        }
-        err = server.open_output(str.c_str());
-        // TODO check error
-        break;
-      case 'i':
-        str = std::string(words[2]);
-        for (int i = 3; words[0] != 0; ++i) {
-          str += ' ';
-          str += words[i];
-          i += 1;
-        }
-        err = server.open_input(str.c_str());
-        // TODO check error
-        break;
-      default:
-        cout <<  "# error: unknown subcommand " << words[1] << endl;
-        break;
-      }
-      break;
-    case 's':
-      if (!server.is_output_open())
-        cerr << "# please select an output port first" << endl;
-      else
-        server.send_file_or_bytes(&words[1]);
-      break;
-    case 'r':
-      if (!server.is_input_open())
-        cerr << "# please select an input port first" << endl;
-      else
-        server.receive_and_print_sysex_bytes();
-      break;
-    case 'w':
-      if (!server.is_input_open())
-        cerr << "# please select an input port first" << endl;
-      else
-        server.receive_and_save_sysex_bytes(words[1]);
-      break;
-    case 'm':
-      if (!server.is_input_open())
-        cerr << "# please select an input port first" << endl;
-      else {
-        cout << "type ^C to stop monitoring" << endl;
-        server.monitor_midi();
-      }
-      break;
-    case 'p':
-      for (int i = 1; words[i] != 0; ++i) {
-        if (i > 1) cout << ' ';
-        cout << words[i];
-      }
-      cout << endl;
-      break;
-    case 'x':
-      if (!server.is_input_open() || !server.is_output_open())
-        cerr << "# please select output and input ports first" << endl;
-      else {
-        server.send_file_or_bytes(&words[1]);
-        server.receive_and_print_sysex_bytes();
-      }
-      break;
-    case 'f':
-      if (!server.is_input_open())
-        cerr << "# please select an inport port" << endl;
-      else {
-        server.send_file_or_bytes(&words[2]);
-        server.receive_and_save_sysex_bytes(words[1]);
-      }
-      break;
-    case 'h': case '?':
-      help();
-      break;
-    case 'q':
+    if (words[0] == 0)
+      continue;
+    server.rescan_if_hotplugged();
+    if (!run_command(server, words))
       return;
-    case '#':
-      // comment, ignore
-      break;
-    default:
-      if (cmd != 0)
-        cerr << "# unknown command " << words[0] << ", type 'h' for help" << endl;
-      break;
-    }       
   }
 }
 
+// Compiles and runs the script in `path`, which ends at its last line or
+// a quit. Returns false if it couldn't be read or compiled.
+bool run_script(Server &server, const char *path, bool timing) {
+  FILE *in = fopen(path, "r");
+  if (in == nullptr) {
+    perror(path);
+    return false;
+  }
+
+  Script script;
+  bool compiled = script.compile(in, server);
+  fclose(in);
+  if (!compiled)
+    return false;
+
+  script.run(server, run_command);
+  const ScriptTiming &stats = script.timing();
+  if (timing && stats.waits > 0)
+    cerr << "# " << stats.waits << " waits, " << stats.late << " started late, by up to "
+         << stats.max_late_us << " us" << endl;
+  return true;
+}
+
+// Parses a comma-separated list of generator streams into `streams`
+bool parse_generator_streams(char *specs, std::vector<GeneratorStream> &streams) {
+  char *spec;
+
+  while ((spec = strsep(&specs, ",")) != nullptr) {
+    GeneratorStream stream;
+    if (!parse_generator_stream(spec, &stream))
+      return false;
+    streams.push_back(stream);
+  }
+  return true;
+}
+
 void usage(const char *prog_name) {
-  cerr << "usage: " << basename((char *)prog_name) << " [-l] [-i] [-o]\n"
+  cerr << "usage: " << basename((char *)prog_name) << " [-l] [-i] [-o] [-w] [-t] [-a] [-b] [-L] [-T] [-A] [-H] [-C] [-B] [-G] [-S] [-s]\n"
        << endl
        << "    -l or --list-ports" << endl
        << "        List all attached MIDI ports" << endl
@@ -178,6 +739,55 @@ void usage(const char *prog_name) {
        << "    -o or --output PORT" << endl
        << "        Use output port PORT" << endl
        << endl
+       << "    -w or --wait poll|block" << endl
+       << "        How to wait for input: poll every 10 ms (the default) or block" << endl
+       << "        until input arrives. Either way, the input is polled every 1 ms" << endl
+       << "        on a background thread while it is open." << endl
+       << endl
+       << "    -t or --timing" << endl
+       << "        Print input wakeup latency after receiving or monitoring" << endl
+       << endl
+       << "    -a or --preallocate BYTES" << endl
+       << "        Preallocate sysex capture files; BYTES may end in k or m" << endl
+       << endl
+       << "    -b or --batch N" << endl
+       << "        Send up to N short messages per PortMidi write (default 256);" << endl
+       << "        1 sends each message separately" << endl
+       << endl
+       << "    -L or --latency MS" << endl
+       << "        Open outputs with MS ms of latency so that +N delays in sent" << endl
+       << "        data are scheduled by PortMidi" << endl
+       << endl
+       << "    -T or --timeout MS" << endl
+       << "        Wait up to MS ms for a sysex reply (default 10000)" << endl
+       << endl
+       << "    -A or --alias ALIAS=DEVICE" << endl
+       << "        Let ALIAS stand for the device named DEVICE; may be repeated" << endl
+       << endl
+       << "    -H or --hotplug on|off" << endl
+       << "        Rescan devices and reopen ports when MIDI devices are plugged in" << endl
+       << "        or unplugged (default on)" << endl
+       << endl
+       << "    -C or --store DIR" << endl
+       << "        Keep captures made with the a command in DIR, created if needed" << endl
+       << endl
+       << "    -B or --backend portmidi|loopback" << endl
+       << "        Use PortMidi (the default) or the in-memory loopback devices" << endl
+       << endl
+       << "    -G or --generate TYPE[:RATE[:SIZE]],..." << endl
+       << "        Use the loopback devices, with the generator input sending cc," << endl
+       << "        clock or SIZE-byte sysex at RATE messages/sec (0 is flat out)" << endl
+       << endl
+       << "    -S or --listen PATH | [HOST:]PORT" << endl
+       << "        Serve commands to any number of clients on a Unix socket (PATH" << endl
+       << "        contains a '/') or TCP port instead of reading stdin" << endl
+       << endl
+       << "    -s or --script FILE" << endl
+       << "        Compile the commands in FILE, checking ports and loading the files" << endl
+       << "        it sends, then run them instead of reading stdin. Scripts can use" << endl
+       << "        repeat N ... end, and their waits keep to time across repeats." << endl
+       << "        With -S, run it before serving clients" << endl
+       << endl
        << "    -h or --help" << endl
        << "        This help" << endl;
 }
@@ -188,13 +798,37 @@ void parse_command_line(int argc, char * const *argv, struct opts *opts) {
     {"list", no_argument, 0, 'l'},
     {"input-port", required_argument, 0, 'i'},
     {"output-port", required_argument, 0, 'o'},
+    {"wait", required_argument, 0, 'w'},
+    {"timing", no_argument, 0, 't'},
+    {"preallocate", required_argument, 0, 'a'},
+    {"batch", required_argument, 0, 'b'},
+    {"latency", required_argument, 0, 'L'},
+    {"timeout", required_argument, 0, 'T'},
+    {"alias", required_argument, 0, 'A'},
+    {"hotplug", required_argument, 0, 'H'},
+    {"store", required_argument, 0, 'C'},
+    {"backend", required_argument, 0, 'B'},
+    {"generate", required_argument, 0, 'G'},
+    {"listen", required_argument, 0, 'S'},
+    {"script", required_argument, 0, 's'},
     {"help", no_argument, 0, 'h'},
     {0, 0, 0, 0}
   };
 
   opts->list_devices = false;
   opts->input_port[0] = opts->output_port[0] = 0;
-  while ((ch = getopt_long(argc, argv, "li:o:h", longopts, 0)) != -1) {
+  opts->wait_mode = WAIT_POLL;
+  opts->timing = false;
+  opts->preallocate = 0;
+  opts->batch_size = DEFAULT_BATCH_SIZE;
+  opts->latency = 0;
+  opts->reply_timeout = DEFAULT_REPLY_TIMEOUT_MILLISECS;
+  opts->hotplug = true;
+  opts->loopback = false;
+  opts->listen_address[0] = 0;
+  opts->script_path[0] = 0;
+  opts->store_dir[0] = 0;
+  while ((ch = getopt_long(argc, argv, "li:o:w:ta:b:L:T:A:H:C:B:G:S:s:h", longopts, 0)) != -1) {
     switch (ch) {
     case 'l':
       opts->list_devices = true;
@@ -205,6 +839,72 @@ void parse_command_line(int argc, char * const *argv, struct opts *opts) {
     case 'o':
       strncpy(opts->output_port, optarg, BUFSIZ);
       break;
+    case 'w':
+      if (strcmp(optarg, "block") == 0)
+        opts->wait_mode = WAIT_BLOCK;
+      else if (strcmp(optarg, "poll") == 0)
+        opts->wait_mode = WAIT_POLL;
+      else {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 't':
+      opts->timing = true;
+      break;
+    case 'a':
+      opts->preallocate = parse_size(optarg);
+      break;
+    case 'b':
+      opts->batch_size = atoi(optarg);
+      break;
+    case 'L':
+      opts->latency = atoi(optarg);
+      break;
+    case 'T':
+      opts->reply_timeout = atol(optarg);
+      break;
+    case 'A':
+      if (strchr(optarg, '=') == nullptr) {
+        usage(argv[0]);
+        exit(1);
+      }
+      opts->aliases.push_back(optarg);
+      break;
+    case 'H':
+      if (strcmp(optarg, "on") == 0)
+        opts->hotplug = true;
+      else if (strcmp(optarg, "off") == 0)
+        opts->hotplug = false;
+      else {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'C':
+      strncpy(opts->store_dir, optarg, BUFSIZ);
+      break;
+    case 'B':
+      if (strcmp(optarg, "loopback") == 0)
+        opts->loopback = true;
+      else if (strcmp(optarg, "portmidi") == 0)
+        opts->loopback = false;
+      else {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'G':
+      if (!parse_generator_streams(optarg, opts->generator_streams))
+        exit(1);
+      opts->loopback = true;
+      break;
+    case 'S':
+      strncpy(opts->listen_address, optarg, BUFSIZ);
+      break;
+    case 's':
+      strncpy(opts->script_path, optarg, BUFSIZ);
+      break;
     case 'h': default:
       usage(argv[0]);
       exit(ch == '?' || ch == 'h' ? 0 : 1);
@@ -213,15 +913,40 @@ void parse_command_line(int argc, char * const *argv, struct opts *opts) {
 }
 
 int main(int argc, char * const *argv) {
-  Server server;
   struct opts opts;
+  LoopbackBackend *loopback = nullptr;
 
   parse_command_line(argc, argv, &opts);
+  if (opts.loopback) {
+    loopback = new LoopbackBackend();
+    for (GeneratorStream &stream : opts.generator_streams)
+      loopback->add_generator_stream(stream);
+  }
+
+  Server server(loopback);
   if (opts.list_devices) {
     server.list_all_devices();
-    exit(0);
+    return 0;
+  }
+  configure(server, &opts);
+  if (opts.script_path[0] != 0 && !run_script(server, opts.script_path, opts.timing))
+    return 1;
+  if (opts.listen_address[0] != 0) {
+    SocketServer socket_server(server, run_client_command);
+    // Paced output and long scheduled sends would hold up every client
+    if (server.is_pacing()) {
+      server.wait_for_output();
+      server.set_pacing_delay(0, 0);
+      cerr << "# pacing is off over a socket" << endl;
+    }
+    server.set_sleeping_sends(false);
+    if (!socket_server.listen(opts.listen_address))
+      return 1;
+    socket_server.run();
   }
-  run(server, &opts);
-  exit(0);
+  else if (opts.script_path[0] == 0)
+    run(server);
+  // Returning rather than calling exit() runs ~Server, stopping the input
+  // reader, before the backend's static destructor terminates PortMidi
   return 0;
 }
@@ -0,0 +1,70 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>
+#include <stddef.h>
+
+// A lock-free ring buffer for exactly one producer thread and one consumer
+// thread. Capacity is rounded up to a power of two.
+template <typename T>
+class RingBuffer {
+public:
+  RingBuffer(size_t min_capacity) : head(0), tail(0) {
+    capacity = 1;
+    while (capacity < min_capacity)
+      capacity <<= 1;
+    mask = capacity - 1;
+    items = new T[capacity];
+  }
+  ~RingBuffer() { delete[] items; }
+
+  size_t size() const {
+    return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+
+  // Producer only. Copies as many of the `n` items as will fit and returns
+  // the number copied.
+  size_t push(const T *src, size_t n) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t room = capacity - (t - head.load(std::memory_order_acquire));
+    if (n > room)
+      n = room;
+    for (size_t i = 0; i < n; ++i)
+      items[(t + i) & mask] = src[i];
+    tail.store(t + n, std::memory_order_release);
+    return n;
+  }
+
+  // Consumer only. Copies up to `max` items into `dest` and returns the
+  // number copied.
+  size_t pop(T *dest, size_t max) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t avail = tail.load(std::memory_order_acquire) - h;
+    if (max > avail)
+      max = avail;
+    for (size_t i = 0; i < max; ++i)
+      dest[i] = items[(h + i) & mask];
+    head.store(h + max, std::memory_order_release);
+    return max;
+  }
+
+  // Consumer only. Discards everything currently in the buffer.
+  void clear() {
+    head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+  }
+
+private:
+  T *items;
+  size_t capacity;
+  size_t mask;
+  // Head and tail increase forever and are masked on use. They live on
+  // separate cache lines so that producer and consumer don't contend.
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+
+  RingBuffer(const RingBuffer &);
+  RingBuffer &operator=(const RingBuffer &);
+};
+
+#endif /* RING_BUFFER_H */
@@ -0,0 +1,238 @@
+#include <iostream>
+#include <string>
+#include <string.h>
+#include "consts.h"
+#include "porttime.h"
+#include "router.h"
+
+using std::cerr;
+using std::endl;
+using std::vector;
+
+static const struct {
+  const char *name;
+  unsigned int bits;
+} ROUTE_TYPE_NAMES[] = {
+  {"note", ROUTE_NOTE},
+  {"ppress", ROUTE_POLY_PRESSURE},
+  {"cntrl", ROUTE_CONTROLLER},
+  {"pchg", ROUTE_PROGRAM_CHANGE},
+  {"cpress", ROUTE_CHANNEL_PRESSURE},
+  {"pbend", ROUTE_PITCH_BEND},
+  {"sysex", ROUTE_SYSEX},
+  {"common", ROUTE_SYSTEM_COMMON},
+  {"realtime", ROUTE_REALTIME},
+  {nullptr, 0}
+};
+
+// ROUTE_* bit for each channel message high nibble, 0x80 through 0xe0
+static const unsigned int CHANNEL_TYPE_BITS[] = {
+  ROUTE_NOTE, ROUTE_NOTE, ROUTE_POLY_PRESSURE, ROUTE_CONTROLLER,
+  ROUTE_PROGRAM_CHANGE, ROUTE_CHANNEL_PRESSURE, ROUTE_PITCH_BEND
+};
+
+bool parse_route_types(const char *names, unsigned int *bits) {
+  *bits = 0;
+  while (*names) {
+    size_t len = strcspn(names, ",");
+    int i;
+    for (i = 0; ROUTE_TYPE_NAMES[i].name != nullptr; ++i) {
+      if (strlen(ROUTE_TYPE_NAMES[i].name) == len
+          && strncmp(ROUTE_TYPE_NAMES[i].name, names, len) == 0)
+        break;
+    }
+    if (ROUTE_TYPE_NAMES[i].name == nullptr) {
+      cerr << "# unknown message type " << std::string(names, len)
+           << "; use note, ppress, cntrl, pchg, cpress, pbend, sysex, common, realtime"
+           << endl;
+      return false;
+    }
+    *bits |= ROUTE_TYPE_NAMES[i].bits;
+    names += len;
+    if (*names == ',')
+      ++names;
+  }
+  return true;
+}
+
+std::string route_type_names(unsigned int bits) {
+  std::string names;
+  for (int i = 0; ROUTE_TYPE_NAMES[i].name != nullptr; ++i) {
+    if ((bits & ROUTE_TYPE_NAMES[i].bits) != 0) {
+      if (!names.empty())
+        names += ',';
+      names += ROUTE_TYPE_NAMES[i].name;
+    }
+  }
+  return names;
+}
+
+static bool contains_eox(PmMessage msg) {
+  for (int i = 0; i < 4; ++i)
+    if (((msg >> (i * 8)) & 0xff) == EOX)
+      return true;
+  return false;
+}
+
+bool route_message(Route &route, PmMessage &msg) {
+  byte status = Pm_MessageStatus(msg);
+
+  // Sysex arrives four bytes per event; continuation events start with a
+  // data byte and go wherever the start of their message went
+  if (status == SYSEX || status < NOTE_OFF) {
+    if (status == SYSEX)
+      route.in_sysex = true;
+    else if (!route.in_sysex)
+      return false;
+    if (contains_eox(msg))
+      route.in_sysex = false;
+    return (route.drop_types & ROUTE_SYSEX) == 0;
+  }
+
+  if (status >= CLOCK)          // may arrive in the middle of sysex
+    return (route.drop_types & ROUTE_REALTIME) == 0;
+  route.in_sysex = false;
+  if (status == EOX)
+    return (route.drop_types & ROUTE_SYSEX) == 0;
+  if (status > SYSEX)
+    return (route.drop_types & ROUTE_SYSTEM_COMMON) == 0;
+
+  int high_nibble = status & 0xf0;
+  if ((route.drop_types & CHANNEL_TYPE_BITS[(high_nibble >> 4) - 8]) != 0)
+    return false;
+
+  int data1 = Pm_MessageData1(msg);
+  if (route.transpose != 0
+      && (high_nibble == NOTE_OFF || high_nibble == NOTE_ON || high_nibble == POLY_PRESSURE)) {
+    data1 += route.transpose;
+    if (data1 < 0 || data1 > 127)
+      return false;
+  }
+  if (route.channel != ROUTE_KEEP_CHANNEL)
+    status = high_nibble | route.channel;
+  msg = Pm_Message(status, data1, Pm_MessageData2(msg));
+  return true;
+}
+
+void Router::add(const Route &route) {
+  routes.push_back(route);
+  routes.back().in_sysex = false;
+  rebuild_batches();
+}
+
+void Router::remove_input(int input_id) {
+  for (size_t i = 0; i < routes.size(); ) {
+    if (routes[i].input_id == input_id)
+      routes.erase(routes.begin() + i);
+    else
+      ++i;
+  }
+  rebuild_batches();
+}
+
+void Router::remove_output(int output_id) {
+  for (size_t i = 0; i < routes.size(); ) {
+    if (routes[i].output_id == output_id)
+      routes.erase(routes.begin() + i);
+    else
+      ++i;
+  }
+  rebuild_batches();
+}
+
+void Router::set_output(int output_id, PortMidiStream *output) {
+  for (Route &route : routes)
+    if (route.output_id == output_id)
+      route.output = output;
+  rebuild_batches();
+}
+
+void Router::clear() {
+  routes.clear();
+  batches.clear();
+}
+
+// One batch per distinct output, however many routes lead to it
+void Router::rebuild_batches() {
+  batches.clear();
+  for (Route &route : routes) {
+    size_t i;
+    for (i = 0; i < batches.size(); ++i)
+      if (batches[i].output == route.output)
+        break;
+    if (i == batches.size()) {
+      batches.push_back(OutputBatch());
+      batches.back().output = route.output;
+      batches.back().num_events = 0;
+    }
+    route.batch = (int)i;
+  }
+}
+
+void Router::forward(const PmEvent *events, const int *port_ids, int num_events) {
+  long long timestamp_sum = 0;
+  PmTimestamp oldest = 0;
+  long num_forwarded = 0;
+
+  for (int i = 0; i < num_events; ++i) {
+    for (Route &route : routes) {
+      if (route.input_id != port_ids[i])
+        continue;
+
+      PmMessage msg = events[i].message;
+      if (!route_message(route, msg))
+        continue;
+
+      OutputBatch &batch = batches[route.batch];
+      // Timestamp 0 means "now", even if the output has a latency
+      batch.events[batch.num_events].message = msg;
+      batch.events[batch.num_events].timestamp = 0;
+      if (++batch.num_events == ROUTE_BATCH_SIZE)
+        flush(batch);
+
+      if (num_forwarded == 0 || events[i].timestamp < oldest)
+        oldest = events[i].timestamp;
+      timestamp_sum += events[i].timestamp;
+      ++num_forwarded;
+    }
+  }
+  for (OutputBatch &batch : batches)
+    flush(batch);
+
+  events_in += num_events;
+  if (num_forwarded > 0) {
+    PmTimestamp now = Pt_Time();
+    events_out += num_forwarded;
+    total_latency_ms += (long long)now * num_forwarded - timestamp_sum;
+    if (now - oldest > max_latency_ms)
+      max_latency_ms = now - oldest;
+  }
+}
+
+void Router::flush(OutputBatch &batch) {
+  if (batch.num_events == 0)
+    return;
+  if (batch.output == nullptr) {  // unplugged
+    batch.num_events = 0;
+    return;
+  }
+
+  PmError err = midi->write(batch.output, batch.events, batch.num_events);
+  if (err < 0)
+    cerr << "# error routing messages: " << Pm_GetErrorText(err) << endl;
+  batch.num_events = 0;
+}
+
+void Router::reset_stats() {
+  events_in = events_out = 0;
+  total_latency_ms = 0;
+  max_latency_ms = 0;
+}
+
+void Router::print_stats() {
+  cerr << "# routed " << events_in << " events in, " << events_out << " out";
+  if (events_out > 0)
+    cerr << ", latency avg " << (double)total_latency_ms / events_out
+         << " ms, max " << max_latency_ms << " ms";
+  cerr << endl;
+}
@@ -0,0 +1,94 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <string>
+#include <vector>
+#include "midi_backend.h"
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+// Message types a route can drop, as bits in Route.drop_types
+#define ROUTE_NOTE 0x001        // note on and off
+#define ROUTE_POLY_PRESSURE 0x002
+#define ROUTE_CONTROLLER 0x004
+#define ROUTE_PROGRAM_CHANGE 0x008
+#define ROUTE_CHANNEL_PRESSURE 0x010
+#define ROUTE_PITCH_BEND 0x020
+#define ROUTE_SYSEX 0x040
+#define ROUTE_SYSTEM_COMMON 0x080
+#define ROUTE_REALTIME 0x100
+
+#define ROUTE_KEEP_CHANNEL -1
+// Events sent per write call
+#define ROUTE_BATCH_SIZE 256
+
+// Forwards messages from one input to one output, transforming them on
+// the way
+typedef struct Route {
+  int input_id;                 // Port.id of the input
+  int output_id;                // Port.id of the output
+  PortMidiStream *output;       // nullptr while the output is unplugged
+  int channel;                  // 0-15, or ROUTE_KEEP_CHANNEL
+  int transpose;                // semitones; notes pushed out of range are dropped
+  unsigned int drop_types;      // ROUTE_* bits
+  bool in_sysex;                // inside a sysex message from the input
+  int batch;                    // index of the output's batch in Router
+} Route;
+
+// Parses a comma-separated list of type names ("note,cntrl,realtime")
+// into ROUTE_* bits. Returns false and prints an error for unknown names.
+bool parse_route_types(const char *names, unsigned int *bits);
+// The reverse of parse_route_types
+std::string route_type_names(unsigned int bits);
+
+// Applies `route`'s filter and transforms to `msg` in place. Returns false
+// if the message should not be forwarded.
+bool route_message(Route &route, PmMessage &msg);
+
+// Forwards events from inputs to outputs according to a list of routes.
+// Events for each output are collected into a fixed batch and written
+// with one write per input batch, so forwarding never allocates.
+class Router {
+public:
+  Router(MidiBackend *midi) : midi(midi) { reset_stats(); }
+
+  void add(const Route &route);
+  // Removes routes from the input with `input_id` or to the output with
+  // `output_id`
+  void remove_input(int input_id);
+  void remove_output(int output_id);
+  // Sends routes to the output with `output_id` to a new stream, or
+  // nowhere if `output` is nullptr, after the output is reopened
+  void set_output(int output_id, PortMidiStream *output);
+  void clear();
+  const std::vector<Route> &all() const { return routes; }
+  bool empty() const { return routes.empty(); }
+
+  void forward(const PmEvent *events, const int *port_ids, int num_events);
+
+  // Input to output latency, measured from PortMidi's input timestamps
+  // to the time the events are written
+  void reset_stats();
+  void print_stats();
+
+private:
+  typedef struct OutputBatch {
+    PortMidiStream *output;
+    PmEvent events[ROUTE_BATCH_SIZE];
+    int num_events;
+  } OutputBatch;
+
+  MidiBackend *midi;
+  std::vector<Route> routes;
+  std::vector<OutputBatch> batches;
+  long events_in;
+  long events_out;
+  long long total_latency_ms;
+  long max_latency_ms;
+
+  void rebuild_batches();
+  void flush(OutputBatch &batch);
+};
+
+#endif /* ROUTER_H */
@@ -0,0 +1,360 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include "script.h"
+#include "util.h"
+
+using std::cerr;
+using std::endl;
+
+#define NANOSECS_PER_SEC 1000000000L
+
+// Parses a non-negative number, the whole word
+static bool parse_count(const char *word, long *count) {
+  char *end;
+
+  if (word == nullptr || !isdigit((unsigned char)word[0]))
+    return false;
+  *count = strtol(word, &end, 10);
+  return *end == 0;
+}
+
+bool Script::compile(FILE *in, Server &server) {
+  char *line = nullptr;
+  size_t line_size = 0;
+  int line_number = 0;
+  bool ok = true;
+
+  steps.clear();
+  open_repeats.clear();
+  known_handles = server.port_handles();
+  devices_may_change = false;
+
+  while (getline(&line, &line_size, in) != -1)
+    if (!compile_line(line, ++line_number, server))
+      ok = false;
+  free(line);
+
+  for (size_t i : open_repeats) {
+    cerr << "# line " << steps[i].line << ": repeat without end" << endl;
+    ok = false;
+  }
+  if (!ok)
+    return false;
+
+  // Split command lines only now, since the strings don't move again
+  char *words[MAX_WORDS];
+  for (ScriptStep &step : steps) {
+    if (step.type != STEP_COMMAND)
+      continue;
+    split_line_into_words(&step.text[0], words);
+    for (int i = 0; words[i] != 0; ++i)
+      step.words.push_back(words[i]);
+    step.words.push_back(nullptr);
+  }
+  return true;
+}
+
+bool Script::compile_line(char *line, int line_number, Server &server) {
+  char *words[MAX_WORDS];
+  ScriptStep step;
+
+  step.type = STEP_COMMAND;
+  step.line = line_number;
+  step.text = line;
+  step.input = false;
+  step.device = -1;
+  step.reply = REPLY_NONE;
+  step.count = 0;
+  step.jump = 0;
+
+  split_line_into_words(line, words);
+  if (words[0] == 0 || words[0][0] == '#')
+    return true;
+
+  // Commands that have to be typed in full
+  if (strcmp(words[0], "repeat") == 0) {
+    if (!parse_count(words[1], &step.count)) {
+      cerr << "# line " << line_number << ": repeat N" << endl;
+      return false;
+    }
+    step.type = STEP_REPEAT;
+    open_repeats.push_back(steps.size());
+  }
+  else if (strcmp(words[0], "end") == 0) {
+    if (open_repeats.empty()) {
+      cerr << "# line " << line_number << ": end without repeat" << endl;
+      return false;
+    }
+    step.type = STEP_END;
+    step.jump = open_repeats.back();
+    steps[step.jump].jump = steps.size();
+    open_repeats.pop_back();
+  }
+  else if (strcmp(words[0], "wait") == 0) {
+    if (!parse_count(words[1], &step.count)) {
+      cerr << "# line " << line_number << ": wait MS" << endl;
+      return false;
+    }
+    step.type = STEP_WAIT;
+  }
+  else if (strcmp(words[0], "record") == 0 || strcmp(words[0], "route") == 0) {
+    if (!check_handles(words, line_number, nullptr))
+      return false;
+  }
+  else if (strcmp(words[0], "filter") == 0 || strcmp(words[0], "stats") == 0
+           || strcmp(words[0], "pace") == 0)
+    ;
+  else if (!compile_letter_command(words, step, server))
+    return false;
+
+  steps.push_back(step);
+  return true;
+}
+
+// Compiles the commands that can be shortened to their first letter
+bool Script::compile_letter_command(char **words, ScriptStep &step, Server &server) {
+  int line_number = step.line;
+
+  switch (words[0][0]) {
+  case 'o':
+    if (!compile_open(words, step, server))
+      return false;
+    break;
+  case 's':
+    if (!compile_send(words, step, server))
+      return false;
+    break;
+  case 'x':
+    step.reply = REPLY_PRINT;
+    if (!compile_send(words, step, server))
+      return false;
+    break;
+  case 'f':
+    step.reply = REPLY_SAVE;
+    if (!compile_send(words, step, server))
+      return false;
+    break;
+  case 'c':
+    if (!check_handles(words, line_number, nullptr))
+      return false;
+    if (words[1] != 0 && words[1][0] == ':')
+      known_handles.erase(std::remove(known_handles.begin(), known_handles.end(),
+                                      std::string(&words[1][1])),
+                          known_handles.end());
+    break;
+  case 'd':
+    if (words[1] != 0 && words[1][0] == 'r')
+      devices_may_change = true;
+    else if (words[1] != 0 && words[1][0] == 'a' && words[2] != 0 && words[3] != 0) {
+      // Later open commands are resolved now, so they need the alias now
+      std::string name;
+      for (int i = 3; words[i] != 0; ++i) {
+        if (!name.empty())
+          name += ' ';
+        name += words[i];
+      }
+      server.add_device_alias(words[2], name.c_str());
+    }
+    break;
+  case 'p': case 'h': case '?': case 'l': case 'q':
+    break;
+  default:
+    if (!check_handles(words, line_number, nullptr))
+      return false;
+    break;
+  }
+  return true;
+}
+
+/*
+ * open input/output N|name [:handle], parsed as the open command does.
+ * After a "d rescan" device numbers may change before the open runs, so
+ * it is left for the command to find the device then.
+ */
+bool Script::compile_open(char **words, ScriptStep &step, Server &server) {
+  std::string name, handle;
+
+  if (words[1] == 0 || (words[1][0] != 'i' && words[1][0] != 'o') || words[2] == 0) {
+    cerr << "# line " << step.line << ": open input/output N [:handle]" << endl;
+    return false;
+  }
+  step.input = words[1][0] == 'i';
+  for (int i = 2; words[i] != 0; ++i) {
+    if (words[i][0] == ':' && words[i+1] == 0) {
+      handle = &words[i][1];
+      break;
+    }
+    if (!name.empty())
+      name += ' ';
+    name += words[i];
+  }
+  if (name.empty() || (words[2][0] == ':' && handle.empty())) {
+    cerr << "# line " << step.line << ": open input/output N [:handle]" << endl;
+    return false;
+  }
+  if (handle.empty())
+    handle = step.input ? DEFAULT_INPUT_HANDLE : DEFAULT_OUTPUT_HANDLE;
+  if (!is_known_handle(handle))
+    known_handles.push_back(handle);
+  if (devices_may_change)
+    return true;
+
+  step.device = server.find_device(name.c_str(), step.input);
+  if (step.device == DEVICE_NOT_FOUND) {
+    cerr << "# line " << step.line << ": no " << (step.input ? "input" : "output")
+         << " named \"" << name << "\"" << endl;
+    return false;
+  }
+  if (step.device == DEVICE_AMBIGUOUS) {
+    cerr << "# line " << step.line << ": \"" << name << "\" matches more than one "
+         << (step.input ? "input" : "output") << "; use more of its name or its number" << endl;
+    return false;
+  }
+  step.type = STEP_OPEN;
+  step.handles.push_back(handle);
+  return true;
+}
+
+// s|x [:handle...] @file|.file|bytes, or f [:handle...] outfile @file|.file|bytes
+bool Script::compile_send(char **words, ScriptStep &step, Server &server) {
+  if (!check_handles(words, step.line, &step.handles))
+    return false;
+
+  int first = 1 + step.handles.size();
+  if (step.reply == REPLY_SAVE && words[first] != 0)
+    step.path = words[first++];
+  if (words[first] == 0) {
+    cerr << "# line " << step.line << ": nothing to send" << endl;
+    return false;
+  }
+  if (!server.load_file_or_bytes(&words[first], step.bytes, step.delays)) {
+    cerr << "# line " << step.line << ": can't read " << &words[first][1] << endl;
+    return false;
+  }
+  step.type = STEP_SEND;
+  return true;
+}
+
+// Checks the ":handle" words following the command, and returns them
+// without the ':' in `handles` if it isn't null
+bool Script::check_handles(char **words, int line_number, std::vector<std::string> *handles) {
+  for (int i = 1; words[i] != 0 && words[i][0] == ':'; ++i) {
+    if (!is_known_handle(&words[i][1])) {
+      cerr << "# line " << line_number << ": no port named " << words[i] << endl;
+      return false;
+    }
+    if (handles != nullptr)
+      handles->push_back(&words[i][1]);
+  }
+  return true;
+}
+
+bool Script::is_known_handle(const std::string &handle) const {
+  return std::find(known_handles.begin(), known_handles.end(), handle) != known_handles.end();
+}
+
+bool Script::run(Server &server, CommandHandler handler) {
+  std::vector<long> remaining(steps.size());
+  char *words[MAX_WORDS];
+
+  stats.waits = stats.late = stats.max_late_us = 0;
+  restart_schedule();
+  for (size_t i = 0; i < steps.size(); ++i) {
+    const ScriptStep &step = steps[i];
+
+    switch (step.type) {
+    case STEP_COMMAND:
+      // Commands may rearrange their words, so they get a copy each time
+      std::copy(step.words.begin(), step.words.end(), words);
+      server.rescan_if_hotplugged();
+      if (!handler(server, words))
+        return false;
+      restart_schedule();
+      break;
+    case STEP_OPEN: {
+      PmError err = step.input
+        ? server.open_input(std::to_string(step.device).c_str(), step.handles[0].c_str())
+        : server.open_output(std::to_string(step.device).c_str(), step.handles[0].c_str());
+      if (err != pmNoError)
+        cerr << "# line " << step.line << ": error opening " << (step.input ? "input" : "output")
+             << " port " << step.device << ": " << Pm_GetErrorText(err) << endl;
+      restart_schedule();
+      break;
+    }
+    case STEP_SEND:
+      run_send(server, step);
+      if (step.reply != REPLY_NONE)
+        restart_schedule();
+      break;
+    case STEP_WAIT:
+      wait(step.count);
+      break;
+    case STEP_REPEAT:
+      remaining[i] = step.count;
+      if (step.count == 0)
+        i = step.jump;
+      break;
+    case STEP_END:
+      if (--remaining[step.jump] > 0)
+        i = step.jump;
+      break;
+    }
+  }
+  return true;
+}
+
+void Script::run_send(Server &server, const ScriptStep &step) {
+  server.select_default_ports();
+  for (const std::string &handle : step.handles)
+    server.select_port(handle.c_str());
+
+  if (!server.is_output_open() || (step.reply != REPLY_NONE && !server.is_input_open())) {
+    cerr << "# line " << step.line << ": port not open" << endl;
+    return;
+  }
+  if (step.reply != REPLY_NONE)
+    server.expect_reply();
+  server.send(step.bytes, step.delays);
+  if (step.reply == REPLY_PRINT)
+    server.receive_and_print_sysex_bytes();
+  else if (step.reply == REPLY_SAVE)
+    server.receive_and_save_sysex_bytes(step.path.c_str());
+}
+
+/*
+ * Sleeps until `millisecs` after the previous wait ended, using an
+ * absolute deadline so that neither the time spent since then nor a
+ * signal interrupting the sleep throws the schedule off.
+ */
+void Script::wait(long millisecs) {
+  struct timespec now;
+
+  schedule.tv_sec += millisecs / 1000;
+  schedule.tv_nsec += (millisecs % 1000) * 1000000L;
+  if (schedule.tv_nsec >= NANOSECS_PER_SEC) {
+    schedule.tv_nsec -= NANOSECS_PER_SEC;
+    ++schedule.tv_sec;
+  }
+  ++stats.waits;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  long late_us = (now.tv_sec - schedule.tv_sec) * 1000000L
+    + (now.tv_nsec - schedule.tv_nsec) / 1000;
+  if (late_us > 0) {
+    // Start again from now rather than rushing to catch up
+    ++stats.late;
+    stats.max_late_us = std::max(stats.max_late_us, late_us);
+    schedule = now;
+    return;
+  }
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &schedule, nullptr) == EINTR)
+    ;
+}
+
+void Script::restart_schedule() {
+  clock_gettime(CLOCK_MONOTONIC, &schedule);
+}
@@ -0,0 +1,108 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "server.h"
+
+typedef enum StepType {
+  STEP_COMMAND,                 // any other command, run by the command handler
+  STEP_OPEN,                    // open a port on a device found when compiling
+  STEP_SEND,                    // send bytes loaded when compiling
+  STEP_WAIT,
+  STEP_REPEAT,                  // run the steps up to its STEP_END `count` times
+  STEP_END
+} StepType;
+
+// What a send step does after sending
+typedef enum ReplyAction {
+  REPLY_NONE,                   // s
+  REPLY_PRINT,                  // x
+  REPLY_SAVE                    // f, to `path`
+} ReplyAction;
+
+typedef struct ScriptStep {
+  StepType type;
+  int line;                     // in the script, for messages
+  // STEP_COMMAND: the line, split into `words` once compiling is done
+  std::string text;
+  std::vector<char *> words;
+  // STEP_OPEN: the device and handle; STEP_SEND: the ports to use
+  bool input;
+  int device;
+  std::vector<std::string> handles;
+  // STEP_SEND
+  std::vector<byte> bytes;
+  std::vector<SendDelay> delays;
+  ReplyAction reply;
+  std::string path;
+  // STEP_WAIT: milliseconds; STEP_REPEAT: times
+  long count;
+  // STEP_REPEAT: index of its STEP_END; STEP_END: index of its STEP_REPEAT
+  size_t jump;
+} ScriptStep;
+
+// How closely a script's waits kept to time
+typedef struct ScriptTiming {
+  long waits;
+  long late;                    // waits whose time had passed before they started
+  long max_late_us;
+} ScriptTiming;
+
+/*
+ * A script compiled up front into steps, so running it involves no
+ * parsing or file reading. Port handles and device names are checked and
+ * hex and binary files loaded while compiling, and every error in the
+ * script is reported before any of it runs.
+ *
+ * Besides the usual commands, scripts can use
+ *
+ *   repeat N ... end   run the commands in between N times; may be nested
+ *   wait MS            pause for MS milliseconds
+ *
+ * Waits keep to a schedule rather than sleeping for MS after whatever
+ * came before, so the time spent sending doesn't add up over a repeat:
+ * each wait ends MS after the previous one ended. Other commands, and
+ * sends that wait for a reply, restart the schedule. A wait whose time
+ * has already passed returns at once.
+ */
+class Script {
+public:
+  Script() : devices_may_change(false), stats() {}
+
+  // Compiles the script read from `in`, against the ports open in
+  // `server` and the devices it can see. Prints each error and returns
+  // false if there were any.
+  bool compile(FILE *in, Server &server);
+  // Runs the compiled script, passing commands it doesn't handle itself
+  // to `handler`. Returns false if the script quit.
+  bool run(Server &server, CommandHandler handler);
+
+  const std::vector<ScriptStep> &all_steps() const { return steps; }
+  const ScriptTiming &timing() const { return stats; }
+
+private:
+  std::vector<ScriptStep> steps;
+  std::vector<std::string> known_handles;
+  std::vector<size_t> open_repeats;
+  bool devices_may_change;      // a rescan comes before the current line
+  ScriptTiming stats;
+  struct timespec schedule;     // when the last wait ended
+
+  bool compile_line(char *line, int line_number, Server &server);
+  bool compile_open(char **words, ScriptStep &step, Server &server);
+  bool compile_letter_command(char **words, ScriptStep &step, Server &server);
+  bool compile_send(char **words, ScriptStep &step, Server &server);
+  bool check_handles(char **words, int line_number, std::vector<std::string> *handles);
+  bool is_known_handle(const std::string &handle) const;
+  void run_send(Server &server, const ScriptStep &step);
+  void wait(long millisecs);
+  void restart_schedule();
+
+  Script(const Script &);
+  Script &operator=(const Script &);
+};
+
+#endif /* SCRIPT_H */
@@ -1,25 +1,49 @@
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <iomanip>
+#include <string>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include "consts.h"
 #include "portmidi.h"
+#include "porttime.h"
+#include "hex.h"
+#include "mapped_file.h"
 #include "server.h"
+#include "seven_bit.h"
+#include "smf_recorder.h"
+#include "sysex_writer.h"
 #include "util.h"
 
-#define BYTES_BUFSIZ 8192
+// Default number of short messages sent per Pm_Write call
+#define OUTPUT_BATCH_SIZE 256
 #define MIDI_BUFSIZ 128
+// Input events buffered by the reader thread, 512 KB worth
+#define INPUT_RING_EVENTS 65536
 #define PM_EVENT_BUFSIZ 256
-#define WAIT_FOR_SYSEX_TIMEOUT_SECS 10
 // 10 milliseconds, in nanoseconds
 #define SLEEP_NANOSECS 10000000L
+// Longest a blocking wait sleeps before its caller checks for timeouts
+#define WAIT_BLOCK_MILLISECS 100
+// Output buffer size when scheduling, enough for SCHEDULE_AHEAD_MILLISECS
+// of dense data
+#define SCHEDULED_OUTPUT_BUFSIZ 4096
+#define SCHEDULE_AHEAD_MILLISECS 500
 #define HEX_FILE_NAME_INDICATOR_CHAR '@'
+#define DELAY_INDICATOR_CHAR '+'
 #define BIN_FILE_NAME_INDICATOR_CHAR '.'
-#define UNDEFINED_PORT -1
-
-#define is_realtime(b) ((b) >= CLOCK)
+// Words around 8-bit data to send packed into 7-bit data bytes
+#define PACK_START_CHAR '{'
+#define PACK_END_CHAR '}'
 
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
+using std::chrono::steady_clock;
 using std::cout;
 using std::cerr;
 using std::endl;
@@ -31,292 +55,1189 @@ using std::vector;
 
 typedef unsigned char byte;
 
-static const char * NOTE_NAMES[] = {
-  "C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"
-};
-
 sig_atomic_t monitoring;
 
-void cleanup() {
-  Pm_Terminate();
+Server::Server(MidiBackend *backend)
+  : midi(backend != nullptr ? backend : portmidi_backend()), devices(midi),
+    next_port_id(0), selected_input_id(-1), output(nullptr), router(midi),
+    last_arrival(-1), last_interval(-1), read_errors_at_reset(0), awaiting_reply(false),
+    sysex_state(SYSEX_WAITING), unpack_header(-1),
+    wait_mode(WAIT_POLL), input_reader(midi, INPUT_RING_EVENTS), timing(false),
+    preallocate_bytes(0), num_output_events(0), latency_ms(0), sleeping_sends(true),
+    reply_timeout_ms(DEFAULT_REPLY_TIMEOUT_MILLISECS), sysex_pacer(midi), monitor_format(MONITOR_TEXT), out(stdout)
+{
+  set_batch_size(OUTPUT_BATCH_SIZE);
+  reset_wait_stats();
 }
 
-Server::Server() : input(nullptr), output(nullptr), sysex_state(SYSEX_WAITING) {
-  Pm_Initialize();
+Server::~Server() {
+  shutdown();
+}
 
-  // Pm_Initialize(), when it looks for default devices, can set errno to a
-  // non-zero value. Reinitialize it here.
-  errno = 0;
+void Server::shutdown() {
+  wait_for_output();
+  flush_output_events();
+  input_reader.stop();
+  for (Port &port : inputs) {
+    if (port.stream != nullptr)
+      midi->close(port.stream);
+  }
+  for (Port &port : outputs) {
+    if (port.stream != nullptr)
+      midi->close(port.stream);
+  }
+  inputs.clear();
+  outputs.clear();
+  router.clear();
+  output = nullptr;
+  sysex_pacer.set_output(nullptr);
+  selected_input_id = -1;
+}
 
-  atexit(cleanup);
+bool parse_monitor_format(const char *word, MonitorFormat *format) {
+  if (word == nullptr || word[0] == 't')
+    *format = MONITOR_TEXT;
+  else if (word[0] == 'j')
+    *format = MONITOR_JSON;
+  else if (word[0] == 'b')
+    *format = MONITOR_BINARY;
+  else {
+    cerr << "# unknown monitor format " << word << endl;
+    return false;
+  }
+  return true;
 }
 
-void Server::list_devices(const char *title, vector<PmDeviceInfo *> &devices, bool print_inputs) {
+// Returns the port in `ports` using `handle`, or nullptr
+static Port *find_port(vector<Port> &ports, const char *handle) {
+  for (Port &port : ports)
+    if (port.handle == handle)
+      return &port;
+  return nullptr;
+}
+
+void Server::list_devices(const char *title, bool print_inputs) {
+  vector<Port> &ports = print_inputs ? inputs : outputs;
+
   cout << title << ":" << endl;
-  vector<PmDeviceInfo *>::iterator iter = devices.begin();
-  for (int i = 0; iter != devices.end(); ++iter, ++i) {
-    if ((print_inputs && !(*iter)->input) || (!print_inputs && !(*iter)->output))
+  for (const Device &device : devices.all()) {
+    if ((print_inputs && !device.input) || (!print_inputs && !device.output))
       continue;
 
-    const char *name = (*iter)->name;
+    const char *name = device.name.c_str();
     const char *q = (name[0] == ' ' || name[strlen(name)-1] == ' ') ? "\"" : "";
-    cout << "   " << setw(2) << i << ": "
-         << q << name << q
-         << ((*iter)->opened ? " (open)" : "")
-         << endl;
+    cout << "   " << setw(2) << device.id << ": "
+         << q << name << q;
+    std::string aliases = devices.aliases_for(device.id, print_inputs);
+    if (!aliases.empty())
+      cout << " [" << aliases << ']';
+    const char *separator = " (open as :";
+    for (Port &port : ports) {
+      if (port.device == device.id) {
+        cout << separator << port.handle;
+        separator = ", :";
+      }
+    }
+    if (separator[0] == ',')
+      cout << ')';
+    cout << endl;
   }
 }
 
 void Server::list_all_devices() {
-  vector<PmDeviceInfo *>devices;
-  int num_devices = Pm_CountDevices();
+  list_devices("Inputs", true);
+  list_devices("Outputs", false);
+
+  bool any_unplugged = false;
+  for (int i = 0; i < 2; ++i) {
+    for (Port &port : i == 0 ? inputs : outputs) {
+      if (port.stream != nullptr)
+        continue;
+      if (!any_unplugged)
+        cout << "Unplugged:" << endl;
+      any_unplugged = true;
+      cout << "   :" << port.handle << " (" << (i == 0 ? "input" : "output")
+           << ") " << port.device_name << endl;
+    }
+  }
+}
 
-  for (int i = 0; i < num_devices; ++i)
-    devices.push_back((PmDeviceInfo * const)Pm_GetDeviceInfo(i));
-  list_devices("Inputs", devices, true);
-  list_devices("Outputs", devices, false);
+void Server::list_device_aliases() {
+  for (auto &alias : devices.all_aliases())
+    cout << alias.first << '\t' << alias.second << endl;
 }
 
-PmError Server::open_input(const char *port_num_or_name) {
-  if (input != nullptr)
-    Pm_Close(input);
+PmError Server::open_input(const char *port_num_or_name, const char *handle) {
+  if (handle == nullptr)
+    handle = DEFAULT_INPUT_HANDLE;
+  close_input(handle);
 
-  int port;
-  if (isdigit(port_num_or_name[0]))
-    port = atoi(port_num_or_name);
-  else
-    port = port_number_matching_name(port_num_or_name, true);
-  return Pm_OpenInput(&input, port, 0, MIDI_BUFSIZ, 0, 0);
+  int device = port_number(port_num_or_name, true);
+  PortMidiStream *stream;
+  PmError err = open_input_stream(device, &stream);
+  if (err != pmNoError)
+    return err;
+
+  const Device *info = devices.device(device);
+  Port port = {handle, next_port_id++, device, info ? info->name : "", stream};
+  // Leftovers from inputs that have all since been closed aren't wanted
+  if (inputs.empty())
+    input_reader.clear();
+  inputs.push_back(port);
+  input_reader.add(stream, port.id);
+  return pmNoError;
 }
 
-PmError Server::open_output(const char *port_num_or_name) {
-  if (output != nullptr)
-    Pm_Close(output);
+PmError Server::open_input_stream(int device, PortMidiStream **stream) {
+  PmError err = midi->open_input(stream, device, MIDI_BUFSIZ);
+  if (err != pmNoError)
+    return err;
 
-  int port;
-  if (isdigit(port_num_or_name[0]))
-    port = atoi(port_num_or_name);
+  midi->set_filter(*stream, input_filter.pm_filter());
+  midi->set_channel_mask(*stream, input_filter.pm_channel_mask());
+  return pmNoError;
+}
+
+/*
+ * Opens an output and makes it the selected one. If `latency_ms` is
+ * non-zero, PortMidi will deliver messages at their timestamps plus that
+ * latency, which is what makes delays in sent data accurate.
+ */
+PmError Server::open_output(const char *port_num_or_name, const char *handle) {
+  if (handle == nullptr)
+    handle = DEFAULT_OUTPUT_HANDLE;
+  close_output(handle);
+
+  int device = port_number(port_num_or_name, false);
+  PortMidiStream *stream;
+  PmError err = open_output_stream(device, &stream);
+  if (err != pmNoError)
+    return err;
+
+  const Device *info = devices.device(device);
+  Port port = {handle, next_port_id++, device, info ? info->name : "", stream};
+  outputs.push_back(port);
+  select_default_ports();
+  return pmNoError;
+}
+
+PmError Server::open_output_stream(int device, PortMidiStream **stream) {
+  return midi->open_output(stream, device,
+                           latency_ms > 0 ? SCHEDULED_OUTPUT_BUFSIZ : MIDI_BUFSIZ,
+                           latency_ms);
+}
+
+/*
+ * Closes every port, since PortMidi can't look for devices with any
+ * open, and reopens them afterwards by device name, keeping their Port
+ * ids so that the input reader's tags, routes and socket clients'
+ * monitors and locks carry on working. Input arriving while the ports are
+ * closed is lost.
+ */
+void Server::rescan_devices() {
+  int selected_output_id = -1;
+
+  wait_for_output();
+  flush_output_events();
+  input_reader.stop();
+  for (Port &port : inputs) {
+    if (port.stream != nullptr)
+      midi->close(port.stream);
+  }
+  for (Port &port : outputs) {
+    if (port.stream == nullptr)
+      continue;
+    if (port.stream == output)
+      selected_output_id = port.id;
+    router.set_output(port.id, nullptr);
+    midi->close(port.stream);
+  }
+  output = nullptr;
+  sysex_pacer.set_output(nullptr);
+
+  PmError err = midi->rescan();
+  if (err != pmNoError)
+    cerr << "# error rescanning devices: " << Pm_GetErrorText(err) << endl;
+  devices.refresh();
+
+  for (Port &port : inputs)
+    reopen_port(port, true);
+  for (Port &port : outputs) {
+    reopen_port(port, false);
+    if (port.id == selected_output_id && port.stream != nullptr) {
+      output = port.stream;
+      sysex_pacer.set_output(output);
+    }
+  }
+  if (output == nullptr && !outputs.empty() && outputs.back().stream != nullptr) {
+    output = outputs.back().stream;
+    sysex_pacer.set_output(output);
+  }
+}
+
+// Reopens `port` on the device with the name it had, if it's there
+void Server::reopen_port(Port &port, bool input) {
+  bool was_unplugged = port.device < 0;
+  int device = devices.find_exact(port.device_name, input);
+
+  port.stream = nullptr;
+  port.device = -1;
+  if (device == DEVICE_NOT_FOUND) {
+    if (!was_unplugged)
+      cerr << "# " << port.device_name << " is unplugged; :" << port.handle
+           << " will reopen when it's back" << endl;
+    return;
+  }
+
+  PortMidiStream *stream;
+  PmError err = input ? open_input_stream(device, &stream) : open_output_stream(device, &stream);
+  if (err != pmNoError) {
+    cerr << "# error reopening :" << port.handle << ": " << Pm_GetErrorText(err) << endl;
+    return;
+  }
+  port.stream = stream;
+  port.device = device;
+  if (input)
+    input_reader.add(stream, port.id);
   else
-    port = port_number_matching_name(port_num_or_name, false);
-  return Pm_OpenOutput(&output, port, 0, 128, 0, 0, 0);
+    router.set_output(port.id, stream);
+  if (was_unplugged)
+    cerr << "# reopened :" << port.handle << " on " << port.device_name << endl;
 }
 
-int Server::port_number_matching_name(const char *name, bool match_inputs) {
-  vector<PmDeviceInfo *>devices;
-  int num_devices = Pm_CountDevices();
+void Server::rescan_if_hotplugged() {
+  last_hotplug_check = steady_clock::now();
+  if (devices.hotplug_seen())
+    rescan_devices();
+}
+
+// For loops that run until ^C: rescans on hotplug, checking now and then
+void Server::check_hotplug() {
+  if (devices.hotplug_fd() < 0)
+    return;
+  if (duration_cast<milliseconds>(steady_clock::now() - last_hotplug_check).count()
+      >= HOTPLUG_CHECK_MILLISECS)
+    rescan_if_hotplugged();
+}
 
-  for (int i = 0; i < num_devices; ++i) {
-    PmDeviceInfo * const device = (PmDeviceInfo * const)Pm_GetDeviceInfo(i);
-    if ((match_inputs && !device->input) || (!match_inputs && !device->output))
+void Server::set_input_filter(const EventFilter &filter) {
+  input_filter = filter;
+  input_filter.compile();
+  for (Port &port : inputs) {
+    if (port.stream == nullptr)
       continue;
+    midi->set_filter(port.stream, input_filter.pm_filter());
+    midi->set_channel_mask(port.stream, input_filter.pm_channel_mask());
+  }
+}
+
+bool Server::close_port(const char *handle) {
+  bool closed_input = close_input(handle);
+  bool closed_output = close_output(handle);
+  return closed_input || closed_output;
+}
+
+vector<std::string> Server::port_handles() const {
+  vector<std::string> handles;
+
+  for (const Port &port : inputs)
+    handles.push_back(port.handle);
+  for (const Port &port : outputs)
+    handles.push_back(port.handle);
+  return handles;
+}
+
+bool Server::close_input(const char *handle) {
+  Port *port = find_port(inputs, handle);
+  if (port == nullptr)
+    return false;
+
+  router.remove_input(port->id);
+  if (port->stream != nullptr) {
+    input_reader.remove(port->stream);
+    midi->close(port->stream);
+  }
+  if (selected_input_id == port->id)
+    selected_input_id = -1;
+  inputs.erase(inputs.begin() + (port - inputs.data()));
+  return true;
+}
+
+bool Server::close_output(const char *handle) {
+  Port *port = find_port(outputs, handle);
+  if (port == nullptr)
+    return false;
 
-    if (strncasecmp(name, device->name, BUFSIZ) == 0)
-      return i;
+  if (port->stream != nullptr && port->stream == output) {
+    sysex_pacer.set_output(nullptr);
+    output = nullptr;
   }
-  return UNDEFINED_PORT;
+  router.remove_output(port->id);
+  if (port->stream != nullptr)
+    midi->close(port->stream);
+  outputs.erase(outputs.begin() + (port - outputs.data()));
+  select_default_ports();
+  return true;
 }
 
+bool Server::select_port(const char *handle) {
+  Port *input_port = find_port(inputs, handle);
+  Port *output_port = find_port(outputs, handle);
+
+  if (input_port != nullptr)
+    selected_input_id = input_port->id;
+  if (output_port != nullptr && output_port->stream != output) {
+    output = output_port->stream;
+    sysex_pacer.set_output(output);
+  }
+  return input_port != nullptr || output_port != nullptr;
+}
+
+void Server::select_default_ports() {
+  PortMidiStream *stream = outputs.empty() ? nullptr : outputs.back().stream;
+
+  selected_input_id = -1;
+  if (stream != output) {
+    output = stream;
+    sysex_pacer.set_output(output);
+  }
+}
+
+int Server::port_number(const char *port_num_or_name, bool match_inputs) {
+  int device = devices.find(port_num_or_name, match_inputs);
+  if (device == DEVICE_AMBIGUOUS)
+    cerr << "# \"" << port_num_or_name << "\" matches more than one "
+         << (match_inputs ? "input" : "output") << "; use more of its name or its number" << endl;
+  return device;
+}
+
+/*
+ * Prints the next sysex message as a hexdump, a line at a time as it
+ * arrives.
+ */
 void Server::receive_and_print_sysex_bytes() {
-  struct timespec rqtp = {0, SLEEP_NANOSECS};
-  time_t start_time = time(nullptr);
+  steady_clock::time_point start_time = steady_clock::now();
+  SysexProgress progress = {-1, 0};
+  SysexMessage *message;
 
-  sysex_state = SYSEX_WAITING;
-  while (sysex_state != SYSEX_DONE) {
-    if (difftime(time(nullptr), start_time) >= WAIT_FOR_SYSEX_TIMEOUT_SECS) {
-      cerr << "it's been " << WAIT_FOR_SYSEX_TIMEOUT_SECS << " seconds";
-      switch (sysex_state) {
-      case SYSEX_WAITING:
+  reset_wait_stats();
+  while ((message = sysex_assembler.next()) == nullptr) {
+    if (duration_cast<milliseconds>(steady_clock::now() - start_time).count() >= reply_timeout_ms) {
+      cerr << "it's been " << reply_timeout_ms << " ms";
+      if (sysex_assembler.partial() == nullptr) {
         cerr << " and I haven't seen a SYSEX message" << endl;
+        awaiting_reply = false;
+        out.flush();
         return;
-      case SYSEX_PROCESSING:
-        cerr << " and I'm still getting SYSEX!" << endl;
-        break;
-      default:
-        break;
       }
+      cerr << " and I'm still getting SYSEX!" << endl;
     }
-    if (Pm_Poll(input) == TRUE)
-      read_and_process_sysex();
-    else {
-      if (nanosleep(&rqtp, nullptr) == -1)
-        return;                 // TODO handle error
+    if (wait_for_input() && !read_sysex() && sysex_assembler.partial() != nullptr)
+      print_sysex(sysex_assembler.partial(), progress, false);
+  }
+  print_sysex(message, progress, true);
+  sysex_assembler.release(message);
+  out.flush();
+  report_wait_stats();
+}
+
+/*
+ * Saves the next sysex message to a file, writing it a batch at a time as
+ * it arrives.
+ */
+void Server::receive_and_save_sysex_bytes(const char * const output_path, long unpack_header) {
+  SysexWriter writer;
+  if (!writer.open(output_path, preallocate_bytes))
+    return;
+
+  steady_clock::time_point start_time = steady_clock::now();
+  SysexProgress progress = {-1, 0};
+  SysexMessage *message;
+
+  this->unpack_header = unpack_header;
+  reset_wait_stats();
+  while ((message = sysex_assembler.next()) == nullptr) {
+    if (duration_cast<milliseconds>(steady_clock::now() - start_time).count() >= reply_timeout_ms) {
+      cerr << "it's been " << reply_timeout_ms << " ms";
+      if (sysex_assembler.partial() == nullptr) {
+        cerr << " and I haven't seen a SYSEX message" << endl;
+        awaiting_reply = false;
+        writer.close();
+        return;
+      }
+      cerr << " and I'm still getting SYSEX!" << endl;
     }
+    if (wait_for_input() && !read_sysex() && sysex_assembler.partial() != nullptr)
+      save_sysex(writer, sysex_assembler.partial(), progress);
   }
+  save_sysex(writer, message, progress);
+  sysex_assembler.release(message);
+
+  if (writer.close())
+    writer.print_throughput();
+  report_wait_stats();
 }
 
-void Server::receive_and_save_sysex_bytes(const char * const output_path) {
-  struct timespec rqtp = {0, SLEEP_NANOSECS};
+/*
+ * Receives any number of sysex messages into one file until one of the
+ * limits in `limits` is reached. Writes "offset length" lines describing
+ * each message to `output_path` + ".idx".
+ */
+void Server::receive_bulk_sysex(const char * const output_path, const BulkLimits &limits,
+                                long unpack_header)
+{
+  SysexWriter writer;
+  if (!writer.open(output_path, preallocate_bytes))
+    return;
 
-  FILE *fp = fopen(output_path, "w");
-  if (fp == nullptr) {
-    perror("error opening output file");
+  std::string index_path = std::string(output_path) + ".idx";
+  FILE *index = fopen(index_path.c_str(), "w");
+  if (index == nullptr) {
+    perror("error opening index file");
+    writer.close();
     return;
   }
 
-  time_t start_time = time(nullptr);
-  sysex_state = SYSEX_WAITING;
-  while (sysex_state != SYSEX_DONE) {
-    if (difftime(time(nullptr), start_time) >= WAIT_FOR_SYSEX_TIMEOUT_SECS) {
-      cerr << "it's been " << WAIT_FOR_SYSEX_TIMEOUT_SECS << " seconds";
-      switch (sysex_state) {
-      case SYSEX_WAITING:
-        cerr << " and I haven't seen a SYSEX message" << endl;
-        return;
-      case SYSEX_PROCESSING:
-        cerr << " and I'm still getting SYSEX!" << endl;
-        break;
-      default:
+  BulkCapture bulk = {limits, &writer, index, nullptr, 0, 0, false, steady_clock::time_point()};
+  this->unpack_header = unpack_header;
+  receive_bulk(bulk);
+
+  fclose(index);
+  cerr << "# received " << bulk.messages << " sysex messages" << endl;
+  if (writer.close())
+    writer.print_throughput();
+  report_wait_stats();
+}
+
+/*
+ * Receives into the capture store. Messages the store already has, from
+ * earlier captures or earlier in this one, take no more space.
+ */
+void Server::receive_into_store(const char *name, const BulkLimits &limits) {
+  if (!check_capture_store(name))
+    return;
+
+  Capture capture;
+  capture_store.begin(capture);
+  BulkCapture bulk = {limits, nullptr, nullptr, &capture, 0, 0, false, steady_clock::time_point()};
+  receive_bulk(bulk);
+
+  if (bulk.messages > 0 && capture_store.finish(capture, name))
+    print_capture_stats(capture);
+  report_wait_stats();
+}
+
+// Receives until one of the limits of `bulk` is reached
+void Server::receive_bulk(BulkCapture &bulk) {
+  steady_clock::time_point start_time = steady_clock::now();
+  bulk.last_message_time = start_time;
+
+  reset_wait_stats();
+  while (!bulk.done) {
+    if (wait_for_input())
+      read_sysex();
+    bulk_save_sysex(bulk);
+    if (bulk.done || sysex_assembler.partial() != nullptr)
+      continue;
+
+    long idle_ms = duration_cast<milliseconds>(steady_clock::now() - bulk.last_message_time).count();
+    if (bulk.messages == 0) {
+      if (idle_ms >= reply_timeout_ms) {
+        cerr << "it's been " << reply_timeout_ms << " ms"
+             << " and I haven't seen a SYSEX message" << endl;
+        awaiting_reply = false;
         break;
       }
     }
-    if (Pm_Poll(input) == TRUE)
-      read_and_save_sysex(fp);
-    else {
-      if (nanosleep(&rqtp, nullptr) == -1)
-        return;                 // TODO handle error
-    }
+    else if (bulk.limits.idle_ms > 0 && idle_ms >= bulk.limits.idle_ms)
+      break;
   }
+}
+
+void Server::import_capture(const char *name, const char *path) {
+  Capture capture;
 
-  fclose(fp);
+  if (check_capture_store(name) && capture_store.import(name, path, capture))
+    print_capture_stats(capture);
+}
+
+void Server::extract_capture(const char *name, const char *path) {
+  if (check_capture_store(name) && capture_store.extract(name, path))
+    cerr << "# wrote " << path << endl;
+}
+
+void Server::list_captures() {
+  vector<CaptureInfo> captures;
+  uint64_t total = 0;
+
+  if (!check_capture_store("") || !capture_store.list(captures))
+    return;
+  for (const CaptureInfo &info : captures) {
+    cout << info.name << "\t" << info.header.size << " bytes\t" << info.header.messages
+         << " messages\t" << info.header.num_extents << " extents" << endl;
+    total += info.header.size;
+  }
+  cout << captures.size() << " captures, " << total << " bytes, stored in "
+       << capture_store.stored_bytes() << " bytes (" << capture_store.stored_objects()
+       << " distinct messages)" << endl;
+}
+
+// Prints an error and returns false if there's no store or `name` can't
+// be used. An empty name only checks for the store.
+bool Server::check_capture_store(const char *name) {
+  if (!capture_store.is_open()) {
+    cerr << "# no capture store; start pmserver with -C DIR" << endl;
+    return false;
+  }
+  if (name[0] != 0 && !CaptureStore::valid_name(name)) {
+    cerr << "# bad capture name " << name << endl;
+    return false;
+  }
+  return true;
+}
+
+void Server::print_capture_stats(const Capture &capture) {
+  cerr << "# stored " << capture.messages << " messages, " << capture.size << " bytes; "
+       << capture.new_messages << " new, " << capture.new_bytes << " bytes" << endl;
+}
+
+/*
+ * Keeps up to `window` requests waiting for replies at once instead of
+ * waiting for each reply before sending the next request. Replies are
+ * printed as they arrive, so they can come out of request order if the
+ * device answers out of order.
+ */
+void Server::transact(char **words, size_t window, long timeout_ms, const ReplyPattern &pattern) {
+  vector<byte> bytes;
+  vector<SendDelay> delays;
+
+  if (!load_file_or_bytes(words, bytes, delays))
+    return;
+  if (!delays.empty())
+    cerr << "# warning: delays ignored, requests are sent as the window allows" << endl;
+
+  TransactionQueue queue(window, timeout_ms > 0 ? timeout_ms : reply_timeout_ms, pattern);
+  if (queue.add_requests(bytes.data(), bytes.size()) == 0) {
+    cerr << "# no sysex requests to send" << endl;
+    return;
+  }
+
+  steady_clock::time_point start_time = steady_clock::now();
+  vector<size_t> expired;
+  long unmatched = 0;
+
+  reset_wait_stats();
+  awaiting_reply = false;       // round trips are recorded per request
+  while (!queue.done()) {
+    long i;
+    while ((i = queue.next_to_send(steady_clock::now())) >= 0)
+      send_request(queue.request(i), queue.request_length(i));
+
+    if (wait_for_input())
+      read_sysex();
+    match_replies(queue, &unmatched);
+
+    expired.clear();
+    queue.expire(steady_clock::now(), expired);
+    if (!expired.empty())
+      out.flush();
+    for (size_t index : expired)
+      cerr << "# request " << index << " timed out" << endl;
+  }
+  out.flush();
+
+  long ms = duration_cast<milliseconds>(steady_clock::now() - start_time).count();
+  cerr << "# " << queue.size() << " requests, " << queue.answered() << " answered, "
+       << queue.timed_out() << " timed out";
+  if (unmatched > 0)
+    cerr << ", " << unmatched << " other sysex messages ignored";
+  cerr << " in " << ms << " ms" << endl;
+  report_wait_stats();
 }
 
 void stop_monitoring(int _sig) {
   monitoring = 0;
 }
 
-void Server::monitor_midi() {
-  struct timespec rqtp = {0, SLEEP_NANOSECS};
-  time_t start_time = time(nullptr);
+void Server::monitor_midi(MonitorFormat format) {
   struct sigaction action = {stop_monitoring, SIGINT, SA_RESETHAND};
 
   sigaction(SIGINT, &action, nullptr);
 
+  monitor_format = format;
+  sysex_state = SYSEX_WAITING;
+  reset_wait_stats();
   monitoring = 1;
   while (monitoring == 1) {
-    if (Pm_Poll(input) == TRUE)
+    check_hotplug();
+    if (wait_for_input())
       read_and_process_any_message();
-    else {
-      if (nanosleep(&rqtp, nullptr) == -1)
-        return;                 // TODO handle error
-    }
   }
+  out.flush();
+  report_wait_stats();
 }
 
-byte Server::char_to_nibble(const char ch) {
-    switch (ch) {
-    case '0': case '1': case '2': case '3': case '4':
-    case '5': case '6': case '7': case '8': case '9':
-      return (byte)(ch - '0');
-      break;
-    case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
-      return (byte)(ch - 'a' + 10);
-      break;
-    case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
-      return (byte)(ch - 'A' + 10);
-      break;
-    default:
-      throw "error";
+/*
+ * Records everything arriving on the input into a Standard MIDI File of
+ * type `smf_format` until ^C.
+ */
+void Server::record_midi(const char * const path, int smf_format) {
+  SmfRecorder recorder;
+  PmEvent events[PM_EVENT_BUFSIZ];
+  struct sigaction action = {stop_monitoring, SIGINT, SA_RESETHAND};
+
+  if (!recorder.open(path, smf_format, Pt_Time()))
+    return;
+  sigaction(SIGINT, &action, nullptr);
+
+  reset_wait_stats();
+  monitoring = 1;
+  while (monitoring == 1) {
+    check_hotplug();
+    if (!wait_for_input())
+      continue;
+    int num_read = read_events(events, PM_EVENT_BUFSIZ);
+    for (int i = 0; i < num_read; ++i)
+      recorder.record(events[i]);
+  }
+  if (recorder.close())
+    cerr << "# recorded " << recorder.events() << " events to " << path << endl;
+  report_wait_stats();
+}
+
+bool Server::add_route(const char *from, const char *to, Route &route) {
+  Port *input_port = find_port(inputs, from);
+  Port *output_port = find_port(outputs, to);
+
+  if (input_port == nullptr) {
+    cerr << "# no open input named :" << from << endl;
+    return false;
+  }
+  if (output_port == nullptr) {
+    cerr << "# no open output named :" << to << endl;
+    return false;
+  }
+  route.input_id = input_port->id;
+  route.output_id = output_port->id;
+  route.output = output_port->stream;
+  router.add(route);
+  return true;
+}
+
+void Server::list_routes() {
+  for (const Route &route : router.all()) {
+    for (Port &port : inputs)
+      if (port.id == route.input_id)
+        cout << ':' << port.handle;
+    for (Port &port : outputs)
+      if (port.id == route.output_id)
+        cout << " -> :" << port.handle;
+    if (route.channel != ROUTE_KEEP_CHANNEL)
+      cout << " channel " << route.channel + 1;
+    if (route.transpose != 0)
+      cout << " transpose " << route.transpose;
+    if (route.drop_types != 0)
+      cout << " drop " << route_type_names(route.drop_types);
+    cout << endl;
+  }
+}
+
+/*
+ * Forwards input to outputs according to the routes until ^C. This always
+ * blocks waiting for input, whatever the wait mode, so that events are
+ * forwarded as soon as the input reader sees them.
+ */
+void Server::route_midi() {
+  PmEvent events[PM_EVENT_BUFSIZ];
+  int port_ids[PM_EVENT_BUFSIZ];
+  struct sigaction action = {stop_monitoring, SIGINT, SA_RESETHAND};
+
+  sigaction(SIGINT, &action, nullptr);
+
+  // The router writes to the streams itself, so the pacer mustn't be
+  // writing to one of them too
+  wait_for_output();
+  reset_wait_stats();
+  router.reset_stats();
+  monitoring = 1;
+  while (monitoring == 1) {
+    check_hotplug();
+    if (!input_reader.wait(WAIT_BLOCK_MILLISECS))
+      continue;
+    int num_read = input_reader.read(events, PM_EVENT_BUFSIZ, port_ids);
+    if (!input_filter.keeps_everything())
+      num_read = input_filter.apply(events, num_read, port_ids);
+    router.forward(events, port_ids, num_read);
+  }
+  router.print_stats();
+  report_wait_stats();
+}
+
+/*
+ * Waits for input according to `wait_mode` and returns true if there is
+ * something to read. Returns false after a short sleep otherwise, so that
+ * callers can check their timeouts and loop.
+ */
+bool Server::wait_for_input() {
+  if (wait_mode == WAIT_BLOCK)
+    return input_reader.wait(WAIT_BLOCK_MILLISECS);
+
+  struct timespec rqtp = {0, SLEEP_NANOSECS};
+  if (input_reader.has_input())
+    return true;
+  nanosleep(&rqtp, nullptr);
+  return false;
+}
+
+/*
+ * Reads up to `max_events` events buffered by the input reader and records
+ * how long the first one waited between arriving and being read. If an
+ * input has been selected, events from the others are dropped, as are
+ * events the input filter doesn't want.
+ */
+int Server::read_input(PmEvent *events, int *port_ids, int max_events) {
+  int num_read = input_reader.read(events, max_events, port_ids);
+
+  if (!input_filter.keeps_everything())
+    num_read = input_filter.apply(events, num_read, port_ids);
+  record_arrivals(events, num_read);
+  return num_read;
+}
+
+int Server::input_port_id(const char *handle) {
+  Port *port = find_port(inputs, handle);
+  return port == nullptr ? -1 : port->id;
+}
+
+const char *Server::default_output_handle() {
+  return outputs.empty() ? nullptr : outputs.back().handle.c_str();
+}
+
+int Server::read_events(PmEvent *events, int max_events) {
+  int num_read;
+
+  if (selected_input_id < 0)
+    num_read = input_reader.read(events, max_events);
+  else {
+    int port_ids[PM_EVENT_BUFSIZ];
+    if (max_events > PM_EVENT_BUFSIZ)
+      max_events = PM_EVENT_BUFSIZ;
+    int n = input_reader.read(events, max_events, port_ids);
+    num_read = 0;
+    for (int i = 0; i < n; ++i)
+      if (port_ids[i] == selected_input_id)
+        events[num_read++] = events[i];
+  }
+  if (num_read > 0) {
+    long latency = Pt_Time() - events[0].timestamp;
+    ++wait_stats.reads;
+    wait_stats.events += num_read;
+    wait_stats.total_latency_ms += latency;
+    if (latency > wait_stats.max_latency_ms)
+      wait_stats.max_latency_ms = latency;
+  }
+  if (!input_filter.keeps_everything())
+    num_read = input_filter.apply(events, num_read, nullptr);
+  record_arrivals(events, num_read);
+  return num_read;
+}
+
+/*
+ * Records the intervals between messages' PortMidi timestamps, and how
+ * much each interval differs from the one before. Sysex continuation
+ * events are skipped since they arrive together.
+ */
+void Server::record_arrivals(const PmEvent *events, int num_events) {
+  for (int i = 0; i < num_events; ++i) {
+    if (Pm_MessageStatus(events[i].message) < NOTE_OFF)
+      continue;
+
+    PmTimestamp arrival = events[i].timestamp;
+    if (last_arrival >= 0) {
+      long interval = arrival > last_arrival ? arrival - last_arrival : 0;
+      interval_ms.record(interval);
+      if (last_interval >= 0)
+        jitter_ms.record(labs(interval - last_interval));
+      last_interval = interval;
     }
+    last_arrival = arrival;
+  }
+}
+
+void Server::expect_reply() {
+  send_time = steady_clock::now();
+  awaiting_reply = true;
+}
+
+// Called when a sysex message ends. Records the time since the request
+// expecting it was sent.
+void Server::record_reply() {
+  if (!awaiting_reply)
+    return;
+  round_trip_us.record(duration_cast<microseconds>(steady_clock::now() - send_time).count());
+  awaiting_reply = false;
+}
+
+void Server::print_stats() {
+  Histogram batches;
+
+  input_reader.batch_sizes(batches);
+  round_trip_us.print("round trip", "us");
+  interval_ms.print("interval", "ms");
+  jitter_ms.print("jitter", "ms");
+  batches.print("read batch", "events");
+  cout << "read errors: " << input_reader.read_errors() - read_errors_at_reset << endl;
+}
+
+void Server::reset_stats() {
+  round_trip_us.reset();
+  interval_ms.reset();
+  jitter_ms.reset();
+  input_reader.reset_batch_sizes();
+  read_errors_at_reset = input_reader.read_errors();
+}
+
+void Server::reset_wait_stats() {
+  memset(&wait_stats, 0, sizeof(WaitStats));
+  // Don't count the time between commands as an interval
+  last_arrival = -1;
+  last_interval = -1;
+  wait_stats.overflows_at_start = input_reader.overflows();
+  wait_stats.read_errors_at_start = input_reader.read_errors();
+}
+
+void Server::report_wait_stats() {
+  long dropped = input_reader.overflows() - wait_stats.overflows_at_start;
+  if (dropped > 0)
+    cerr << "# input overflowed, " << dropped << " events dropped" << endl;
+  long errors = input_reader.read_errors() - wait_stats.read_errors_at_start;
+  if (errors > 0)
+    cerr << "# " << errors << " input reads failed" << endl;
+  if (!timing)
+    return;
+
+  cerr << "# wait " << (wait_mode == WAIT_BLOCK ? "block" : "poll")
+       << ": " << wait_stats.reads << " reads, "
+       << wait_stats.events << " events";
+  if (wait_stats.reads > 0)
+    cerr << ", latency avg "
+         << (double)wait_stats.total_latency_ms / wait_stats.reads
+         << " ms, max " << wait_stats.max_latency_ms << " ms";
+  cerr << endl;
 }
 
 /*
- * Turns `word` into one or more bytes and stores them into `bytes`. Returns
- * a pointer to the byte AFTER the last byte stored in `bytes`.
+ * Turns `word` into one or more bytes and appends them to `bytes`.
+ * Returns false if `word` is not entirely hex.
  *
  * If `word` contains an odd number of characters greater than 1, an error
- * message is output and the last character is ignored.
+ * message is output and the last character is ignored. If it contains a
+ * non-hex character, an error message is output and the rest of the word
+ * is ignored.
  */
-void Server::hex_word_to_bytes(const char * const word, vector<byte> &bytes) {
-  if (*word == 0)
-    return;
+bool Server::hex_word_to_bytes(const char * const word, vector<byte> &bytes) {
+  size_t len = strlen(word);
+  size_t old_size = bytes.size();
+  size_t num_out;
 
-  if (word[1] == 0) {
-    bytes.push_back(char_to_nibble(word[0]));
-    return;
+  bytes.resize(old_size + (len + 1) / 2);
+  HexStatus status = hex_decode_word(word, len, &bytes[old_size], &num_out);
+  bytes.resize(old_size + num_out);
+  return report_hex_status(status, word, len);
+}
+
+bool Server::report_hex_status(HexStatus status, const char *word, size_t len) {
+  switch (status) {
+  case HEX_OK:
+    return true;
+  case HEX_ODD_DIGITS:
+    cerr << "error: odd number of hex digits seen, last byte dropped" << endl;
+    return false;
+  default:
+    cerr << "error: bad hex digit in \"" << std::string(word, len)
+         << "\", rest of word dropped" << endl;
+    return false;
   }
+}
 
-  const char *p = (const char *)word;
-  while (*p) {
-    if (*(p+1) == 0) {
-      cerr << "error: odd number of hex digits seen, last byte dropped" << endl;
-      return;
-    }
-    bytes.push_back((char_to_nibble(*p) << 4) + char_to_nibble(*(p+1)));
-    p += 2;
+/*
+ * Reads the bytes and delays from a file or from hex words, without
+ * sending them. Returns false if the file can't be read.
+ */
+bool Server::load_file_or_bytes(char **words, vector<byte> &bytes, vector<SendDelay> &delays) {
+  switch (words[0][0]) {
+  case HEX_FILE_NAME_INDICATOR_CHAR:
+    return decode_hex_file(&words[0][1], bytes, delays);
+  case BIN_FILE_NAME_INDICATOR_CHAR: {
+    MappedFile file;
+    if (!file.open(&words[0][1]))
+      return false;
+    bytes.assign(file.data(), file.data() + file.size());
+    return true;
+  }
+  default:
+    hex_words_to_bytes(words, bytes, delays);
+    return true;
   }
 }
 
 void Server::send_hex_file_bytes(char *fname) {
   vector<byte> bytes;
-  char line[BUFSIZ], *words[MAX_WORDS];
-  int i, offset = 0;
-
-  FILE *fp = fopen(fname, "r");
-  while (fgets(line, BUFSIZ, fp) != 0) {
-    split_line_into_words(line, words);
-    for (i = 0; words[i]; ++i) {
-      if (words[i][0] == '#')
-        break;
-      hex_word_to_bytes(words[i], bytes);
+  vector<SendDelay> delays;
+
+  if (decode_hex_file(fname, bytes, delays))
+    send_bytes(bytes.data(), bytes.size(), delays);
+}
+
+/*
+ * Maps the whole file and decodes it in one pass, stopping only for delays
+ * and errors.
+ */
+bool Server::decode_hex_file(char *fname, vector<byte> &bytes, vector<SendDelay> &delays) {
+  MappedFile file;
+  long pack_start = -1;
+
+  if (!file.open(fname))
+    return false;
+
+  const char *p = (const char *)file.data();
+  size_t len = file.size();
+  while (len > 0) {
+    HexResult result = hex_decode_buffer(p, len, bytes);
+    if (result.status == HEX_OK)
+      break;
+
+    const char *word = p + result.word_start;
+    size_t word_len = result.word_end - result.word_start;
+    if (result.status == HEX_NOT_HEX && word[0] == DELAY_INDICATOR_CHAR) {
+      // The mapping isn't NUL-terminated, so don't let atol near it
+      SendDelay delay = {bytes.size(), atol(std::string(word + 1, word_len - 1).c_str())};
+      delays.push_back(delay);
     }
+    else if (result.status != HEX_NOT_HEX || !pack_word(word, word_len, bytes, &pack_start))
+      report_hex_status(result.status, word, word_len);
+    p += result.word_end;
+    len -= result.word_end;
   }
-  fclose(fp);
-  send_bytes(bytes);
+  end_packing(bytes, &pack_start);
+  return true;
 }
 
+/*
+ * Sends straight from a memory mapping of the file, without copying it.
+ */
 void Server::send_bin_file_bytes(char *fname) {
-  vector<byte> bytes;
-  byte buf[BYTES_BUFSIZ];
-  size_t num_read;
-  int i, offset = 0;
+  MappedFile file;
 
-  FILE *fp = fopen(fname, "rb");
-  while ((num_read = fread(buf, 1, BYTES_BUFSIZ, fp)) > 0) {
-    for (int j = 0; j < num_read; ++j)
-      bytes.push_back(buf[j]);
-  }
-  fclose(fp);
-  send_bytes(bytes);
+  if (file.open(fname))
+    send_bytes(file.data(), file.size(), vector<SendDelay>());
 }
 
 // Assumes data is not malformed!
 void Server::send_hex_bytes(char **words) {
   vector<byte> bytes;
+  vector<SendDelay> delays;
+  hex_words_to_bytes(words, bytes, delays);
+  send_bytes(bytes.data(), bytes.size(), delays);
+}
+
+void Server::hex_words_to_bytes(char **words, vector<byte> &bytes, vector<SendDelay> &delays) {
+  long pack_start = -1;
+
   for (int i = 0; words[i]; ++i)
-    hex_word_to_bytes(words[i], bytes);
-  send_bytes(bytes);
-}
-
-void Server::send_bytes(vector<byte> &bytes) {
-  for (int i = 0; i < bytes.size(); ++i) {
-    byte byte = bytes[i];
-    switch (byte & 0xf0) {
-    case NOTE_OFF: case NOTE_ON: case POLY_PRESSURE: case CONTROLLER:
-    case PROGRAM_CHANGE: case CHANNEL_PRESSURE: case PITCH_BEND:
-    case SONG_POINTER:
-      Pm_WriteShort(output, 0, Pm_Message(byte, bytes[i+1], bytes[i+2]));
-      i += 2;
-      break;
-    case SONG_SELECT:
-      Pm_WriteShort(output, 0, Pm_Message(byte, bytes[i+1], 0));
-      ++i;
+    if (!pack_word(words[i], strlen(words[i]), bytes, &pack_start))
+      hex_or_delay_word_to_bytes(words[i], bytes, delays);
+  end_packing(bytes, &pack_start);
+}
+
+/*
+ * Handles the "{" and "}" words around 8-bit data, which is packed into
+ * 7-bit data bytes when the "}" is reached. `*pack_start` is the offset
+ * of the data in `bytes`, or -1 outside braces. Returns false if `word`
+ * is neither.
+ */
+bool Server::pack_word(const char *word, size_t len, vector<byte> &bytes, long *pack_start) {
+  if (len != 1 || (word[0] != PACK_START_CHAR && word[0] != PACK_END_CHAR))
+    return false;
+
+  if (word[0] == PACK_START_CHAR) {
+    if (*pack_start >= 0)
+      cerr << "# " << PACK_START_CHAR << " inside braces ignored" << endl;
+    else
+      *pack_start = bytes.size();
+  }
+  else if (*pack_start < 0)
+    cerr << "# " << PACK_END_CHAR << " without " << PACK_START_CHAR << " ignored" << endl;
+  else {
+    size_t start = *pack_start;
+    vector<byte> data(bytes.begin() + start, bytes.end());
+    bytes.resize(start + seven_bit_packed_size(data.size()));
+    if (!data.empty())
+      seven_bit_pack(data.data(), data.size(), &bytes[start]);
+    *pack_start = -1;
+  }
+  return true;
+}
+
+// Packs data after a "{" that was never closed
+void Server::end_packing(vector<byte> &bytes, long *pack_start) {
+  if (*pack_start < 0)
+    return;
+  cerr << "# " << PACK_START_CHAR << " without " << PACK_END_CHAR << ", packed to the end" << endl;
+  const char end_word[] = {PACK_END_CHAR, 0};
+  pack_word(end_word, 1, bytes, pack_start);
+}
+
+/*
+ * A word of the form "+N" means "wait N milliseconds before sending the
+ * next message" and is stored in `delays`. Any other word is hex and is
+ * converted and stored in `bytes`.
+ */
+void Server::hex_or_delay_word_to_bytes(const char * const word, vector<byte> &bytes,
+                                        vector<SendDelay> &delays)
+{
+  if (word[0] == DELAY_INDICATOR_CHAR) {
+    SendDelay delay = {bytes.size(), atol(&word[1])};
+    delays.push_back(delay);
+  }
+  else
+    hex_word_to_bytes(word, bytes);
+}
+
+
+/*
+ * Sends `bytes`, which may contain any number of MIDI messages. Short
+ * messages are collected into batches of `batch_size` events and sent with
+ * Pm_Write; sysex messages are sent as they are found, after flushing any
+ * pending batch so that ordering is preserved.
+ *
+ * If the output was opened with a latency, each message is timestamped
+ * using `delays` relative to the time the send started and PortMidi
+ * delivers it at that time. We stay no more than SCHEDULE_AHEAD_MILLISECS
+ * ahead of the clock so that long patterns don't overflow PortMidi's
+ * buffers. With sleeping sends turned off, a send whose delays add up to
+ * more than that is refused rather than holding up the caller.
+ *
+ * If sysex pacing is on, everything is handed to the pacer instead, which
+ * sends it from its own thread and sleeps through the delays itself.
+ */
+void Server::send_bytes(const byte *bytes, size_t num_bytes, const vector<SendDelay> &delays) {
+  long num_messages = 0;
+  steady_clock::time_point start_time = steady_clock::now();
+  PmTimestamp when = latency_ms > 0 ? Pt_Time() : 0;
+  size_t next_delay = 0;
+  bool pacing = sysex_pacer.is_enabled();
+  PacedSend paced;
+
+  if (latency_ms > 0 && !pacing && !sleeping_sends) {
+    long total_delay_ms = 0;
+    for (const SendDelay &delay : delays)
+      total_delay_ms += delay.millisecs;
+    if (total_delay_ms > SCHEDULE_AHEAD_MILLISECS) {
+      cerr << "# can't send more than " << SCHEDULE_AHEAD_MILLISECS
+           << " ms of delays here" << endl;
+      return;
+    }
+  }
+
+  if (!delays.empty() && latency_ms == 0 && !pacing)
+    cerr << "# warning: delays ignored, start pmserver with -L to schedule output" << endl;
+
+  for (size_t i = 0; i < num_bytes; ) {
+    byte status = bytes[i];
+
+    if (pacing) {
+      for (; next_delay < delays.size() && delays[next_delay].offset <= i; ++next_delay)
+        paced.add_delay(delays[next_delay].millisecs);
+    }
+    else if (latency_ms > 0) {
+      for (; next_delay < delays.size() && delays[next_delay].offset <= i; ++next_delay)
+        when += delays[next_delay].millisecs;
+      PmTimestamp ahead = when - Pt_Time();
+      if (ahead > SCHEDULE_AHEAD_MILLISECS) {
+        flush_output_events();
+        Pt_Sleep(ahead - SCHEDULE_AHEAD_MILLISECS);
+      }
+    }
+
+    size_t len;
+    switch (next_message(&bytes[i], num_bytes - i, &len)) {
+    case MESSAGE_SYSEX:
+      if (pacing)
+        paced.add_sysex(&bytes[i], len);
+      else {
+        flush_output_events();
+        // We know there's an EOX, so PortMidi won't read past the end
+        midi->write_sysex(output, when, (byte *)&bytes[i]);
+      }
+      ++num_messages;
       break;
-    case TUNE_REQUEST: case CLOCK: case START: case CONTINUE: case STOP:
-    case SYSTEM_RESET:
-      Pm_WriteShort(output, 0, Pm_Message(byte, 0, 0));
+    case MESSAGE_SHORT:
+      if (status != ACTIVE_SENSE) {
+        PmMessage msg = Pm_Message(status,
+                                   len > 1 ? bytes[i+1] : 0,
+                                   len > 2 ? bytes[i+2] : 0);
+        if (pacing)
+          paced.add_short(msg);
+        else
+          queue_output_message(when, msg);
+        ++num_messages;
+      }
       break;
-    case 0xf0:
-      Pm_WriteSysEx(output, 0, &bytes[i]);
-      while (bytes[i] != EOX && i < bytes.size())
-        ++i;
+    case MESSAGE_BAD_STATUS:
+      cout << "??? status '" << setw(2) << hex << (int)status << '\'' << std::dec << endl;
       break;
-    case ACTIVE_SENSE:
+    case MESSAGE_NO_EOX:
+      cerr << "# error: sysex without EOX not sent" << endl;
       break;
-    default:
-      cout << "??? status '" << setw(2) << hex << (int)byte << '\'' << endl;
+    case MESSAGE_INCOMPLETE:
+      cerr << "# error: incomplete message at end of data not sent" << endl;
       break;
     }
+    i += len;
+  }
+  if (pacing) {
+    sysex_pacer.send(paced);
+    return;
+  }
+  flush_output_events();
+
+  if (timing) {
+    double secs = std::chrono::duration<double>(steady_clock::now() - start_time).count();
+    cerr << "# sent " << num_messages << " messages in " << secs * 1000.0 << " ms";
+    if (secs > 0)
+      cerr << " (" << (long)(num_messages / secs) << " messages/sec)";
+    cerr << endl;
+  }
+}
+
+void Server::set_batch_size(int size) {
+  flush_output_events();
+  batch_size = size < 1 ? 1 : size;
+  output_events.resize(batch_size);
+}
+
+// Sends `msg` now if batching is off, else adds it to the pending batch.
+void Server::queue_output_message(PmTimestamp when, PmMessage msg) {
+  if (batch_size == 1) {
+    midi->write_short(output, when, msg);
+    return;
   }
+
+  output_events[num_output_events].message = msg;
+  output_events[num_output_events].timestamp = when;
+  if (++num_output_events == batch_size)
+    flush_output_events();
+}
+
+void Server::flush_output_events() {
+  if (num_output_events == 0)
+    return;
+
+  PmError err = midi->write(output, output_events.data(), num_output_events);
+  if (err < 0)
+    cerr << "# error sending messages: " << Pm_GetErrorText(err) << endl;
+  num_output_events = 0;
 }
 
 void Server::send_file_or_bytes(char **words) {
@@ -333,235 +1254,324 @@ void Server::send_file_or_bytes(char **words) {
   }
 }
 
+// Sends one transaction request, paced if pacing is on
+void Server::send_request(const byte *bytes, size_t num_bytes) {
+  if (sysex_pacer.is_enabled()) {
+    PacedSend paced;
+    paced.add_sysex(bytes, num_bytes);
+    sysex_pacer.send(paced);
+    return;
+  }
+  // Requests always end with an EOX, so PortMidi won't read past the end
+  midi->write_sysex(output, latency_ms > 0 ? Pt_Time() : 0, (byte *)bytes);
+}
+
+/*
+ * Hands each finished sysex message to `queue` and prints it if it
+ * answers a request, else counts it in `*unmatched`.
+ */
+void Server::match_replies(TransactionQueue &queue, long *unmatched) {
+  SysexMessage *reply;
+
+  while ((reply = sysex_assembler.next()) != nullptr) {
+    long index = queue.answer(reply->bytes.data(), reply->bytes.size(), steady_clock::now());
+    if (index < 0)
+      ++*unmatched;
+    else {
+      round_trip_us.record(queue.transaction(index).round_trip_us);
+      print_reply(index, reply->bytes);
+    }
+    sysex_assembler.release(reply);
+  }
+  out.flush_if_due(!input_reader.has_input());
+}
+
+// Prints the request's index, a tab, and the reply's bytes in hex
+void Server::print_reply(size_t index, const vector<byte> &reply) {
+  out.put_uint(index);
+  out.put('\t');
+  for (size_t i = 0; i < reply.size(); ++i) {
+    if (i > 0)
+      out.put(' ');
+    out.put_hex_byte(reply[i]);
+  }
+  out.put('\n');
+}
+
 void Server::read_and_process_any_message() {
   PmEvent events[PM_EVENT_BUFSIZ];
 
-  int num_read = Pm_Read(input, events, PM_EVENT_BUFSIZ);
-  for (int i = 0; i < num_read; ++i) {
-    PmMessage msg = events[i].message;
-    int status = Pm_MessageStatus(msg);
-    int chan = (status & 0x0f) + 1;
-    int high_nibble = status & 0xf0;
-    int data1 = Pm_MessageData1(msg);
-    int data2 = Pm_MessageData2(msg);
-
-    switch (high_nibble) {
-    case NOTE_OFF:
-      print_note(msg, "off");
-      break;
-    case NOTE_ON:
-      print_note(msg, Pm_MessageData2(msg) == 0 ? "off" : "on");
-      break;
-    case POLY_PRESSURE:
-      print_three_byte_chan(msg, "ppress");
-      break;
-    case CONTROLLER:
-      print_three_byte_chan(msg, "cntrl");
-      break;
-    case PROGRAM_CHANGE:
-      print_two_byte(msg, "pchg");
-      break;
-    case CHANNEL_PRESSURE:
-      print_two_byte(msg, "cpress");
-      break;
-    case PITCH_BEND:
-      print_three_byte_chan(msg, "pbend");
-      break;
-    case 0xf0:
-      print_sys_common(msg);
-      break;
-    default:
-      if (sysex_state == SYSEX_PROCESSING)
-        print_four_sysex_bytes(msg);
-      else {
-        cout << "??? status" << endl;
-        print_four_sysex_bytes(msg);
-      }
-      break;
+  int num_read = read_events(events, PM_EVENT_BUFSIZ);
+  format_events(out, events, num_read, monitor_format);
+  out.flush_if_due(!input_reader.has_input());
+}
+
+void Server::format_events(Formatter &f, const PmEvent *events, int num_events,
+                           MonitorFormat format)
+{
+  switch (format) {
+  case MONITOR_BINARY:
+    for (int i = 0; i < num_events; ++i)
+      f.binary_event(events[i]);
+    break;
+  case MONITOR_JSON:
+    for (int i = 0; i < num_events; ++i)
+      print_json_event(f, events[i]);
+    break;
+  default:
+    for (int i = 0; i < num_events; ++i)
+      print_message(f, events[i].message);
+    break;
+  }
+}
+
+void Server::print_message(Formatter &f, PmMessage msg) {
+  switch (Pm_MessageStatus(msg) & 0xf0) {
+  case NOTE_OFF:
+    print_note(f, msg, "off");
+    break;
+  case NOTE_ON:
+    print_note(f, msg, Pm_MessageData2(msg) == 0 ? "off" : "on");
+    break;
+  case POLY_PRESSURE:
+    print_three_byte_chan(f, msg, "ppress");
+    break;
+  case CONTROLLER:
+    print_three_byte_chan(f, msg, "cntrl");
+    break;
+  case PROGRAM_CHANGE:
+    print_two_byte(f, msg, "pchg");
+    break;
+  case CHANNEL_PRESSURE:
+    print_two_byte(f, msg, "cpress");
+    break;
+  case PITCH_BEND:
+    print_three_byte_chan(f, msg, "pbend");
+    break;
+  case 0xf0:
+    print_sys_common(f, msg);
+    break;
+  default:
+    if (sysex_state == SYSEX_PROCESSING)
+      print_four_sysex_bytes(f, msg);
+    else {
+      f.line("??? status");
+      print_four_sysex_bytes(f, msg);
     }
+    break;
   }
 }
 
-void note_num_to_name(int num, char *buf) {
-  int oct = (num / 12) - 1;
-  const char *note = NOTE_NAMES[num % 12];
-  snprintf(buf, 4, "%s%d", note, oct);
+// Same names as the text format uses. Sysex continuation events, whose
+// first byte is a data byte, are "sysex".
+static const char *json_type_name(byte status, byte data2) {
+  switch (status & 0xf0) {
+  case NOTE_OFF: return "off";
+  case NOTE_ON: return data2 == 0 ? "off" : "on";
+  case POLY_PRESSURE: return "ppress";
+  case CONTROLLER: return "cntrl";
+  case PROGRAM_CHANGE: return "pchg";
+  case CHANNEL_PRESSURE: return "cpress";
+  case PITCH_BEND: return "pbend";
+  case 0xf0: break;
+  default: return "sysex";
+  }
+
+  switch (status) {
+  case SYSEX: return "sysex";
+  case SONG_POINTER: return "songptr";
+  case SONG_SELECT: return "songsel";
+  case TUNE_REQUEST: return "tunereq";
+  case EOX: return "eox";
+  case CLOCK: return "clock";
+  case START: return "start";
+  case CONTINUE: return "cont";
+  case STOP: return "stop";
+  case ACTIVE_SENSE: return "asense";
+  case SYSTEM_RESET: return "reset";
+  default: return "???";
+  }
 }
 
-void Server::print_note(PmMessage msg, const char * const name) {
-  char buf[8];
-  int status = Pm_MessageStatus(msg);
-  int chan = (status & 0x0f) + 1;
-  int note = Pm_MessageData1(msg);
-  int velocity = Pm_MessageData2(msg);
+/*
+ * Writes one event as a JSON line. Short messages list only their own
+ * bytes; sysex events list their bytes up to and including any EOX.
+ */
+void Server::print_json_event(Formatter &f, const PmEvent &event) {
+  byte bytes[4];
+  int num_bytes = short_message_length(Pm_MessageStatus(event.message));
+
+  for (int i = 0; i < 4; ++i)
+    bytes[i] = (event.message >> (i * 8)) & 0xff;
+  if (num_bytes == 0) {         // sysex or sysex continuation
+    while (num_bytes < 4 && (num_bytes == 0 || bytes[num_bytes - 1] != EOX))
+      ++num_bytes;
+  }
+  f.json_event(event.timestamp, json_type_name(bytes[0], bytes[2]), bytes, num_bytes);
+}
 
-  note_num_to_name(note, buf);
-  cout << name << "\tch " << chan << '\t' << buf << '\t' << velocity << endl;
+void Server::print_note(Formatter &f, PmMessage msg, const char * const name) {
+  f.note(name, msg);
 }
 
-void Server::print_three_byte_chan(PmMessage msg, const char * const name) {
-  int status = Pm_MessageStatus(msg);
-  int chan = (status & 0x0f) + 1;
-  cout << name << "\tch " << chan
-       << '\t' << Pm_MessageData1(msg)
-       << '\t' << Pm_MessageData2(msg)
-       << endl;
+void Server::print_three_byte_chan(Formatter &f, PmMessage msg, const char * const name) {
+  f.three_byte_chan(name, msg);
 }
 
-void Server::print_two_byte(PmMessage msg, const char * const name) {
-  int status = Pm_MessageStatus(msg);
-  int chan = (status & 0x0f) + 1;
-  cout << name << "\tch " << chan
-       << '\t' << Pm_MessageData1(msg)
-       << endl;
+void Server::print_two_byte(Formatter &f, PmMessage msg, const char * const name) {
+  f.two_byte(name, msg);
 }
 
-void Server::print_four_sysex_bytes(PmMessage msg) {
-  byte *bp = (byte *)&msg;
-  // to hell with cout << setfill << setw << right << hex
-  printf("  %02x %02x %02x %02x\n", bp[0], bp[1], bp[2], bp[3]);
-  for (int i = 0; i < 4; ++i) {
-    if ((bp[i] & 0x80) != 0)
-      sysex_state = SYSEX_DONE;
-  }
+void Server::print_four_sysex_bytes(Formatter &f, PmMessage msg) {
+  f.four_bytes(msg);
+  if ((msg & 0x80808080) != 0)
+    sysex_state = SYSEX_DONE;
 }
 
-// FIXME doesn't do anything with the sysex
-void Server::read_and_process_sysex() {
+/*
+ * Reads a batch of events into the sysex assembler. Returns true if a
+ * sysex message is ready.
+ */
+bool Server::read_sysex() {
   PmEvent events[PM_EVENT_BUFSIZ];
+  long cut_short = sysex_assembler.cut_short();
 
-  sysex_offset = 0;
-  int num_read = Pm_Read(input, events, PM_EVENT_BUFSIZ);
-  for (int i = 0; i < num_read; ++i) {
-    PmMessage msg = events[i].message;
-    byte *bp = (byte *)&msg;
-    for (int j = 0; j < 4; ++j) {
-      byte b = bp[j];
-      if (is_realtime(b))
-        continue;
-      if (sysex_state == SYSEX_PROCESSING) {
-        if (b == EOX) {
-          print_sysex_byte(b);
-          end_sysex_print();
-          sysex_state = SYSEX_DONE;
-          return;
-        }
-      }
-      else if (b == SYSEX) {
-        if (sysex_state != SYSEX_WAITING)
-          cerr << "Hmm, something odd here: state is not WAITING but I just saw my first SYSEX byte" << endl;
-        sysex_state = SYSEX_PROCESSING;
-      }
-      if (sysex_state == SYSEX_PROCESSING)
-        print_sysex_byte(b);
-    }
+  int num_read = read_events(events, PM_EVENT_BUFSIZ);
+  sysex_assembler.add(events, num_read);
+  if (sysex_assembler.cut_short() != cut_short)
+    cerr << "# sysex message dropped, another message arrived before its EOX" << endl;
+  if (!sysex_assembler.has_ready())
+    return false;
+  record_reply();
+  return true;
+}
+
+/*
+ * Prints the whole hexdump lines of `message` that `progress` says
+ * haven't been printed yet, and the last short line too if `finished`.
+ * Starts over if `message` isn't the one `progress` was for.
+ */
+void Server::print_sysex(const SysexMessage *message, SysexProgress &progress, bool finished) {
+  const byte *bytes = message->bytes.data();
+  size_t size = message->bytes.size();
+
+  if (message->number != progress.number) {
+    progress.number = message->number;
+    progress.done = 0;
+  }
+  for (; progress.done + 16 <= size; progress.done += 16)
+    out.hexdump_line(progress.done, &bytes[progress.done], 16);
+  if (finished && progress.done < size) {
+    out.hexdump_line(progress.done, &bytes[progress.done], size - progress.done);
+    progress.done = size;
   }
 }
 
-void Server::read_and_save_sysex(FILE *fp) {
-  PmEvent events[PM_EVENT_BUFSIZ];
+// Appends the bytes of `message` that haven't been saved yet to `writer`
+void Server::save_sysex(SysexWriter &writer, const SysexMessage *message, SysexProgress &progress) {
+  const vector<byte> &bytes = message->bytes;
 
-  sysex_offset = 0;
-  int num_read = Pm_Read(input, events, PM_EVENT_BUFSIZ);
-  for (int i = 0; i < num_read; ++i) {
-    PmMessage msg = events[i].message;
-    byte *bp = (byte *)&msg;
-    for (int j = 3; j >= 0; ++j) {
-      byte b = bp[j];
-      if (is_realtime(b))
-        continue;
-      if (sysex_state == SYSEX_PROCESSING) {
-        if (b == EOX) {
-          fwrite(&b, 1, 1, fp);
-          sysex_state = SYSEX_DONE;
-          return;
-        }
-      }
-      else if (b == SYSEX) {
-        if (sysex_state != SYSEX_WAITING)
-          cerr << "Hmm, something odd here: state is not WAITING but I just saw my first SYSEX byte" << endl;
-        sysex_state = SYSEX_PROCESSING;
-      }
-      if (sysex_state == SYSEX_PROCESSING)
-        fwrite(&b, 1, 1, fp);
+  if (message->number != progress.number) {
+    progress.number = message->number;
+    progress.done = 0;
+    unpacker.reset();
+  }
+  if (unpack_header < 0) {
+    writer.write(&bytes[progress.done], bytes.size() - progress.done);
+    progress.done = bytes.size();
+    return;
+  }
+
+  // Only finished messages end with an EOX
+  bool finished = !bytes.empty() && bytes.back() == EOX;
+  size_t start = std::max(progress.done, (size_t)unpack_header);
+  size_t end = finished ? bytes.size() - 1 : bytes.size();
+  unpacked.clear();
+  if (start < end)
+    unpacker.add(&bytes[start], end - start, unpacked);
+  if (finished)
+    unpacker.finish(unpacked);
+  writer.write(unpacked.data(), unpacked.size());
+  progress.done = bytes.size();
+}
+
+/*
+ * Appends each finished sysex message to the bulk capture's file,
+ * recording it in the index, or adds it to the capture store. Sets
+ * `bulk.done` once a message or byte limit is reached, leaving any later
+ * messages for the next command.
+ */
+void Server::bulk_save_sysex(BulkCapture &bulk) {
+  SysexMessage *message;
+
+  while (!bulk.done && (message = sysex_assembler.next()) != nullptr) {
+    if (bulk.capture != nullptr) {
+      if (!capture_store.add(*bulk.capture, message->bytes.data(), message->bytes.size()))
+        bulk.done = true;
     }
+    else {
+      size_t start = bulk.writer->size();
+      SysexProgress progress = {-1, 0};
+      save_sysex(*bulk.writer, message, progress);
+      fprintf(bulk.index, "%lu %lu\n", (unsigned long)start,
+              (unsigned long)(bulk.writer->size() - start));
+    }
+    bulk.bytes += message->bytes.size();
+    sysex_assembler.release(message);
+    ++bulk.messages;
+    bulk.last_message_time = steady_clock::now();
+    if ((bulk.limits.max_messages > 0 && bulk.messages >= bulk.limits.max_messages)
+        || (bulk.limits.max_bytes > 0 && bulk.bytes >= bulk.limits.max_bytes))
+      bulk.done = true;
   }
 }
 
-void Server::print_sys_common(PmMessage msg) {
+void Server::print_sys_common(Formatter &f, PmMessage msg) {
   switch (Pm_MessageStatus(msg)) {
   case SYSEX:
-    cout << "sysex" << endl;
-    print_four_sysex_bytes(msg);
+    f.line("sysex");
+    print_four_sysex_bytes(f, msg);
     sysex_state = SYSEX_PROCESSING;
     break;
   case SONG_POINTER:
-    cout << "songptr\t" << Pm_MessageData1(msg) << '\t' << Pm_MessageData2(msg) << endl;
+    f.put("songptr\t");
+    f.put_uint(Pm_MessageData1(msg));
+    f.put('\t');
+    f.put_uint(Pm_MessageData2(msg));
+    f.put('\n');
     break;
   case SONG_SELECT:
-    cout << "songsel\t" << Pm_MessageData1(msg) << endl;
+    f.put("songsel\t");
+    f.put_uint(Pm_MessageData1(msg));
+    f.put('\n');
     break;
   case TUNE_REQUEST:
-    cout << "tunereq" << endl;
+    f.line("tunereq");
     break;
   case EOX:
-    cout << "eox" << endl;
+    f.line("eox");
     sysex_state = SYSEX_PROCESSING;
     break;
   case CLOCK:
-    cout << "clock" << endl;
+    f.line("clock");
     break;
   case START:
-    cout << "start" << endl;
+    f.line("start");
     break;
   case CONTINUE:
-    cout << "cont" << endl;
+    f.line("cont");
     break;
   case STOP:
-    cout << "stop" << endl;
+    f.line("stop");
     break;
   case ACTIVE_SENSE:
-    cout << "asense" << endl;
+    f.line("asense");
     break;
   case SYSTEM_RESET:
-    cout << "reset" << endl;
+    f.line("reset");
     break;
   default:
-    cout << "???" << endl;
+    f.line("???");
     break;
   }
 }
-
-void Server::print_sysex_byte(byte b) {
-  int line_index = sysex_offset & 0x0f;
-  sysex_bytes[line_index] = b;
-  if (line_index == 15)
-    print_sysex_line();
-  ++sysex_offset;
-}
-
-void Server::print_sysex_line() {
-  int line_index = sysex_offset & 0x0f;
-  if (line_index == 0)
-    return;
-
-  size_t line_start = sysex_offset - line_index;
-  size_t offset;
-  int i;
-
-  printf("%08lx:", line_start);
-  for (offset = line_start, i = 0; offset < sysex_offset; ++offset, ++i) {
-    byte b = sysex_bytes[i];
-    printf("%s %02x", i == 8 ? "  " : "", b);
-  }
-  printf("  ");
-  for (offset = line_start, i = 0; offset < sysex_offset; ++offset, ++i) {
-    byte b = sysex_bytes[i];
-    printf("%s%c", i == 8 ? "  " : "", (b >= 32 && b <= 127) ? b : '.');
-  }
-  printf("\n");
-}
-
-void Server::end_sysex_print() {
-  print_sysex_line();
-}
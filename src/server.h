@@ -2,63 +2,343 @@
 #define SERVER_H
 
 #include <stdio.h>
+#include <chrono>
+#include <string>
 #include <vector>
 #include "portmidi.h"
+#include "capture_store.h"
+#include "device_registry.h"
+#include "event_filter.h"
+#include "formatter.h"
+#include "hex.h"
+#include "histogram.h"
+#include "input_reader.h"
+#include "midi_backend.h"
+#include "midi_message.h"
+#include "router.h"
+#include "seven_bit.h"
+#include "sysex_assembler.h"
+#include "sysex_pacer.h"
+#include "sysex_writer.h"
+#include "transaction.h"
 
 typedef unsigned char byte;
 
-typedef enum SysexState {
-  SYSEX_WAITING,
-  SYSEX_PROCESSING,
-  SYSEX_DONE
-} SysexState;
+// Handles used when an open command doesn't name one
+#define DEFAULT_INPUT_HANDLE "in"
+#define DEFAULT_OUTPUT_HANDLE "out"
+// How long to wait for a sysex reply
+#define DEFAULT_REPLY_TIMEOUT_MILLISECS 10000
+// How often long-running commands check for hotplug
+#define HOTPLUG_CHECK_MILLISECS 1000
+
+// An open input or output port. Commands refer to ports by handle.
+typedef struct Port {
+  std::string handle;
+  int id;                       // unique, tags events from the input reader
+  int device;                   // -1 while unplugged
+  std::string device_name;      // used to reopen it after a rescan
+  PortMidiStream *stream;       // nullptr while unplugged
+} Port;
+
+// How the receive and monitor loops wait for input
+typedef enum WaitMode {
+  WAIT_POLL,                    // poll, sleeping 10 ms between polls
+  WAIT_BLOCK                    // sleep until the input reader, which polls
+                                // every 1 ms, wakes us
+} WaitMode;
+
+// How the monitor writes the messages it receives
+typedef enum MonitorFormat {
+  MONITOR_TEXT,                 // one tab-separated line per message
+  MONITOR_JSON,                 // one JSON object per line
+  MONITOR_BINARY                // 8-byte records: timestamp, message
+} MonitorFormat;
+
+// Parses "text", "json", or "binary" (or a prefix). A null word means text.
+// Prints an error and returns false if `word` is none of them.
+bool parse_monitor_format(const char *word, MonitorFormat *format);
+
+// Input wakeup measurements, used to compare wait modes
+typedef struct WaitStats {
+  long reads;
+  long events;
+  long total_latency_ms;
+  long max_latency_ms;
+  long overflows_at_start;      // input_reader.overflows() at reset
+  long read_errors_at_start;    // input_reader.read_errors() at reset
+} WaitStats;
+
+// A pause before sending the message at `offset` in a byte stream
+typedef struct SendDelay {
+  size_t offset;
+  long millisecs;
+} SendDelay;
+
+// When to stop a multi-message sysex capture. Zero means no limit.
+typedef struct BulkLimits {
+  long max_messages;
+  size_t max_bytes;
+  long idle_ms;                 // silence after a message that ends capture
+} BulkLimits;
+
+// How much of a sysex message has been printed or saved as it arrives
+typedef struct SysexProgress {
+  long number;                  // SysexMessage::number, -1 for none yet
+  size_t done;                  // bytes handled
+} SysexProgress;
+
+// State of a multi-message sysex capture in progress, to a file and its
+// index or to the capture store
+typedef struct BulkCapture {
+  BulkLimits limits;
+  SysexWriter *writer;
+  FILE *index;
+  Capture *capture;
+  long messages;
+  size_t bytes;
+  bool done;
+  std::chrono::steady_clock::time_point last_message_time;
+} BulkCapture;
+
+class Server;
+
+// Runs one command. Returns false if it was quit.
+typedef bool (*CommandHandler)(Server &server, char **words);
 
 class Server {
 public:
-  Server();
+  // A null `midi` uses PortMidi
+  Server(MidiBackend *midi = nullptr);
+  ~Server();
+
+  // Finishes paced output, stops the input reader and closes every port.
+  // Call before exit(), which skips ~Server but not the PortMidi backend's
+  // static destructor; a reader still running then would read from
+  // streams Pm_Terminate has freed.
+  void shutdown();
+
+  void set_wait_mode(WaitMode mode) { wait_mode = mode; }
+  void set_timing(bool print_timing) { timing = print_timing; }
+  // Expected size of sysex captures, used to preallocate output files
+  void set_preallocate(size_t bytes) { preallocate_bytes = bytes; }
+  // Number of short messages sent per Pm_Write; 1 uses Pm_WriteShort
+  void set_batch_size(int size);
+  // Output latency; non-zero schedules output using delays in sent data.
+  // Takes effect the next time an output is opened.
+  void set_latency(int millisecs) { latency_ms = millisecs; }
+  // Whether a send may sleep until later messages are due, as sends with
+  // long delays do with latency. When not, such sends are refused.
+  void set_sleeping_sends(bool allowed) { sleeping_sends = allowed; }
+  // Sysex pacing. A chunk size of 0 turns pacing off.
+  void set_pacing_delay(size_t chunk_bytes, long delay_ms) { sysex_pacer.set_delay(chunk_bytes, delay_ms); }
+  void set_pacing_rate(size_t chunk_bytes, long bytes_per_sec) { sysex_pacer.set_rate(chunk_bytes, bytes_per_sec); }
+  void print_pacing() { sysex_pacer.print_settings(); }
+  bool is_pacing() { return sysex_pacer.is_enabled(); }
+  // Blocks until paced output has been sent, and prints its rate
+  void wait_for_output() {
+    sysex_pacer.wait_until_idle();
+    sysex_pacer.print_finished();
+  }
+  // Prints the rate of paced sends that have finished since the last call
+  void print_paced_sends() { sysex_pacer.print_finished(); }
+  // How long receives wait for a sysex message, and transactions for
+  // each reply
+  void set_reply_timeout(long millisecs) { reply_timeout_ms = millisecs; }
 
   void list_all_devices();
+  // Aliases can be used in place of device names when opening ports
+  void add_device_alias(const char *alias, const char *name) { devices.add_alias(alias, name); }
+  bool remove_device_alias(const char *alias) { return devices.remove_alias(alias); }
+  void list_device_aliases();
+  // Has the backend look for devices again, then reopens every port on
+  // the device it had open, found by name, keeping its handle, routes and
+  // settings. Ports whose devices are gone stay closed until a later
+  // rescan finds them again.
+  void rescan_devices();
+  // Starts watching for devices being plugged in or unplugged. Returns
+  // false if that isn't possible here.
+  bool watch_hotplug(const char *dir = HOTPLUG_WATCH_DIR) { return devices.watch_hotplug(dir); }
+  // Readable when devices may have changed, or -1 if not watching
+  int hotplug_fd() const { return devices.hotplug_fd(); }
+  // Rescans if devices were plugged in or unplugged since the last check
+  void rescan_if_hotplugged();
   void send_file_or_bytes(char **words);
+  // Starts timing a round trip, which the next sysex message to arrive
+  // ends. Call just before sending a request that expects a reply.
+  void expect_reply();
+  // Reads the file or hex bytes in `words` as send_file_or_bytes would
+  // send them. Returns false if a file can't be read.
+  bool load_file_or_bytes(char **words, std::vector<byte> &bytes, std::vector<SendDelay> &delays);
+  // Sends bytes read ahead of time by load_file_or_bytes
+  void send(const std::vector<byte> &bytes, const std::vector<SendDelay> &delays) {
+    send_bytes(bytes.data(), bytes.size(), delays);
+  }
 
-  PmError open_input(const char *port_num_or_name);
-  PmError open_output(const char *port_num_or_name);
+  // Opens a port under `handle`, closing any port already using it. A
+  // null handle means DEFAULT_INPUT_HANDLE or DEFAULT_OUTPUT_HANDLE.
+  PmError open_input(const char *port_num_or_name, const char *handle);
+  PmError open_output(const char *port_num_or_name, const char *handle);
+  // Closes the input and/or output using `handle`. Returns false if
+  // there are none.
+  bool close_port(const char *handle);
+  // The handles of all open ports, inputs first
+  std::vector<std::string> port_handles() const;
+  // Finds a device as opening a port would, without opening it. Returns
+  // DEVICE_NOT_FOUND or DEVICE_AMBIGUOUS if no single device matches.
+  int find_device(const char *port_num_or_name, bool input) const { return devices.find(port_num_or_name, input); }
+
+  // Makes the input and/or output using `handle` the one the next command
+  // uses. Returns false if there are none.
+  bool select_port(const char *handle);
+  // Reads from all inputs and sends to the most recently opened output
+  void select_default_ports();
 
   void receive_and_print_sysex_bytes();
-  void receive_and_save_sysex_bytes(const char * const output_path);
-  void monitor_midi();
+  // With an `unpack_header` of 0 or more, each message's first
+  // `unpack_header` bytes and its EOX are dropped and the rest is saved
+  // unpacked from 7-bit data, as it arrives
+  void receive_and_save_sysex_bytes(const char * const output_path, long unpack_header = -1);
+  void receive_bulk_sysex(const char * const output_path, const BulkLimits &limits,
+                          long unpack_header = -1);
+
+  // Opens the store `a` commands use. Returns false if it can't be opened.
+  bool open_capture_store(const char *dir) { return capture_store.open(dir); }
+  // Receives sysex like receive_bulk_sysex, into the capture store as `name`
+  void receive_into_store(const char *name, const BulkLimits &limits);
+  // Adds a sysex file to the capture store, or writes a capture out
+  void import_capture(const char *name, const char *path);
+  void extract_capture(const char *name, const char *path);
+  void list_captures();
+  // Sends each sysex message in the file or bytes `words` as a request,
+  // up to `window` at a time, and prints each reply matching `pattern`
+  // with the index of its request. A zero `timeout_ms` uses the reply
+  // timeout.
+  void transact(char **words, size_t window, long timeout_ms, const ReplyPattern &pattern);
+  // Round trip, arrival interval, jitter and read batch histograms
+  void print_stats();
+  void reset_stats();
 
-  bool is_input_open() { return input != nullptr; }
+  // Filters all inputs, including ones opened later
+  void set_input_filter(const EventFilter &filter);
+  void print_input_filter() { input_filter.print(); }
+
+  void monitor_midi(MonitorFormat format);
+  void record_midi(const char * const path, int smf_format);
+
+  // Routes from the input using handle `from` to the output using handle
+  // `to`. `route` holds the transforms; its ports are filled in here.
+  // Returns false and prints an error if either port isn't open.
+  bool add_route(const char *from, const char *to, Route &route);
+  void clear_routes() { router.clear(); }
+  void list_routes();
+  void route_midi();
+
+  // For the socket server, which reads input itself and fans it out
+  void set_input_notify_fd(int fd) { input_reader.set_notify_fd(fd); }
+  void arm_input_notify() { input_reader.arm_notify(); }
+  bool has_input() const { return input_reader.has_input(); }
+  // Reads from all inputs, filtered, with each event's port id
+  int read_input(PmEvent *events, int *port_ids, int max_events);
+  // Formats events as the monitor does
+  void format_events(Formatter &f, const PmEvent *events, int num_events,
+                     MonitorFormat format);
+  // Returns the id of the input using `handle`, or -1
+  int input_port_id(const char *handle);
+  // The handle of the output sends go to without one, or nullptr
+  const char *default_output_handle();
+
+  bool is_input_open() { return !inputs.empty(); }
   bool is_output_open() { return output != nullptr; }
 
   // only public for testing
-  void hex_word_to_bytes(const char * const word, std::vector<byte> &bytes);
+  bool hex_word_to_bytes(const char * const word, std::vector<byte> &bytes);
 
 protected:
-  PortMidiStream *input;
-  PortMidiStream *output;
-  SysexState sysex_state;
-  size_t sysex_offset;
-  byte sysex_bytes[16];
-
-  void list_devices(const char *title, std::vector<PmDeviceInfo *> &devices, bool inputs);
-  int port_number_matching_name(const char *name, bool match_inputs);
-  byte char_to_nibble(const char ch);
+  MidiBackend *midi;
+  DeviceRegistry devices;
+  std::vector<Port> inputs;
+  std::vector<Port> outputs;
+  int next_port_id;
+  int selected_input_id;        // -1 reads from all inputs
+  PortMidiStream *output;       // selected output
+  Router router;
+  EventFilter input_filter;
+  Histogram round_trip_us;      // from the start of a send to the reply's EOX
+  Histogram interval_ms;        // between messages arriving
+  Histogram jitter_ms;          // change in interval from one message to the next
+  PmTimestamp last_arrival;     // -1 if none yet
+  long last_interval;           // -1 if none yet
+  long read_errors_at_reset;    // input_reader.read_errors() at stats reset
+  std::chrono::steady_clock::time_point send_time;
+  bool awaiting_reply;          // set by expect_reply
+  SysexState sysex_state;       // of the monitor's sysex printing
+  SysexAssembler sysex_assembler;
+  CaptureStore capture_store;
+  long unpack_header;           // of saved sysex, -1 to save it as is
+  SevenBitDecoder unpacker;
+  std::vector<byte> unpacked;
+  WaitMode wait_mode;
+  InputReader input_reader;
+  WaitStats wait_stats;
+  bool timing;
+  size_t preallocate_bytes;
+  int batch_size;
+  std::vector<PmEvent> output_events;
+  int num_output_events;
+  int latency_ms;
+  bool sleeping_sends;
+  long reply_timeout_ms;
+  SysexPacer sysex_pacer;
+  MonitorFormat monitor_format;
+  Formatter out;
+  std::chrono::steady_clock::time_point last_hotplug_check;
+
+  void list_devices(const char *title, bool inputs);
+  int port_number(const char *port_num_or_name, bool match_inputs);
+  PmError open_input_stream(int device, PortMidiStream **stream);
+  PmError open_output_stream(int device, PortMidiStream **stream);
+  void reopen_port(Port &port, bool input);
+  void check_hotplug();
+  bool close_input(const char *handle);
+  bool close_output(const char *handle);
+  bool report_hex_status(HexStatus status, const char *word, size_t len);
+  bool wait_for_input();
+  int read_events(PmEvent *events, int max_events);
+  void record_arrivals(const PmEvent *events, int num_events);
+  void record_reply();
+  void reset_wait_stats();
+  void report_wait_stats();
+  bool decode_hex_file(char *fname, std::vector<byte> &bytes, std::vector<SendDelay> &delays);
   void send_hex_file_bytes(char *fname);
   void send_bin_file_bytes(char *fname);
   void send_hex_bytes(char **words);
-  void send_bytes(std::vector<byte> &bytes);
-  void read_and_process_sysex();
-  void read_and_save_sysex(FILE *fp);
+  void hex_words_to_bytes(char **words, std::vector<byte> &bytes, std::vector<SendDelay> &delays);
+  bool pack_word(const char *word, size_t len, std::vector<byte> &bytes, long *pack_start);
+  void end_packing(std::vector<byte> &bytes, long *pack_start);
+  void hex_or_delay_word_to_bytes(const char * const word, std::vector<byte> &bytes,
+                                  std::vector<SendDelay> &delays);
+  void send_bytes(const byte *bytes, size_t num_bytes, const std::vector<SendDelay> &delays);
+  void queue_output_message(PmTimestamp when, PmMessage msg);
+  void flush_output_events();
+  bool read_sysex();
+  void print_sysex(const SysexMessage *message, SysexProgress &progress, bool finished);
+  void save_sysex(SysexWriter &writer, const SysexMessage *message, SysexProgress &progress);
+  void bulk_save_sysex(BulkCapture &bulk);
+  void receive_bulk(BulkCapture &bulk);
+  bool check_capture_store(const char *name);
+  void print_capture_stats(const Capture &capture);
+  void send_request(const byte *bytes, size_t num_bytes);
+  void match_replies(TransactionQueue &queue, long *unmatched);
+  void print_reply(size_t index, const std::vector<byte> &reply);
   void read_and_process_any_message();
-  void print_note(PmMessage msg, const char * const name);
-  void print_three_byte_chan(PmMessage msg, const char * const name);
-  void print_two_byte(PmMessage msg, const char * const name);
-  void print_four_sysex_bytes(PmMessage msg);
-  void print_sys_common(PmMessage msg);
-
-  void print_sysex_byte(byte b);
-  void print_sysex_line();
-  void end_sysex_print();
+  void print_message(Formatter &f, PmMessage msg);
+  void print_json_event(Formatter &f, const PmEvent &event);
+  void print_note(Formatter &f, PmMessage msg, const char * const name);
+  void print_three_byte_chan(Formatter &f, PmMessage msg, const char * const name);
+  void print_two_byte(Formatter &f, PmMessage msg, const char * const name);
+  void print_four_sysex_bytes(Formatter &f, PmMessage msg);
+  void print_sys_common(Formatter &f, PmMessage msg);
 };
 
 #endif /* SERVER_H */
@@ -0,0 +1,134 @@
+#include <string.h>
+#include "seven_bit.h"
+
+// SSE2 is always there on x86-64. SSSE3 is checked for at run time.
+#if defined(__SSE2__) && defined(__GNUC__)
+#define SEVEN_BIT_SIMD
+#include <emmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+#if defined(SEVEN_BIT_SIMD)
+
+static const bool HAVE_SSSE3 = __builtin_cpu_supports("ssse3");
+
+/*
+ * Packs 14 bytes into two groups, 16 bytes. Reads 16 bytes from `in`.
+ */
+__attribute__((target("ssse3")))
+static inline void pack_2_groups(const byte *in, byte *out) {
+  __m128i v = _mm_loadu_si128((const __m128i *)in);
+
+  // Leave a zero lane for each group's top bits byte
+  __m128i spread = _mm_shuffle_epi8(v, _mm_setr_epi8(-1, 0, 1, 2, 3, 4, 5, 6,
+                                                     -1, 7, 8, 9, 10, 11, 12, 13));
+  int tops = _mm_movemask_epi8(spread);
+  __m128i top_bytes = _mm_or_si128(_mm_cvtsi32_si128((tops >> 1) & 0x7f),
+                                   _mm_slli_si128(_mm_cvtsi32_si128((tops >> 9) & 0x7f), 8));
+  __m128i low = _mm_and_si128(spread, _mm_set1_epi8(0x7f));
+  _mm_storeu_si128((__m128i *)out, _mm_or_si128(low, top_bytes));
+}
+
+/*
+ * Unpacks two groups, 16 bytes, into 14 bytes. Writes 16 bytes to `out`;
+ * the last two are garbage.
+ */
+__attribute__((target("ssse3")))
+static inline void unpack_2_groups(const byte *in, byte *out) {
+  __m128i v = _mm_loadu_si128((const __m128i *)in);
+
+  __m128i data = _mm_shuffle_epi8(v, _mm_setr_epi8(1, 2, 3, 4, 5, 6, 7,
+                                                   9, 10, 11, 12, 13, 14, 15, -1, -1));
+  // Copy each group's top bits byte to its seven lanes, and pick out
+  // the lane's own bit
+  __m128i tops = _mm_shuffle_epi8(v, _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0,
+                                                   8, 8, 8, 8, 8, 8, 8, -1, -1));
+  __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, 1, 2, 4, 8, 16, 32, 64, 0, 0);
+  __m128i is_set = _mm_cmpeq_epi8(_mm_and_si128(tops, bits), bits);
+
+  __m128i low = _mm_and_si128(data, _mm_set1_epi8(0x7f));
+  __m128i high = _mm_and_si128(is_set, _mm_set1_epi8((char)0x80));
+  _mm_storeu_si128((__m128i *)out, _mm_or_si128(low, high));
+}
+
+#endif
+
+void seven_bit_pack(const byte *in, size_t n, byte *out) {
+  const byte *end = in + n;
+
+#if defined(SEVEN_BIT_SIMD)
+  if (HAVE_SSSE3) {
+    for (; end - in >= 16; in += 14, out += 16)
+      pack_2_groups(in, out);
+  }
+#endif
+
+  while (in < end) {
+    size_t len = end - in < 7 ? end - in : 7;
+    byte tops = 0;
+    for (size_t i = 0; i < len; ++i) {
+      tops |= (in[i] >> 7) << i;
+      out[i + 1] = in[i] & 0x7f;
+    }
+    out[0] = tops;
+    in += len;
+    out += len + 1;
+  }
+}
+
+void seven_bit_unpack(const byte *in, size_t n, byte *out) {
+  const byte *end = in + n;
+
+#if defined(SEVEN_BIT_SIMD)
+  // Stop while the output still has room for the two garbage bytes
+  if (HAVE_SSSE3) {
+    for (; end - in >= 24; in += 16, out += 14)
+      unpack_2_groups(in, out);
+  }
+#endif
+
+  while (in < end) {
+    size_t len = end - in < 8 ? end - in : 8;
+    byte tops = in[0];
+    for (size_t i = 1; i < len; ++i)
+      out[i - 1] = (in[i] & 0x7f) | (((tops >> (i - 1)) & 1) << 7);
+    in += len;
+    out += len - 1;
+  }
+}
+
+void SevenBitDecoder::add(const byte *bytes, size_t n, std::vector<byte> &out) {
+  if (held > 0) {
+    size_t take = 8 - held < n ? 8 - held : n;
+    memcpy(group + held, bytes, take);
+    held += take;
+    bytes += take;
+    n -= take;
+    if (held < 8)
+      return;
+    size_t old_size = out.size();
+    out.resize(old_size + 7);
+    seven_bit_unpack(group, 8, &out[old_size]);
+    held = 0;
+  }
+
+  size_t whole = n - n % 8;
+  if (whole > 0) {
+    size_t old_size = out.size();
+    out.resize(old_size + whole / 8 * 7);
+    seven_bit_unpack(bytes, whole, &out[old_size]);
+  }
+  held = n - whole;
+  memcpy(group, bytes + whole, held);
+}
+
+void SevenBitDecoder::finish(std::vector<byte> &out) {
+  if (held < 2) {               // a lone top bits byte holds no data
+    held = 0;
+    return;
+  }
+  size_t old_size = out.size();
+  out.resize(old_size + seven_bit_unpacked_size(held));
+  seven_bit_unpack(group, held, &out[old_size]);
+  held = 0;
+}
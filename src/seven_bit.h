@@ -0,0 +1,43 @@
+#ifndef SEVEN_BIT_H
+#define SEVEN_BIT_H
+
+#include <stddef.h>
+#include <vector>
+
+typedef unsigned char byte;
+
+/*
+ * 8-bit data packed into 7-bit sysex data bytes the way Korg (and many
+ * others) do it: each group of up to 7 bytes is sent as a byte holding
+ * their top bits, bit 0 for the first byte, followed by the 7 bytes with
+ * their top bits cleared. A last group of n < 7 bytes takes n + 1.
+ */
+
+// Bytes that `n` bytes take packed, or that `n` packed bytes unpack to
+inline size_t seven_bit_packed_size(size_t n) { return n + (n + 6) / 7; }
+inline size_t seven_bit_unpacked_size(size_t n) { return n - (n + 7) / 8; }
+
+// Packs `n` bytes from `in` into seven_bit_packed_size(n) bytes at `out`
+void seven_bit_pack(const byte *in, size_t n, byte *out);
+// Unpacks `n` bytes from `in` into seven_bit_unpacked_size(n) bytes at
+// `out`. Top bits set in the data bytes are ignored.
+void seven_bit_unpack(const byte *in, size_t n, byte *out);
+
+// Unpacks data that arrives a piece at a time, holding on to a group
+// split between pieces until the rest of it arrives
+class SevenBitDecoder {
+public:
+  SevenBitDecoder() : held(0) {}
+
+  void reset() { held = 0; }
+  // Unpacks `n` more bytes, appending to `out`
+  void add(const byte *bytes, size_t n, std::vector<byte> &out);
+  // Unpacks a final short group, if any
+  void finish(std::vector<byte> &out);
+
+private:
+  byte group[8];
+  size_t held;
+};
+
+#endif /* SEVEN_BIT_H */
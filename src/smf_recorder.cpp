@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <string.h>
+#include "smf_recorder.h"
+
+#define SMF_OUTPUT_BUFSIZ (64 * 1024)
+#define SMF_HEADER_LENGTH 6
+
+SmfRecorder::SmfRecorder()
+  : out(nullptr), format(0), start_time(0), track_length_pos(0),
+    num_events(0), in_sysex(false), sysex_continued(false), sysex_time(0),
+    sysex_bytes(new byte[SMF_SYSEX_PACKET_BYTES]), sysex_used(0),
+    failed(false)
+{
+  memset(tracks, 0, sizeof(tracks));
+}
+
+SmfRecorder::~SmfRecorder() {
+  close();
+  delete[] sysex_bytes;
+}
+
+bool SmfRecorder::open(const char * const path, int smf_format, PmTimestamp start) {
+  out = fopen(path, "wb");
+  if (out == nullptr) {
+    perror("error opening output file");
+    return false;
+  }
+  setvbuf(out, nullptr, _IOFBF, SMF_OUTPUT_BUFSIZ);
+
+  format = smf_format;
+  start_time = start;
+  num_events = 0;
+  in_sysex = false;
+  sysex_used = 0;
+  failed = false;
+  memset(tracks, 0, sizeof(tracks));
+
+  if (format == 0) {
+    write_header(1);
+    fputs("MTrk", out);
+    track_length_pos = ftell(out);
+    write_int(0, 4);            // patched at close
+    tracks[0].fp = out;
+    tracks[0].last_time = start_time;
+    write_tempo(&tracks[0]);
+  }
+  // Type 1 tracks are created as their first events arrive
+  return true;
+}
+
+void SmfRecorder::record(const PmEvent &event) {
+  byte status = Pm_MessageStatus(event.message);
+
+  if (!in_sysex && status != SYSEX) {
+    if (status >= NOTE_OFF && status < SYSEX)
+      record_short(event, status);
+    return;
+  }
+
+  for (int i = 0; i < 4; ++i) {
+    byte b = (event.message >> (i * 8)) & 0xff;
+    if (b >= CLOCK)             // realtime, may be embedded in sysex
+      continue;
+    if (b == SYSEX) {
+      if (in_sysex)             // previous one was never terminated
+        record_sysex_byte(event.timestamp, EOX);
+      in_sysex = true;
+      sysex_continued = false;
+      sysex_used = 0;
+      ++num_events;
+      continue;
+    }
+    if (!in_sysex)
+      break;
+    if ((b & 0x80) != 0 && b != EOX) {
+      // A new message cut the sysex short. Terminate it so that the file
+      // stays readable, then record the message.
+      record_sysex_byte(event.timestamp, EOX);
+      if (i == 0 && b < SYSEX)
+        record_short(event, b);
+      break;
+    }
+    record_sysex_byte(event.timestamp, b);
+    if (b == EOX)
+      break;
+  }
+}
+
+bool SmfRecorder::close() {
+  if (out == nullptr)
+    return !failed;
+
+  if (in_sysex)
+    record_sysex_byte(sysex_time, EOX);
+
+  if (format == 0) {
+    end_track(&tracks[0]);
+    if (fseek(out, track_length_pos, SEEK_SET) == -1)
+      failed = true;
+    write_int(tracks[0].length, 4);
+  }
+  else {
+    int num_tracks = 1;
+    for (int i = 0; i < SMF_MAX_TRACKS; ++i)
+      if (tracks[i].fp != nullptr)
+        ++num_tracks;
+    write_header(num_tracks);
+
+    SmfTrack conductor = {tmpfile(), 0, start_time, 0};
+    if (conductor.fp == nullptr) {
+      perror("error creating temporary track file");
+      failed = true;
+    }
+    else {
+      write_tempo(&conductor);
+      end_track(&conductor);
+      copy_track(&conductor);
+    }
+    for (int i = 0; i < SMF_MAX_TRACKS; ++i) {
+      if (tracks[i].fp != nullptr) {
+        end_track(&tracks[i]);
+        copy_track(&tracks[i]);
+      }
+    }
+  }
+
+  if (fclose(out) != 0)
+    failed = true;
+  out = nullptr;
+  memset(tracks, 0, sizeof(tracks));
+  if (failed)
+    fprintf(stderr, "# error writing MIDI file\n");
+  return !failed;
+}
+
+// Returns the track to write to, creating it if needed. Type 0 files only
+// have track 0. Returns nullptr if a Type 1 track file can't be created.
+SmfTrack *SmfRecorder::track_for(int track_num) {
+  if (format == 0)
+    return &tracks[0];
+
+  SmfTrack *track = &tracks[track_num];
+  if (track->fp == nullptr) {
+    track->fp = tmpfile();
+    if (track->fp == nullptr) {
+      perror("error creating temporary track file");
+      failed = true;
+      return nullptr;
+    }
+    track->length = 0;
+    track->last_time = start_time;
+    track->running_status = 0;
+
+    char name[16];
+    if (track_num == SMF_SYSEX_TRACK)
+      strcpy(name, "sysex");
+    else
+      snprintf(name, sizeof(name), "ch %d", track_num + 1);
+    write_track_name(track, name);
+  }
+  return track;
+}
+
+void SmfRecorder::record_short(const PmEvent &event, byte status) {
+  SmfTrack *track = track_for(status & 0x0f);
+  if (track == nullptr)
+    return;
+
+  int high_nibble = status & 0xf0;
+  write_delta(track, event.timestamp);
+  if (status != track->running_status) {
+    write_byte(track, status);
+    track->running_status = status;
+  }
+  write_byte(track, Pm_MessageData1(event.message));
+  if (high_nibble != PROGRAM_CHANGE && high_nibble != CHANNEL_PRESSURE)
+    write_byte(track, Pm_MessageData2(event.message));
+  ++num_events;
+}
+
+// Buffers one sysex byte (the F0 is implied). The buffer is written as a
+// packet when the sysex ends or when the buffer fills; later packets of
+// the same message are written as F7 "escape" events, so long dumps don't
+// have to be held in memory.
+void SmfRecorder::record_sysex_byte(PmTimestamp time, byte b) {
+  if (sysex_used == 0)
+    sysex_time = time;
+  sysex_bytes[sysex_used++] = b;
+  if (b == EOX) {
+    write_sysex_packet();
+    in_sysex = false;
+  }
+  else if (sysex_used == SMF_SYSEX_PACKET_BYTES)
+    write_sysex_packet();
+}
+
+void SmfRecorder::write_sysex_packet() {
+  SmfTrack *track = track_for(SMF_SYSEX_TRACK);
+  if (track == nullptr) {
+    sysex_used = 0;
+    return;
+  }
+
+  write_delta(track, sysex_time);
+  write_byte(track, sysex_continued ? EOX : SYSEX);
+  write_var_len(track, sysex_used);
+  if (fwrite(sysex_bytes, 1, sysex_used, track->fp) != sysex_used)
+    failed = true;
+  track->length += sysex_used;
+  track->running_status = 0;
+  sysex_continued = true;
+  sysex_used = 0;
+}
+
+// Timestamps are milliseconds and so are ticks. Events that arrive out of
+// order get a delta of zero.
+void SmfRecorder::write_delta(SmfTrack *track, PmTimestamp time) {
+  if (time < track->last_time)
+    time = track->last_time;
+  write_var_len(track, (unsigned long)(time - track->last_time));
+  track->last_time = time;
+}
+
+void SmfRecorder::write_var_len(SmfTrack *track, unsigned long value) {
+  byte bytes[5];
+  int n = 0;
+
+  bytes[n++] = value & 0x7f;
+  while ((value >>= 7) != 0)
+    bytes[n++] = 0x80 | (value & 0x7f);
+  while (n > 0)
+    write_byte(track, bytes[--n]);
+}
+
+void SmfRecorder::write_byte(SmfTrack *track, byte b) {
+  if (putc(b, track->fp) == EOF)
+    failed = true;
+  ++track->length;
+}
+
+void SmfRecorder::write_track_name(SmfTrack *track, const char * const name) {
+  size_t len = strlen(name);
+
+  write_delta(track, track->last_time);
+  write_byte(track, META_EVENT);
+  write_byte(track, META_SEQ_NAME);
+  write_var_len(track, len);
+  for (size_t i = 0; i < len; ++i)
+    write_byte(track, name[i]);
+}
+
+void SmfRecorder::write_tempo(SmfTrack *track) {
+  write_delta(track, track->last_time);
+  write_byte(track, META_EVENT);
+  write_byte(track, META_SET_TEMPO);
+  write_byte(track, 3);
+  write_byte(track, (SMF_MICROSECS_PER_QUARTER >> 16) & 0xff);
+  write_byte(track, (SMF_MICROSECS_PER_QUARTER >> 8) & 0xff);
+  write_byte(track, SMF_MICROSECS_PER_QUARTER & 0xff);
+}
+
+void SmfRecorder::end_track(SmfTrack *track) {
+  write_delta(track, track->last_time);
+  write_byte(track, META_EVENT);
+  write_byte(track, META_TRACK_END);
+  write_byte(track, 0);
+}
+
+void SmfRecorder::write_header(int num_tracks) {
+  fputs("MThd", out);
+  write_int(SMF_HEADER_LENGTH, 4);
+  write_int(format, 2);
+  write_int(num_tracks, 2);
+  write_int(SMF_TICKS_PER_QUARTER, 2);
+}
+
+// Writes `value` to the output file, most significant byte first
+void SmfRecorder::write_int(unsigned long value, int num_bytes) {
+  for (int shift = (num_bytes - 1) * 8; shift >= 0; shift -= 8)
+    if (putc((value >> shift) & 0xff, out) == EOF)
+      failed = true;
+}
+
+// Appends a Type 1 track's chunk to the output file and closes its
+// temporary file
+bool SmfRecorder::copy_track(SmfTrack *track) {
+  byte buf[SMF_OUTPUT_BUFSIZ];
+  size_t n;
+
+  fputs("MTrk", out);
+  write_int(track->length, 4);
+  rewind(track->fp);
+  while ((n = fread(buf, 1, sizeof(buf), track->fp)) > 0)
+    if (fwrite(buf, 1, n, out) != n)
+      failed = true;
+  if (ferror(track->fp))
+    failed = true;
+  fclose(track->fp);
+  track->fp = nullptr;
+  return !failed;
+}
@@ -0,0 +1,85 @@
+#ifndef SMF_RECORDER_H
+#define SMF_RECORDER_H
+
+#include <stdio.h>
+#include "consts.h"
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+// SMF division. With the tempo below, one tick is one millisecond, so
+// PortMidi timestamp differences can be used as delta times directly.
+#define SMF_TICKS_PER_QUARTER 500
+#define SMF_MICROSECS_PER_QUARTER 500000
+// Long sysex messages are written in packets of at most this many bytes
+#define SMF_SYSEX_PACKET_BYTES 4096
+// Type 1 files get one track per channel plus one for sysex
+#define SMF_SYSEX_TRACK MIDI_CHANNELS
+#define SMF_MAX_TRACKS (MIDI_CHANNELS + 1)
+
+// One track being written. `fp` is the output file for Type 0 and a
+// temporary file for each Type 1 track.
+typedef struct SmfTrack {
+  FILE *fp;
+  size_t length;                // bytes of track data written so far
+  PmTimestamp last_time;
+  byte running_status;
+} SmfTrack;
+
+// Streams incoming events into a Standard MIDI File as they arrive.
+// Memory use does not grow with the length of the recording: a Type 0 file
+// is written directly and its track length patched at close; each Type 1
+// track is streamed to its own temporary file and the tracks are copied
+// into place at close.
+//
+// Channel messages and sysex are recorded. Realtime and system common
+// messages have no place in a MIDI file and are dropped.
+class SmfRecorder {
+public:
+  SmfRecorder();
+  ~SmfRecorder();
+
+  // `format` is 0 or 1. `start_time` is the PortMidi time the recording
+  // starts at. Returns false and prints an error if the file can't be
+  // created.
+  bool open(const char * const path, int format, PmTimestamp start_time);
+  void record(const PmEvent &event);
+  // Ends all tracks and finishes the file. Returns false if any write
+  // failed.
+  bool close();
+
+  long events() const { return num_events; }
+
+private:
+  FILE *out;
+  int format;
+  PmTimestamp start_time;
+  SmfTrack tracks[SMF_MAX_TRACKS];
+  long track_length_pos;        // Type 0 track length, patched at close
+  long num_events;
+  bool in_sysex;
+  bool sysex_continued;         // a packet of this sysex was already written
+  PmTimestamp sysex_time;
+  byte *sysex_bytes;
+  size_t sysex_used;
+  bool failed;
+
+  SmfTrack *track_for(int track_num);
+  void record_short(const PmEvent &event, byte status);
+  void record_sysex_byte(PmTimestamp time, byte b);
+  void write_sysex_packet();
+  void write_delta(SmfTrack *track, PmTimestamp time);
+  void write_var_len(SmfTrack *track, unsigned long value);
+  void write_byte(SmfTrack *track, byte b);
+  void write_track_name(SmfTrack *track, const char * const name);
+  void write_tempo(SmfTrack *track);
+  void end_track(SmfTrack *track);
+  void write_header(int num_tracks);
+  void write_int(unsigned long value, int num_bytes);
+  bool copy_track(SmfTrack *track);
+
+  SmfRecorder(const SmfRecorder &);
+  SmfRecorder &operator=(const SmfRecorder &);
+};
+
+#endif /* SMF_RECORDER_H */
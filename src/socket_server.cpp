@@ -0,0 +1,531 @@
+#include <iostream>
+#include <sstream>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "socket_server.h"
+#include "util.h"
+
+#define LISTEN_BACKLOG 16
+#define MAX_EPOLL_EVENTS 64
+#define SOCKET_READ_BUFSIZ 4096
+// Longest command line a client can send
+#define MAX_LINE_BYTES (64 * 1024)
+// Monitor output a client can fall behind by before events are dropped
+#define MAX_CLIENT_BACKLOG (1024 * 1024)
+// Input batches forwarded per pass through the event loop, so that a
+// flood of input can't keep commands from being read
+#define MAX_INPUT_BATCHES 16
+#define DEFAULT_HOST "localhost"
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::ostringstream;
+using std::streambuf;
+using std::string;
+using std::vector;
+
+static volatile sig_atomic_t stopping;
+
+static void stop(int sig) {
+  stopping = 1;
+}
+
+SocketServer::SocketServer(Server &server, CommandHandler handler)
+  : server(server), handler(handler), listen_fd(-1), epoll_fd(-1), input_fd(-1),
+    hotplug_fd(-1)
+{
+  for (int i = 0; i < 3; ++i)
+    formatters[i] = new Formatter(nullptr);
+}
+
+SocketServer::~SocketServer() {
+  while (!clients.empty())
+    close_client(clients.back());
+  server.set_input_notify_fd(-1);
+  if (input_fd >= 0)
+    close(input_fd);
+  if (epoll_fd >= 0)
+    close(epoll_fd);
+  if (listen_fd >= 0)
+    close(listen_fd);
+  if (!unix_path.empty())
+    unlink(unix_path.c_str());
+  for (int i = 0; i < 3; ++i)
+    delete formatters[i];
+}
+
+bool SocketServer::listen(const char *address) {
+  // A client that disconnects while we're writing to it is not an error
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!(strchr(address, '/') != nullptr ? listen_unix(address) : listen_tcp(address)))
+    return false;
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  input_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd < 0 || input_fd < 0) {
+    cerr << "# error setting up epoll: " << strerror(errno) << endl;
+    return false;
+  }
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = nullptr;        // the listening socket
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+  ev.data.ptr = &input_fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &ev);
+  server.set_input_notify_fd(input_fd);
+  hotplug_fd = server.hotplug_fd();
+  if (hotplug_fd >= 0) {
+    ev.data.ptr = &hotplug_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, hotplug_fd, &ev);
+  }
+  return true;
+}
+
+/*
+ * Removes a stale socket left by a pmserver that was killed, but nothing
+ * else.
+ */
+bool SocketServer::listen_unix(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    cerr << "# socket path " << path << " is too long" << endl;
+    return false;
+  }
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0
+      || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+      || ::listen(listen_fd, LISTEN_BACKLOG) < 0) {
+    cerr << "# error listening on " << path << ": " << strerror(errno) << endl;
+    return false;
+  }
+  unix_path = path;
+  return true;
+}
+
+bool SocketServer::listen_tcp(const char *address) {
+  const char *colon = strrchr(address, ':');
+  string host = colon != nullptr ? string(address, colon - address) : DEFAULT_HOST;
+  const char *port = colon != nullptr ? colon + 1 : address;
+  struct addrinfo hints, *addrs;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  int err = getaddrinfo(host.empty() ? nullptr : host.c_str(), port, &hints, &addrs);
+  if (err != 0) {
+    cerr << "# can't listen on " << address << ": " << gai_strerror(err) << endl;
+    return false;
+  }
+
+  for (struct addrinfo *ai = addrs; ai != nullptr; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+    if (fd < 0)
+      continue;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd, LISTEN_BACKLOG) == 0) {
+      listen_fd = fd;
+      break;
+    }
+    close(fd);
+  }
+  freeaddrinfo(addrs);
+  if (listen_fd < 0) {
+    cerr << "# error listening on " << address << ": " << strerror(errno) << endl;
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Input is forwarded after every pass so that events that arrived while
+ * commands ran go out promptly. The reader only signals the eventfd when
+ * armed, so we arm it and then check for input we'd otherwise miss.
+ */
+void SocketServer::run() {
+  struct epoll_event events[MAX_EPOLL_EVENTS];
+  struct sigaction action;
+
+  // No SA_RESTART, so that epoll_wait returns
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  stopping = 0;
+  while (!stopping) {
+    server.arm_input_notify();
+    int n = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, server.has_input() ? 0 : -1);
+    if (n < 0 && errno != EINTR) {
+      cerr << "# epoll_wait: " << strerror(errno) << endl;
+      return;
+    }
+
+    for (int i = 0; i < n; ++i) {
+      void *ptr = events[i].data.ptr;
+      if (ptr == nullptr)
+        accept_clients();
+      else if (ptr == &input_fd) {
+        uint64_t count;
+        ssize_t bytes_read = read(input_fd, &count, sizeof(count));
+        (void)bytes_read;
+      }
+      else if (ptr == &hotplug_fd)
+        server.rescan_if_hotplugged();
+      else {
+        Client *client = (Client *)ptr;
+        if (events[i].events & EPOLLOUT)
+          write_output(client);
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          read_commands(client);
+      }
+    }
+
+    forward_input();
+
+    // Write what commands and input produced, closing clients that quit
+    // or failed
+    for (size_t i = 0; i < clients.size(); ) {
+      Client *client = clients[i];
+      if (!client->want_write)
+        write_output(client);
+      if (client->fd < 0)
+        close_client(client);
+      else
+        ++i;
+    }
+  }
+}
+
+void SocketServer::accept_clients() {
+  int fd;
+
+  while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    Client *client = new Client();
+    client->fd = fd;
+    client->output_sent = 0;
+    client->want_write = false;
+    client->monitoring = false;
+    client->format = MONITOR_TEXT;
+    client->dropped = 0;
+    clients.push_back(client);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = client;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+// Releases the client's locks and frees it
+void SocketServer::close_client(Client *client) {
+  for (auto iter = output_locks.begin(); iter != output_locks.end(); ) {
+    if (iter->second == client)
+      iter = output_locks.erase(iter);
+    else
+      ++iter;
+  }
+  for (auto iter = clients.begin(); iter != clients.end(); ++iter) {
+    if (*iter == client) {
+      clients.erase(iter);
+      break;
+    }
+  }
+  if (client->fd >= 0)
+    close(client->fd);          // also removes it from the epoll set
+  delete client;
+}
+
+/*
+ * Reads what's available and runs each complete line. A client that
+ * disconnects or quits has its fd closed here and is freed at the end of
+ * the pass, once nothing refers to it.
+ */
+void SocketServer::read_commands(Client *client) {
+  char buf[SOCKET_READ_BUFSIZ];
+
+  while (client->fd >= 0) {
+    ssize_t n = read(client->fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    if (n <= 0) {
+      close(client->fd);
+      client->fd = -1;
+      return;
+    }
+
+    client->input.append(buf, n);
+    size_t start = 0, newline;
+    while (client->fd >= 0 && (newline = client->input.find('\n', start)) != string::npos) {
+      string line = client->input.substr(start, newline - start);
+      start = newline + 1;
+      if (!run_command(client, &line[0])) {
+        write_output(client);
+        close(client->fd);
+        client->fd = -1;
+      }
+    }
+    client->input.erase(0, start);
+    if (client->input.size() > MAX_LINE_BYTES) {
+      const char *msg = "# line too long\n";
+      queue(client, msg, strlen(msg), false);
+      client->input.clear();
+    }
+  }
+}
+
+/*
+ * Runs one line from a client. Monitoring and locks are handled here;
+ * everything else goes to the command handler with its output captured
+ * and sent back to the client. Returns false if the client quit.
+ */
+bool SocketServer::run_command(Client *client, char *line) {
+  char *words[MAX_WORDS];
+  size_t len = strlen(line);
+
+  if (len > 0 && line[len - 1] == '\r')
+    line[len - 1] = 0;
+  split_line_into_words(line, words);
+  if (words[0] == 0)
+    return true;
+
+  ostringstream response;
+  streambuf *old_cout = cout.rdbuf(response.rdbuf());
+  streambuf *old_cerr = cerr.rdbuf(response.rdbuf());
+  bool keep_open = true;
+
+  if (words[0][0] == 'm')
+    monitor(client, &words[1]);
+  else if (strcmp(words[0], "lock") == 0)
+    lock(client, &words[1], true);
+  else if (strcmp(words[0], "unlock") == 0)
+    lock(client, &words[1], false);
+  else if (check_locks(client, words))
+    keep_open = handler(server, words);
+
+  cout.rdbuf(old_cout);
+  cerr.rdbuf(old_cerr);
+  string text = response.str();
+  queue(client, text.data(), text.size(), false);
+  return keep_open;
+}
+
+// m[onitor] [:handle...] [text | json | binary] | m[onitor] off
+bool SocketServer::monitor(Client *client, char **words) {
+  MonitorFormat format = MONITOR_TEXT;
+  vector<string> handles;
+
+  if (words[0] != 0 && strcmp(words[0], "off") == 0) {
+    client->monitoring = false;
+    return true;
+  }
+  for (int i = 0; words[i] != 0; ++i) {
+    if (words[i][0] == ':') {
+      if (server.input_port_id(&words[i][1]) < 0) {
+        cerr << "# no open input named " << words[i] << endl;
+        return false;
+      }
+      handles.push_back(&words[i][1]);
+    }
+    else if (!parse_monitor_format(words[i], &format))
+      return false;
+  }
+  if (!server.is_input_open()) {
+    cerr << "# please open an input port first" << endl;
+    return false;
+  }
+
+  client->monitoring = true;
+  client->format = format;
+  client->handles = handles;
+  client->dropped = 0;
+  return true;
+}
+
+// lock :handle | unlock :handle
+bool SocketServer::lock(Client *client, char **words, bool locking) {
+  if (words[0] == 0 || words[0][0] != ':') {
+    cerr << "# " << (locking ? "lock" : "unlock") << " :handle" << endl;
+    return false;
+  }
+
+  string handle = &words[0][1];
+  auto iter = output_locks.find(handle);
+  if (iter != output_locks.end() && iter->second != client) {
+    cerr << "# output " << words[0] << " is locked by another client" << endl;
+    return false;
+  }
+  if (locking)
+    output_locks[handle] = client;
+  else if (iter != output_locks.end())
+    output_locks.erase(iter);
+  return true;
+}
+
+bool SocketServer::check_lock(Client *client, const char *handle) {
+  if (handle == nullptr)
+    return true;
+  auto iter = output_locks.find(handle);
+  if (iter == output_locks.end() || iter->second == client)
+    return true;
+  cerr << "# output :" << handle << " is locked by another client" << endl;
+  return false;
+}
+
+/*
+ * Refuses to send to, close or replace an output another client has
+ * locked.
+ */
+bool SocketServer::check_locks(Client *client, char **words) {
+  int i;
+
+  switch (words[0][0]) {
+  case 's':
+    if (strcmp(words[0], "stats") == 0)
+      return true;
+    for (i = 1; words[i] != 0 && words[i][0] == ':'; ++i)
+      if (!check_lock(client, &words[i][1]))
+        return false;
+    return i > 1 || check_lock(client, server.default_output_handle());
+  case 'c':
+    return words[1] == 0 || words[1][0] != ':' || check_lock(client, &words[1][1]);
+  case 'o':
+    if (words[1] == 0 || words[1][0] != 'o')
+      return true;
+    for (i = 2; words[i] != 0; ++i)
+      if (words[i][0] == ':' && words[i+1] == 0)
+        return check_lock(client, &words[i][1]);
+    return check_lock(client, DEFAULT_OUTPUT_HANDLE);
+  default:
+    return true;
+  }
+}
+
+/*
+ * Formats each event once per format in use and copies it to every client
+ * monitoring the event's input.
+ */
+void SocketServer::forward_input() {
+  PmEvent events[INPUT_READ_BUFSIZ];
+  int port_ids[INPUT_READ_BUFSIZ];
+  bool formats_used[3];
+
+  for (int batch = 0; batch < MAX_INPUT_BATCHES && server.has_input(); ++batch) {
+    int n = server.read_input(events, port_ids, INPUT_READ_BUFSIZ);
+
+    vector<Client *> monitors;
+    for (int f = 0; f < 3; ++f)
+      formats_used[f] = false;
+    for (Client *client : clients) {
+      if (!client->monitoring || client->fd < 0)
+        continue;
+      client->port_ids.clear();
+      for (const string &handle : client->handles)
+        client->port_ids.push_back(server.input_port_id(handle.c_str()));
+      formats_used[client->format] = true;
+      monitors.push_back(client);
+    }
+    if (monitors.empty())
+      continue;
+
+    for (int i = 0; i < n; ++i) {
+      for (int f = 0; f < 3; ++f) {
+        if (formats_used[f]) {
+          formatters[f]->clear();
+          server.format_events(*formatters[f], &events[i], 1, (MonitorFormat)f);
+        }
+      }
+      for (Client *client : monitors) {
+        bool wanted = client->port_ids.empty();
+        for (int id : client->port_ids)
+          wanted = wanted || id == port_ids[i];
+        if (wanted) {
+          Formatter *f = formatters[client->format];
+          queue(client, f->data(), f->size(), true);
+        }
+      }
+    }
+  }
+}
+
+/*
+ * Adds to the client's output. Droppable (monitor) output is dropped while
+ * the client is more than MAX_CLIENT_BACKLOG behind; once it catches up,
+ * text clients are told how many events they missed.
+ */
+void SocketServer::queue(Client *client, const char *data, size_t len, bool droppable) {
+  if (len == 0 || client->fd < 0)
+    return;
+
+  if (droppable) {
+    if (client->output.size() - client->output_sent > MAX_CLIENT_BACKLOG) {
+      ++client->dropped;
+      return;
+    }
+    if (client->dropped > 0) {
+      if (client->format != MONITOR_BINARY)
+        client->output += "# dropped " + std::to_string(client->dropped) + " events\n";
+      client->dropped = 0;
+    }
+  }
+  client->output.append(data, len);
+}
+
+void SocketServer::write_output(Client *client) {
+  while (client->fd >= 0 && client->output_sent < client->output.size()) {
+    ssize_t n = send(client->fd, client->output.data() + client->output_sent,
+                     client->output.size() - client->output_sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN) {
+      // Don't let what's been written pile up in front of what hasn't
+      if (client->output_sent > MAX_CLIENT_BACKLOG) {
+        client->output.erase(0, client->output_sent);
+        client->output_sent = 0;
+      }
+      watch_output(client, true);
+      return;
+    }
+    if (n < 0) {
+      close(client->fd);
+      client->fd = -1;
+      return;
+    }
+    client->output_sent += n;
+  }
+  client->output.clear();
+  client->output_sent = 0;
+  watch_output(client, false);
+}
+
+void SocketServer::watch_output(Client *client, bool want_write) {
+  if (client->fd < 0 || client->want_write == want_write)
+    return;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (want_write ? EPOLLOUT : 0);
+  ev.data.ptr = client;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+  client->want_write = want_write;
+}
@@ -0,0 +1,83 @@
+#ifndef SOCKET_SERVER_H
+#define SOCKET_SERVER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "formatter.h"
+#include "input_reader.h"
+#include "server.h"
+
+// A connected client
+typedef struct Client {
+  int fd;
+  std::string input;            // received, not yet a whole line
+  std::string output;           // waiting to be written
+  size_t output_sent;           // bytes of `output` already written
+  bool want_write;              // registered for EPOLLOUT
+  bool monitoring;
+  MonitorFormat format;
+  std::vector<std::string> handles; // inputs monitored; empty is all
+  std::vector<int> port_ids;        // the inputs those handles name now
+  long dropped;                 // monitor events dropped while backed up
+} Client;
+
+// Serves commands to any number of clients over a Unix or TCP socket, all
+// from one thread using epoll, sharing one Server and so one set of open
+// ports. Commands that would block (receive, record and so on) are
+// refused.
+//
+// Input is read here instead of by a monitor loop. The input reader
+// signals an eventfd when events arrive, and each event is formatted once
+// per monitor format in use and copied to every client monitoring its
+// port. Writes never block: output waits in a per-client buffer, and a
+// client that falls too far behind loses monitor events rather than
+// holding up anyone else.
+//
+// Each command runs to completion before the next, so messages sent by
+// different clients never interleave. A client can also lock an output to
+// keep other clients from sending to it. Devices are rescanned between
+// commands when they're plugged in or unplugged.
+class SocketServer {
+public:
+  // `handler` runs each client command with cout and cerr going to the
+  // client
+  SocketServer(Server &server, CommandHandler handler);
+  ~SocketServer();
+
+  // `address` is a Unix socket path if it contains a '/', else [HOST:]PORT.
+  // HOST defaults to localhost. Prints an error and returns false on
+  // failure.
+  bool listen(const char *address);
+  // Serves clients until SIGINT or SIGTERM
+  void run();
+
+private:
+  Server &server;
+  CommandHandler handler;
+  int listen_fd;
+  int epoll_fd;
+  int input_fd;                 // eventfd signalled by the input reader
+  int hotplug_fd;               // the server's, -1 if it isn't watching
+  std::string unix_path;        // removed by the destructor
+  std::vector<Client *> clients;
+  std::map<std::string, Client *> output_locks;
+  Formatter *formatters[3];     // one per MonitorFormat, in memory
+
+  bool listen_unix(const char *path);
+  bool listen_tcp(const char *address);
+  void accept_clients();
+  void close_client(Client *client);
+  void read_commands(Client *client);
+  bool run_command(Client *client, char *line);
+  bool monitor(Client *client, char **words);
+  bool lock(Client *client, char **words, bool locking);
+  bool check_lock(Client *client, const char *handle);
+  bool check_locks(Client *client, char **words);
+  void forward_input();
+  void queue(Client *client, const char *data, size_t len, bool droppable);
+  void write_output(Client *client);
+  void watch_output(Client *client, bool want_write);
+};
+
+#endif /* SOCKET_SERVER_H */
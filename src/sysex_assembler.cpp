@@ -0,0 +1,98 @@
+#include "consts.h"
+#include "sysex_assembler.h"
+
+SysexAssembler::SysexAssembler()
+  : current(nullptr), next_ready(0), next_number(0), num_cut_short(0)
+{
+}
+
+SysexAssembler::~SysexAssembler() {
+  reset();
+  for (SysexMessage *message : pool)
+    delete message;
+}
+
+void SysexAssembler::add(const PmEvent *events, int num_events) {
+  for (int i = 0; i < num_events; ++i) {
+    PmMessage msg = events[i].message;
+
+    // The middle of a message: four data bytes
+    if (current != nullptr && (msg & 0x80808080) == 0) {
+      for (int j = 0; j < 4; ++j)
+        current->bytes.push_back((msg >> (j * 8)) & 0xff);
+      continue;
+    }
+    // A realtime message in an event of its own
+    if ((msg & 0xff) >= CLOCK && (msg & 0xffffff00) == 0)
+      continue;
+
+    for (int j = 0; j < 4; ++j) {
+      byte b = (msg >> (j * 8)) & 0xff;
+      if (b >= CLOCK)           // realtime, embedded in sysex
+        continue;
+      if (b == SYSEX) {
+        if (current != nullptr)
+          drop_current();
+        start(events[i].timestamp);
+      }
+      else if (current == nullptr)
+        break;                  // not sysex
+      else if ((b & 0x80) != 0 && b != EOX) {
+        drop_current();         // any other status byte ends sysex
+        break;
+      }
+
+      current->bytes.push_back(b);
+      if (b == EOX) {
+        ready.push_back(current);
+        current = nullptr;
+        break;                  // the rest of the event is padding
+      }
+    }
+  }
+}
+
+SysexMessage *SysexAssembler::next() {
+  if (!has_ready())
+    return nullptr;
+
+  SysexMessage *message = ready[next_ready++];
+  if (next_ready == ready.size()) {
+    ready.clear();
+    next_ready = 0;
+  }
+  return message;
+}
+
+void SysexAssembler::release(SysexMessage *message) {
+  pool.push_back(message);
+}
+
+void SysexAssembler::reset() {
+  if (current != nullptr) {
+    pool.push_back(current);
+    current = nullptr;
+  }
+  for (; next_ready < ready.size(); ++next_ready)
+    pool.push_back(ready[next_ready]);
+  ready.clear();
+  next_ready = 0;
+}
+
+void SysexAssembler::start(PmTimestamp timestamp) {
+  if (pool.empty())
+    current = new SysexMessage();
+  else {
+    current = pool.back();
+    pool.pop_back();
+  }
+  current->bytes.clear();
+  current->timestamp = timestamp;
+  current->number = next_number++;
+}
+
+void SysexAssembler::drop_current() {
+  pool.push_back(current);
+  current = nullptr;
+  ++num_cut_short;
+}
@@ -0,0 +1,66 @@
+#ifndef SYSEX_ASSEMBLER_H
+#define SYSEX_ASSEMBLER_H
+
+#include <vector>
+#include <stddef.h>
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+// A sysex message, F0 through F7, in a buffer owned by a SysexAssembler
+typedef struct SysexMessage {
+  std::vector<byte> bytes;
+  PmTimestamp timestamp;        // of the event holding the F0
+  long number;                  // counts messages started, cut short or not
+} SysexMessage;
+
+/*
+ * Reassembles sysex messages from the four-bytes-per-event form PortMidi
+ * reads them in. Realtime messages may arrive in the middle of a message,
+ * either as events of their own or as bytes embedded in sysex events, and
+ * are skipped. A batch of events can hold the ends and starts of any
+ * number of messages, and a message can span any number of batches.
+ *
+ * Finished messages wait in order until taken with `next`, so nothing
+ * after the end of the message a caller wanted is lost. Their buffers
+ * come from a pool and go back to it on `release`, keeping what they
+ * grew to, so once the pool has warmed up to the sizes and number of
+ * messages in flight no more memory is allocated.
+ */
+class SysexAssembler {
+public:
+  SysexAssembler();
+  ~SysexAssembler();
+
+  void add(const PmEvent *events, int num_events);
+
+  bool has_ready() const { return next_ready < ready.size(); }
+  // Returns the oldest finished message, or nullptr. It belongs to the
+  // caller until it is given back with `release`.
+  SysexMessage *next();
+  void release(SysexMessage *message);
+  // The message being assembled, or nullptr. Lets callers handle long
+  // messages a batch at a time as they arrive.
+  const SysexMessage *partial() const { return current; }
+
+  // Drops the message being assembled and any waiting to be taken
+  void reset();
+  // Messages dropped because a status byte arrived before their EOX
+  long cut_short() const { return num_cut_short; }
+
+private:
+  SysexMessage *current;
+  std::vector<SysexMessage *> ready;
+  size_t next_ready;
+  std::vector<SysexMessage *> pool;
+  long next_number;
+  long num_cut_short;
+
+  void start(PmTimestamp timestamp);
+  void drop_current();
+
+  SysexAssembler(const SysexAssembler &);
+  SysexAssembler &operator=(const SysexAssembler &);
+};
+
+#endif /* SYSEX_ASSEMBLER_H */
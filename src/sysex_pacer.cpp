@@ -0,0 +1,191 @@
+#include <chrono>
+#include <iostream>
+#include "consts.h"
+#include "sysex_pacer.h"
+
+#define PACER_EVENT_BUFSIZ 1024
+
+using std::cerr;
+using std::endl;
+using std::lock_guard;
+using std::mutex;
+using std::unique_lock;
+using std::vector;
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+
+void PacedSend::add_delay(long millisecs) {
+  Item item = {PACED_DELAY, millisecs, 0};
+  items.push_back(item);
+}
+
+void PacedSend::add_short(PmMessage msg) {
+  Item item = {PACED_SHORT, msg, 0};
+  items.push_back(item);
+}
+
+void PacedSend::add_sysex(const byte *bytes, size_t len) {
+  Item item = {PACED_SYSEX, (long)data.size(), len};
+  items.push_back(item);
+  data.insert(data.end(), bytes, bytes + len);
+  sysex_bytes += len;
+}
+
+SysexPacer::SysexPacer(MidiBackend *midi)
+  : midi(midi), output(nullptr), chunk_bytes(0), delay_ms(0), bytes_per_sec(0),
+    busy(false), stopping(false)
+{
+}
+
+SysexPacer::~SysexPacer() {
+  if (!thread.joinable())
+    return;
+
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    stopping = true;
+  }
+  queue_changed.notify_all();
+  thread.join();
+}
+
+void SysexPacer::set_delay(size_t chunk, long millisecs) {
+  wait_until_idle();
+  chunk_bytes = (chunk + 3) & ~(size_t)3;
+  delay_ms = millisecs;
+  bytes_per_sec = 0;
+}
+
+void SysexPacer::set_rate(size_t chunk, long rate) {
+  wait_until_idle();
+  chunk_bytes = (chunk + 3) & ~(size_t)3;
+  delay_ms = 0;
+  bytes_per_sec = rate;
+}
+
+void SysexPacer::print_settings() {
+  if (!is_enabled())
+    cerr << "# pacing is off" << endl;
+  else if (bytes_per_sec > 0)
+    cerr << "# pacing sysex at " << bytes_per_sec << " bytes/sec in "
+         << chunk_bytes << " byte chunks" << endl;
+  else
+    cerr << "# pacing sysex in " << chunk_bytes << " byte chunks, "
+         << delay_ms << " ms apart" << endl;
+}
+
+void SysexPacer::set_output(PortMidiStream *stream) {
+  wait_until_idle();
+  output = stream;
+}
+
+void SysexPacer::send(PacedSend &send) {
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    queue.push_back(std::move(send));
+    if (!thread.joinable())
+      thread = std::thread(&SysexPacer::run, this);
+  }
+  queue_changed.notify_all();
+}
+
+void SysexPacer::wait_until_idle() {
+  unique_lock<mutex> lock(queue_mutex);
+  queue_changed.wait(lock, [this]{ return queue.empty() && !busy; });
+}
+
+void SysexPacer::print_finished() {
+  vector<PacedTime> times;
+  {
+    lock_guard<mutex> lock(queue_mutex);
+    times.swap(finished);
+  }
+
+  for (const PacedTime &time : times) {
+    cerr << "# paced " << time.sysex_bytes << " sysex bytes in "
+         << time.secs * 1000.0 << " ms";
+    if (time.secs > 0)
+      cerr << " (" << (long)(time.sysex_bytes / time.secs) << " bytes/sec)";
+    cerr << endl;
+  }
+}
+
+void SysexPacer::run() {
+  unique_lock<mutex> lock(queue_mutex);
+  while (true) {
+    queue_changed.wait(lock, [this]{ return !queue.empty() || stopping; });
+    if (queue.empty())
+      return;
+
+    PacedSend send = std::move(queue.front());
+    queue.pop_front();
+    busy = true;
+    lock.unlock();
+    send_now(send);
+    lock.lock();
+    busy = false;
+    queue_changed.notify_all();
+  }
+}
+
+void SysexPacer::send_now(PacedSend &send) {
+  steady_clock::time_point start_time = steady_clock::now();
+
+  for (PacedSend::Item &item : send.items) {
+    switch (item.type) {
+    case PacedSend::PACED_DELAY:
+      std::this_thread::sleep_for(milliseconds(item.value));
+      break;
+    case PacedSend::PACED_SHORT:
+      midi->write_short(output, 0, (PmMessage)item.value);
+      break;
+    case PacedSend::PACED_SYSEX:
+      send_sysex(&send.data[item.value], item.len);
+      break;
+    }
+  }
+
+  if (send.sysex_bytes > 0) {
+    PacedTime time = {send.sysex_bytes,
+                      duration<double>(steady_clock::now() - start_time).count()};
+    lock_guard<mutex> lock(queue_mutex);
+    finished.push_back(time);
+  }
+}
+
+/*
+ * Sends one sysex message `chunk_bytes` at a time. PortMidi lets a sysex
+ * message span several Pm_Write calls as long as every event but the last
+ * holds four bytes. Chunk times are computed from the start time, not the
+ * previous chunk, so that sleep overshoot doesn't accumulate.
+ */
+void SysexPacer::send_sysex(const byte *bytes, size_t len) {
+  PmEvent events[PACER_EVENT_BUFSIZ];
+  nanoseconds interval = bytes_per_sec > 0
+    ? nanoseconds((long long)chunk_bytes * 1000000000LL / bytes_per_sec)
+    : nanoseconds(milliseconds(delay_ms));
+  steady_clock::time_point next_chunk_time = steady_clock::now();
+
+  for (size_t offset = 0; offset < len; offset += chunk_bytes) {
+    std::this_thread::sleep_until(next_chunk_time);
+
+    size_t chunk_end = offset + chunk_bytes < len ? offset + chunk_bytes : len;
+    int num_events = 0;
+    for (size_t i = offset; i < chunk_end; i += 4) {
+      PmMessage msg = 0;
+      for (int j = 0; j < 4 && i + j < chunk_end; ++j)
+        msg |= (PmMessage)bytes[i + j] << (j * 8);
+      events[num_events].message = msg;
+      events[num_events].timestamp = 0;
+      if (++num_events == PACER_EVENT_BUFSIZ) {
+        midi->write(output, events, num_events);
+        num_events = 0;
+      }
+    }
+    if (num_events > 0)
+      midi->write(output, events, num_events);
+    next_chunk_time += interval;
+  }
+}
@@ -0,0 +1,92 @@
+#ifndef SYSEX_PACER_H
+#define SYSEX_PACER_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "midi_backend.h"
+#include "portmidi.h"
+
+typedef unsigned char byte;
+
+// One send command's worth of output, in order
+class PacedSend {
+public:
+  PacedSend() : sysex_bytes(0) {}
+
+  void add_delay(long millisecs);
+  void add_short(PmMessage msg);
+  void add_sysex(const byte *bytes, size_t len);
+
+private:
+  typedef enum ItemType { PACED_DELAY, PACED_SHORT, PACED_SYSEX } ItemType;
+  typedef struct Item {
+    ItemType type;
+    long value;                 // delay, message, or offset into data
+    size_t len;                 // sysex length
+  } Item;
+
+  std::vector<Item> items;
+  std::vector<byte> data;
+  size_t sysex_bytes;
+
+  friend class SysexPacer;
+};
+
+// Sends output on a background thread, splitting sysex messages into
+// chunks with a pause between each one so that slow receivers can keep
+// up. Pacing is either a fixed delay between chunks or a target rate in
+// bytes per second.
+//
+// While pacing is enabled every send must go through the pacer so that
+// output stays in order and only one thread writes to the stream.
+class SysexPacer {
+public:
+  SysexPacer(MidiBackend *midi);
+  ~SysexPacer();
+
+  // `chunk_bytes` is rounded up to a multiple of four, the number of sysex
+  // bytes in a PmEvent. A chunk size of 0 turns pacing off.
+  void set_delay(size_t chunk_bytes, long delay_ms);
+  void set_rate(size_t chunk_bytes, long bytes_per_sec);
+  bool is_enabled() { return chunk_bytes > 0; }
+  void print_settings();
+
+  void set_output(PortMidiStream *stream);
+  // Queues `send` and returns immediately
+  void send(PacedSend &send);
+  // Blocks until everything queued so far has been sent
+  void wait_until_idle();
+  // Prints the rate each send that has finished since the last call
+  // achieved. The pacer thread only records them, leaving the printing to
+  // the thread that owns cerr.
+  void print_finished();
+
+private:
+  // How long a send's sysex took
+  typedef struct PacedTime {
+    size_t sysex_bytes;
+    double secs;
+  } PacedTime;
+
+  MidiBackend *midi;
+  PortMidiStream *output;
+  size_t chunk_bytes;
+  long delay_ms;
+  long bytes_per_sec;
+  std::deque<PacedSend> queue;
+  std::vector<PacedTime> finished;
+  bool busy;
+  bool stopping;
+  std::thread thread;
+  std::mutex queue_mutex;
+  std::condition_variable queue_changed;
+
+  void run();
+  void send_now(PacedSend &send);
+  void send_sysex(const byte *bytes, size_t len);
+};
+
+#endif /* SYSEX_PACER_H */
@@ -0,0 +1,107 @@
+#include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sysex_writer.h"
+
+#define WRITER_BUFSIZ (256 * 1024)
+
+using std::cerr;
+using std::endl;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+SysexWriter::SysexWriter()
+  : fd(-1), buf(new byte[WRITER_BUFSIZ]), buf_size(WRITER_BUFSIZ),
+    buf_used(0), bytes_written(0), failed(false)
+{
+}
+
+SysexWriter::~SysexWriter() {
+  close();
+  delete[] buf;
+}
+
+bool SysexWriter::open(const char * const path, size_t preallocate) {
+  fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    perror("error opening output file");
+    return false;
+  }
+  buf_used = bytes_written = 0;
+  failed = false;
+
+  if (preallocate > 0) {
+#if defined(__APPLE__)
+    fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)preallocate, 0};
+    if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+      store.fst_flags = F_ALLOCATEALL;
+      fcntl(fd, F_PREALLOCATE, &store);
+    }
+#else
+    // Failure is harmless, we just don't get the benefit
+    posix_fallocate(fd, 0, (off_t)preallocate);
+#endif
+  }
+  start_time = end_time = steady_clock::now();
+  return true;
+}
+
+bool SysexWriter::close() {
+  if (fd == -1)
+    return !failed;
+
+  flush();
+  end_time = steady_clock::now();
+  if (ftruncate(fd, (off_t)bytes_written) == -1)
+    failed = true;
+  if (::close(fd) == -1)
+    failed = true;
+  fd = -1;
+  return !failed;
+}
+
+void SysexWriter::write(const byte *bytes, size_t n) {
+  if (size() == 0 && n > 0)
+    start_time = steady_clock::now();
+  while (n > 0) {
+    if (buf_used == buf_size)
+      flush();
+    size_t chunk = buf_size - buf_used;
+    if (chunk > n)
+      chunk = n;
+    memcpy(buf + buf_used, bytes, chunk);
+    buf_used += chunk;
+    bytes += chunk;
+    n -= chunk;
+  }
+}
+
+void SysexWriter::flush() {
+  byte *p = buf;
+  while (buf_used > 0 && !failed) {
+    ssize_t n = ::write(fd, p, buf_used);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("error writing output file");
+      failed = true;
+      break;
+    }
+    p += n;
+    buf_used -= n;
+    bytes_written += n;
+  }
+  buf_used = 0;
+}
+
+void SysexWriter::print_throughput() {
+  double secs = duration<double>(end_time - start_time).count();
+  cerr << "# wrote " << bytes_written << " bytes";
+  if (secs > 0)
+    cerr << " in " << secs * 1000.0 << " ms ("
+         << (long)(bytes_written / secs) << " bytes/sec)";
+  cerr << endl;
+}
@@ -0,0 +1,50 @@
+#ifndef SYSEX_WRITER_H
+#define SYSEX_WRITER_H
+
+#include <chrono>
+#include <stddef.h>
+
+typedef unsigned char byte;
+
+// Collects captured sysex bytes into a large buffer and writes them to a
+// file a block at a time. Optionally preallocates the file so that large
+// dumps don't fragment it or pay for growing it a block at a time.
+class SysexWriter {
+public:
+  SysexWriter();
+  ~SysexWriter();
+
+  // Returns false and prints an error if the file can't be created.
+  // `preallocate` is the expected size in bytes, or 0 for none.
+  bool open(const char * const path, size_t preallocate);
+  // Flushes and closes the file, truncating any unused preallocated space.
+  // Returns false if any write failed.
+  bool close();
+
+  void write(byte b) {
+    if (buf_used == buf_size)
+      flush();
+    if (bytes_written == 0 && buf_used == 0)
+      start_time = std::chrono::steady_clock::now();
+    buf[buf_used++] = b;
+  }
+  void write(const byte *bytes, size_t n);
+
+  size_t size() const { return bytes_written + buf_used; }
+  // Prints the number of bytes written and the rate they arrived at
+  void print_throughput();
+
+private:
+  int fd;
+  byte *buf;
+  size_t buf_size;
+  size_t buf_used;
+  size_t bytes_written;
+  bool failed;
+  std::chrono::steady_clock::time_point start_time;
+  std::chrono::steady_clock::time_point end_time;
+
+  void flush();
+};
+
+#endif /* SYSEX_WRITER_H */
@@ -0,0 +1,124 @@
+#include <iostream>
+#include <string.h>
+#include "hex.h"
+#include "midi_message.h"
+#include "transaction.h"
+
+using namespace std::chrono;
+using std::cerr;
+using std::endl;
+
+bool parse_reply_pattern(const char *word, ReplyPattern *pattern) {
+  size_t len = strlen(word);
+
+  pattern->clear();
+  if (len % 2 != 0) {
+    cerr << "# reply pattern \"" << word << "\" has an odd number of digits" << endl;
+    return false;
+  }
+  for (size_t i = 0; i < len; i += 2) {
+    byte b;
+    size_t num_decoded;
+
+    if (strncmp(&word[i], "??", 2) == 0)
+      pattern->push_back(PATTERN_ANY);
+    else if (strncmp(&word[i], "==", 2) == 0)
+      pattern->push_back(PATTERN_SAME);
+    else if (hex_decode_word(&word[i], 2, &b, &num_decoded) == HEX_OK)
+      pattern->push_back(b);
+    else {
+      cerr << "# bad byte \"" << std::string(&word[i], 2) << "\" in reply pattern" << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool reply_matches(const ReplyPattern &pattern, const byte *request, size_t request_len,
+                   const byte *reply, size_t reply_len)
+{
+  if (reply_len < pattern.size())
+    return false;
+  for (size_t i = 0; i < pattern.size(); ++i) {
+    switch (pattern[i]) {
+    case PATTERN_ANY:
+      break;
+    case PATTERN_SAME:
+      if (i >= request_len || reply[i] != request[i])
+        return false;
+      break;
+    default:
+      if (reply[i] != pattern[i])
+        return false;
+      break;
+    }
+  }
+  return true;
+}
+
+TransactionQueue::TransactionQueue(size_t window, long timeout_ms, const ReplyPattern &pattern)
+  : window(window < 1 ? 1 : window), timeout_ms(timeout_ms), pattern(pattern),
+    next_unsent(0), num_answered(0), num_timed_out(0)
+{
+}
+
+size_t TransactionQueue::add_requests(const byte *data, size_t num_bytes) {
+  size_t num_added = 0;
+  long num_skipped = 0;
+
+  for (size_t i = 0; i < num_bytes; ) {
+    size_t len;
+    if (next_message(&data[i], num_bytes - i, &len) == MESSAGE_SYSEX) {
+      Transaction t = {bytes.size(), len, TRANSACTION_WAITING, steady_clock::time_point(), 0};
+      bytes.insert(bytes.end(), &data[i], &data[i] + len);
+      transactions.push_back(t);
+      ++num_added;
+    }
+    else
+      ++num_skipped;
+    i += len;
+  }
+  if (num_skipped > 0)
+    cerr << "# warning: skipped " << num_skipped << " non-sysex bytes or messages" << endl;
+  return num_added;
+}
+
+long TransactionQueue::next_to_send(steady_clock::time_point now) {
+  if (in_flight.size() >= window || next_unsent == transactions.size())
+    return -1;
+
+  Transaction &t = transactions[next_unsent];
+  t.state = TRANSACTION_SENT;
+  t.sent_time = now;
+  in_flight.push_back(next_unsent);
+  return next_unsent++;
+}
+
+long TransactionQueue::answer(const byte *reply, size_t reply_len, steady_clock::time_point now) {
+  for (auto i = in_flight.begin(); i != in_flight.end(); ++i) {
+    Transaction &t = transactions[*i];
+    if (!reply_matches(pattern, &bytes[t.offset], t.length, reply, reply_len))
+      continue;
+
+    long index = *i;
+    t.state = TRANSACTION_ANSWERED;
+    t.round_trip_us = duration_cast<microseconds>(now - t.sent_time).count();
+    in_flight.erase(i);
+    ++num_answered;
+    return index;
+  }
+  return -1;
+}
+
+void TransactionQueue::expire(steady_clock::time_point now, std::vector<size_t> &expired) {
+  // Sent in order with the same timeout, so they expire in order
+  while (!in_flight.empty()) {
+    Transaction &t = transactions[in_flight.front()];
+    if (duration_cast<milliseconds>(now - t.sent_time).count() < timeout_ms)
+      break;
+    t.state = TRANSACTION_TIMED_OUT;
+    expired.push_back(in_flight.front());
+    in_flight.pop_front();
+    ++num_timed_out;
+  }
+}
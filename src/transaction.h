@@ -0,0 +1,95 @@
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <stddef.h>
+
+typedef unsigned char byte;
+
+// Reply pattern bytes that aren't literal byte values
+#define PATTERN_ANY -1          // "??" matches any byte
+#define PATTERN_SAME -2         // "==" matches the request's byte at the same offset
+
+// The start of the sysex reply a request expects, for example the
+// manufacturer, model and function bytes. An empty pattern matches any
+// sysex message.
+typedef std::vector<int> ReplyPattern;
+
+// Parses a word of two-character hex bytes, "??" and "==", like
+// "f042??684c====". Prints an error and returns false if `word` is bad.
+bool parse_reply_pattern(const char *word, ReplyPattern *pattern);
+
+// Returns true if `reply` starts with `pattern`, given the request it
+// would answer
+bool reply_matches(const ReplyPattern &pattern, const byte *request, size_t request_len,
+                   const byte *reply, size_t reply_len);
+
+typedef enum TransactionState {
+  TRANSACTION_WAITING,          // not sent yet
+  TRANSACTION_SENT,
+  TRANSACTION_ANSWERED,
+  TRANSACTION_TIMED_OUT
+} TransactionState;
+
+typedef struct Transaction {
+  size_t offset;                // of the request in the queue's bytes
+  size_t length;
+  TransactionState state;
+  std::chrono::steady_clock::time_point sent_time;
+  long round_trip_us;           // once answered
+} Transaction;
+
+/*
+ * Sysex requests sent with up to `window` of them awaiting replies at
+ * once. Each reply is given to the oldest request still waiting whose
+ * pattern it matches, so replies correlate back to their requests even
+ * when the device answers out of order, as long as the pattern's "=="
+ * bytes tell the requests apart. Requests that wait longer than
+ * `timeout_ms` for a reply time out and free their place in the window.
+ *
+ * The queue does no I/O; the caller sends what next_to_send returns and
+ * hands it the replies.
+ */
+class TransactionQueue {
+public:
+  TransactionQueue(size_t window, long timeout_ms, const ReplyPattern &pattern);
+
+  // Adds each sysex message in `bytes` as a request. Returns the number
+  // added. Other messages are skipped with a warning.
+  size_t add_requests(const byte *bytes, size_t num_bytes);
+
+  size_t size() const { return transactions.size(); }
+  const byte *request(size_t i) const { return &bytes[transactions[i].offset]; }
+  size_t request_length(size_t i) const { return transactions[i].length; }
+  const Transaction &transaction(size_t i) const { return transactions[i]; }
+
+  // Returns the index of the next request to send and marks it sent at
+  // `now`, or returns -1 if the window is full or nothing is left
+  long next_to_send(std::chrono::steady_clock::time_point now);
+  // Returns the index of the request `reply` answers and marks it
+  // answered, or -1 if it answers none of them
+  long answer(const byte *reply, size_t reply_len, std::chrono::steady_clock::time_point now);
+  // Times out requests sent `timeout_ms` or more before `now`, appending
+  // their indexes to `expired`
+  void expire(std::chrono::steady_clock::time_point now, std::vector<size_t> &expired);
+
+  // Everything has been sent and answered or timed out
+  bool done() const { return next_unsent == transactions.size() && in_flight.empty(); }
+  long answered() const { return num_answered; }
+  long timed_out() const { return num_timed_out; }
+
+private:
+  size_t window;
+  long timeout_ms;
+  ReplyPattern pattern;
+  std::vector<byte> bytes;
+  std::vector<Transaction> transactions;
+  size_t next_unsent;
+  std::deque<size_t> in_flight; // in the order sent
+  long num_answered;
+  long num_timed_out;
+};
+
+#endif /* TRANSACTION_H */
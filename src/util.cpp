@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 #include "util.h"
 
@@ -19,3 +20,17 @@ void split_line_into_words(char *line, char *words[]) {
         break;
   *ap = 0;
 }
+
+// Parses a byte count with an optional k or m suffix
+size_t parse_size(const char *str) {
+  char *suffix;
+  size_t size = strtoul(str, &suffix, 10);
+  switch (*suffix) {
+  case 'k': case 'K':
+    return size * 1024;
+  case 'm': case 'M':
+    return size * 1024 * 1024;
+  default:
+    return size;
+  }
+}
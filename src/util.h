@@ -1,8 +1,12 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
+
 #define MAX_WORDS 1024
 
 extern void split_line_into_words(char *line, char *words[]);
+// Parses a byte count with an optional k or m suffix
+extern size_t parse_size(const char *str);
 
 #endif /* UTIL_H */
\ No newline at end of file
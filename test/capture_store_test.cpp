@@ -0,0 +1,215 @@
+#include <catch2/catch_all.hpp>
+#include <fstream>
+#include <iterator>
+#include <signal.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include "../src/capture_store.h"
+
+#define CATCH_CATEGORY "[capture_store]"
+
+static std::string temp_dir() {
+  char path[] = "/tmp/pmserver_store_XXXXXX";
+  REQUIRE(mkdtemp(path) != nullptr);
+  return path;
+}
+
+static void remove_dir(const std::string &dir) {
+  REQUIRE(system(("rm -rf " + dir).c_str()) == 0);
+}
+
+static std::vector<byte> read_file(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  return std::vector<byte>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void write_file(const std::string &path, const std::vector<byte> &bytes) {
+  std::ofstream out(path, std::ios::binary);
+  out.write((const char *)bytes.data(), bytes.size());
+}
+
+static std::vector<byte> sysex(byte id, size_t length) {
+  std::vector<byte> bytes = {0xf0, 0x42, id};
+  for (size_t i = 3; i < length - 1; ++i)
+    bytes.push_back((byte)((i * id) & 0x7f));
+  bytes.push_back(0xf7);
+  return bytes;
+}
+
+TEST_CASE("captures share messages", CATCH_CATEGORY) {
+  std::string dir = temp_dir();
+  CaptureStore store;
+  Capture capture;
+  std::vector<byte> a = sysex(1, 100), b = sysex(2, 200), c = sysex(3, 50);
+
+  REQUIRE(store.open(dir.c_str()));
+  store.begin(capture);
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  REQUIRE(store.add(capture, b.data(), b.size()));
+  REQUIRE(store.finish(capture, "monday"));
+  REQUIRE(capture.new_messages == 2);
+  REQUIRE(capture.extents.size() == 1);
+  REQUIRE(store.stored_bytes() == 300);
+
+  // the same dump again, then one that changed at the end
+  store.begin(capture);
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  REQUIRE(store.add(capture, b.data(), b.size()));
+  REQUIRE(store.finish(capture, "tuesday"));
+  REQUIRE(capture.new_messages == 0);
+  REQUIRE(capture.extents.size() == 1);
+
+  store.begin(capture);
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  REQUIRE(store.add(capture, c.data(), c.size()));
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  REQUIRE(store.finish(capture, "wednesday"));
+  REQUIRE(capture.new_messages == 1);
+  REQUIRE(capture.new_bytes == 50);
+  REQUIRE(capture.extents.size() == 3);
+  REQUIRE(store.stored_bytes() == 350);
+
+  // reopening reads the index back
+  store.close();
+  REQUIRE(store.open(dir.c_str()));
+  REQUIRE(store.stored_objects() == 3);
+  store.begin(capture);
+  REQUIRE(store.add(capture, c.data(), c.size()));
+  REQUIRE(capture.new_messages == 0);
+
+  std::vector<CaptureInfo> captures;
+  REQUIRE(store.list(captures));
+  REQUIRE(captures.size() == 3);
+  REQUIRE(captures[0].name == "monday");
+  REQUIRE(captures[2].name == "wednesday");
+  REQUIRE(captures[2].header.size == 250);
+  REQUIRE(captures[2].header.messages == 3);
+
+  std::string out = dir + "/wednesday.syx";
+  REQUIRE(store.extract("wednesday", out.c_str()));
+  std::vector<byte> expected(a);
+  expected.insert(expected.end(), c.begin(), c.end());
+  expected.insert(expected.end(), a.begin(), a.end());
+  REQUIRE(read_file(out) == expected);
+
+  REQUIRE(!store.extract("thursday", out.c_str()));
+  remove_dir(dir);
+}
+
+TEST_CASE("import and extract are byte-exact", CATCH_CATEGORY) {
+  std::string dir = temp_dir();
+  CaptureStore store;
+  Capture capture;
+  std::vector<byte> a = sysex(1, 100), b = sysex(2, 20);
+
+  // stray bytes before, between and after messages, and an unfinished one
+  std::vector<byte> file = {0x90, 0x40, 0x7f};
+  file.insert(file.end(), a.begin(), a.end());
+  file.push_back(0xfe);
+  file.insert(file.end(), b.begin(), b.end());
+  file.insert(file.end(), a.begin(), a.end());
+  file.insert(file.end(), {0xf0, 0x42, 0x01});
+  std::string in = dir + "/in.syx";
+  write_file(in, file);
+
+  REQUIRE(store.open(dir.c_str()));
+  REQUIRE(store.import("dump", in.c_str(), capture));
+  REQUIRE(capture.messages == 6);
+  REQUIRE(capture.new_messages == 5);
+  REQUIRE(capture.size == file.size());
+
+  std::string out = dir + "/out.syx";
+  REQUIRE(store.extract("dump", out.c_str()));
+  REQUIRE(read_file(out) == file);
+
+  REQUIRE(!CaptureStore::valid_name("../dump"));
+  REQUIRE(!CaptureStore::valid_name(".hidden"));
+  REQUIRE(CaptureStore::valid_name("kronos-2026-10-16"));
+  remove_dir(dir);
+}
+
+TEST_CASE("hash collisions don't share storage", CATCH_CATEGORY) {
+  std::string dir = temp_dir();
+  CaptureStore store;
+  Capture capture;
+  std::vector<byte> a = sysex(1, 100), b = sysex(2, 100);
+
+  REQUIRE(store.open(dir.c_str()));
+  store.begin(capture);
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  store.close();
+
+  // Give b's index entry a's hash by rewriting the index by hand
+  REQUIRE(store.open(dir.c_str()));
+  store.begin(capture);
+  REQUIRE(store.add(capture, b.data(), b.size()));
+  store.close();
+  std::string index = dir + "/" CAPTURE_INDEX_FILE;
+  std::vector<byte> records = read_file(index);
+  REQUIRE(records.size() == 2 * sizeof(StoredObject));
+  memcpy(&records[sizeof(StoredObject)], &records[0], sizeof(uint64_t));
+  write_file(index, records);
+
+  REQUIRE(store.open(dir.c_str()));
+  store.begin(capture);
+  REQUIRE(store.add(capture, b.data(), b.size()));
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  REQUIRE(capture.new_messages == 1);   // b, whose real hash isn't indexed
+  REQUIRE(store.finish(capture, "both"));
+
+  std::string out = dir + "/both.syx";
+  REQUIRE(store.extract("both", out.c_str()));
+  std::vector<byte> expected(b);
+  expected.insert(expected.end(), a.begin(), a.end());
+  REQUIRE(read_file(out) == expected);
+  remove_dir(dir);
+}
+
+TEST_CASE("a failed write leaves the store consistent", CATCH_CATEGORY) {
+  std::string dir = temp_dir();
+  CaptureStore store;
+  Capture capture;
+  std::vector<byte> a = sysex(1, 100), b = sysex(2, 200);
+  struct rlimit old_limit, limit;
+
+  REQUIRE(store.open(dir.c_str()));
+  store.begin(capture);
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  REQUIRE(store.finish(capture, "first"));
+
+  // Let only part of b reach the pack
+  signal(SIGXFSZ, SIG_IGN);
+  REQUIRE(getrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+  limit = old_limit;
+  limit.rlim_cur = 150;
+  REQUIRE(setrlimit(RLIMIT_FSIZE, &limit) == 0);
+  store.begin(capture);
+  REQUIRE(store.add(capture, b.data(), b.size()));
+  bool finished = store.finish(capture, "second");
+  REQUIRE(setrlimit(RLIMIT_FSIZE, &old_limit) == 0);
+  signal(SIGXFSZ, SIG_DFL);
+  REQUIRE(!finished);
+  REQUIRE(store.stored_objects() == 1);
+  REQUIRE(store.stored_bytes() == 100);
+
+  store.begin(capture);
+  REQUIRE(store.add(capture, b.data(), b.size()));
+  REQUIRE(store.add(capture, a.data(), a.size()));
+  REQUIRE(capture.new_messages == 1);
+  REQUIRE(store.finish(capture, "third"));
+
+  std::string out = dir + "/third.syx";
+  std::vector<byte> expected(b);
+  expected.insert(expected.end(), a.begin(), a.end());
+  REQUIRE(store.extract("third", out.c_str()));
+  REQUIRE(read_file(out) == expected);
+
+  store.close();
+  REQUIRE(store.open(dir.c_str()));
+  REQUIRE(store.stored_objects() == 2);
+  REQUIRE(store.extract("third", out.c_str()));
+  REQUIRE(read_file(out) == expected);
+  remove_dir(dir);
+}
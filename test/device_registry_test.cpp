@@ -0,0 +1,81 @@
+#include <catch2/catch_all.hpp>
+#include "../src/device_registry.h"
+
+#define CATCH_CATEGORY "[device_registry]"
+
+// Just enough backend for the registry to list
+class FakeBackend : public MidiBackend {
+public:
+  std::vector<PmDeviceInfo> devices;
+
+  void add(const char *name, bool input) {
+    PmDeviceInfo info = {1, "fake", name, input ? 1 : 0, input ? 0 : 1, 0};
+    devices.push_back(info);
+  }
+
+  int count_devices() { return (int)devices.size(); }
+  const PmDeviceInfo *device_info(int device) { return &devices[device]; }
+  PmError rescan() { return pmNoError; }
+  PmError open_input(PortMidiStream **, int, int) { return pmNoError; }
+  PmError open_output(PortMidiStream **, int, int, int) { return pmNoError; }
+  PmError close(PortMidiStream *) { return pmNoError; }
+  PmError set_filter(PortMidiStream *, int32_t) { return pmNoError; }
+  PmError set_channel_mask(PortMidiStream *, int) { return pmNoError; }
+  int read(PortMidiStream *, PmEvent *, int) { return 0; }
+  PmError write(PortMidiStream *, PmEvent *, int) { return pmNoError; }
+  PmError write_short(PortMidiStream *, PmTimestamp, PmMessage) { return pmNoError; }
+  PmError write_sysex(PortMidiStream *, PmTimestamp, byte *) { return pmNoError; }
+};
+
+TEST_CASE("find devices", CATCH_CATEGORY) {
+  FakeBackend midi;
+  midi.add("Midi Through Port-0", true);
+  midi.add("Midi Through Port-0", false);
+  midi.add("microKORG XL MIDI 1", true);
+  midi.add("microKORG XL MIDI 1", false);
+  midi.add("UM-ONE MIDI 1", false);
+  midi.add("UM-ONE", false);
+  DeviceRegistry registry(&midi);
+
+  REQUIRE(registry.all().size() == 6);
+  REQUIRE(registry.find("3", false) == 3);
+
+  // exact matches win, ignoring case
+  REQUIRE(registry.find("midi through port-0", true) == 0);
+  REQUIRE(registry.find("Midi Through Port-0", false) == 1);
+  REQUIRE(registry.find("um-one", false) == 5);
+
+  // then prefixes, then anything in the name
+  REQUIRE(registry.find("microkorg", true) == 2);
+  REQUIRE(registry.find("microkorg", false) == 3);
+  REQUIRE(registry.find("korg", false) == 3);
+  REQUIRE(registry.find("UM-ONE MIDI", true) == DEVICE_NOT_FOUND);
+  REQUIRE(registry.find("MIDI 1", false) == DEVICE_AMBIGUOUS);
+  REQUIRE(registry.find("nothing", false) == DEVICE_NOT_FOUND);
+
+  REQUIRE(registry.find_exact("UM-ONE MIDI 1", false) == 4);
+  REQUIRE(registry.find_exact("um-one midi 1", false) == DEVICE_NOT_FOUND);
+}
+
+TEST_CASE("aliases survive renumbering", CATCH_CATEGORY) {
+  FakeBackend midi;
+  midi.add("UM-ONE MIDI 1", false);
+  midi.add("microKORG XL MIDI 1", false);
+  DeviceRegistry registry(&midi);
+
+  registry.add_alias("synth", "microkorg");
+  REQUIRE(registry.find("synth", false) == 1);
+  REQUIRE(registry.aliases_for(1, false) == "synth");
+  REQUIRE(registry.aliases_for(0, false) == "");
+
+  // the interface is unplugged
+  midi.devices.erase(midi.devices.begin());
+  registry.refresh();
+  REQUIRE(registry.find("synth", false) == 0);
+  REQUIRE(registry.device(0)->name == "microKORG XL MIDI 1");
+  REQUIRE(registry.device(1) == nullptr);
+
+  REQUIRE(registry.remove_alias("synth"));
+  REQUIRE(!registry.remove_alias("synth"));
+  REQUIRE(registry.find("synth", false) == DEVICE_NOT_FOUND);
+}
@@ -0,0 +1,74 @@
+#include <catch2/catch_all.hpp>
+#include "../src/event_filter.h"
+
+#define CATCH_CATEGORY "[filter]"
+
+TEST_CASE("default filter drops active sensing", CATCH_CATEGORY) {
+  EventFilter f;
+
+  REQUIRE(f.pm_filter() == PM_FILT_ACTIVE);
+  REQUIRE(f.pm_channel_mask() == 0xffff);
+  REQUIRE_FALSE(f.keeps_everything());
+  REQUIRE_FALSE(f.keep(Pm_Message(0xfe, 0, 0)));
+  REQUIRE(f.keep(Pm_Message(0xf8, 0, 0)));
+  REQUIRE(f.keep(Pm_Message(0x90, 60, 100)));
+}
+
+TEST_CASE("filter types and channels", CATCH_CATEGORY) {
+  EventFilter f;
+  int32_t bits;
+  bool channels[16];
+
+  REQUIRE(parse_filter_types("clock,sysex", &bits));
+  REQUIRE(bits == (PM_FILT_CLOCK | PM_FILT_SYSEX));
+  REQUIRE(parse_filter_types("none", &bits));
+  REQUIRE(bits == 0);
+  REQUIRE_FALSE(parse_filter_types("clock,bogus", &bits));
+
+  REQUIRE(parse_number_list("1-2,10", 1, 16, channels));
+  REQUIRE(channels[0]);
+  REQUIRE(channels[1]);
+  REQUIRE_FALSE(channels[2]);
+  REQUIRE(channels[9]);
+  REQUIRE_FALSE(parse_number_list("0-3", 1, 16, channels));
+  REQUIRE_FALSE(parse_number_list("3,x", 1, 16, channels));
+
+  f.set_drop_types(PM_FILT_CLOCK | PM_FILT_SYSEX);
+  f.set_channels(Pm_Channel(0) | Pm_Channel(9));
+  f.compile();
+  REQUIRE_FALSE(f.keep(Pm_Message(0xf8, 0, 0)));
+  REQUIRE(f.keep(Pm_Message(0xfe, 0, 0)));
+  REQUIRE_FALSE(f.keep(0x304200f0));
+  REQUIRE_FALSE(f.keep(0x04030201)); // sysex continuation
+  REQUIRE(f.keep(Pm_Message(0x99, 36, 100)));
+  REQUIRE_FALSE(f.keep(Pm_Message(0x91, 36, 100)));
+}
+
+TEST_CASE("filter controllers and notes", CATCH_CATEGORY) {
+  EventFilter f;
+  bool controllers[128];
+  PmEvent events[4];
+  int port_ids[4] = {0, 1, 2, 3};
+
+  REQUIRE(parse_number_list("1,7,64", 0, 127, controllers));
+  f.set_drop_types(0);
+  f.set_controllers(controllers);
+  f.set_note_range(36, 60);
+  f.compile();
+
+  REQUIRE(f.keep(Pm_Message(0xb0, 7, 100)));
+  REQUIRE_FALSE(f.keep(Pm_Message(0xb0, 10, 100)));
+  REQUIRE(f.keep(Pm_Message(0x90, 36, 100)));
+  REQUIRE_FALSE(f.keep(Pm_Message(0x80, 61, 0)));
+  REQUIRE(f.keep(Pm_Message(0xe0, 0, 64)));
+
+  events[0].message = Pm_Message(0xb0, 10, 0);
+  events[1].message = Pm_Message(0x90, 40, 100);
+  events[2].message = Pm_Message(0x90, 20, 100);
+  events[3].message = Pm_Message(0xb0, 64, 127);
+  REQUIRE(f.apply(events, 4, port_ids) == 2);
+  REQUIRE(events[0].message == Pm_Message(0x90, 40, 100));
+  REQUIRE(port_ids[0] == 1);
+  REQUIRE(events[1].message == Pm_Message(0xb0, 64, 127));
+  REQUIRE(port_ids[1] == 3);
+}
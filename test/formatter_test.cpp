@@ -0,0 +1,64 @@
+#include <string>
+#include <stdio.h>
+#include <catch2/catch_all.hpp>
+#include "../src/formatter.h"
+
+#define CATCH_CATEGORY "[formatter]"
+
+using std::string;
+
+// Runs `fn` against a Formatter writing to a temp file, returns the text
+template <typename F>
+static string formatted(F fn) {
+  FILE *fp = tmpfile();
+  {
+    Formatter out(fp);
+    fn(out);
+  }
+  rewind(fp);
+  string text;
+  char buf[256];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    text.append(buf, n);
+  fclose(fp);
+  return text;
+}
+
+TEST_CASE("formatter messages", CATCH_CATEGORY) {
+  REQUIRE(formatted([](Formatter &out) { out.note("on", Pm_Message(0x90, 60, 127)); })
+          == "on\tch 1\tC4\t127\n");
+  // names with sharps and negative octaves used to be truncated
+  REQUIRE(formatted([](Formatter &out) { out.note("off", Pm_Message(0x8f, 1, 0)); })
+          == "off\tch 16\tC#-1\t0\n");
+  REQUIRE(formatted([](Formatter &out) { out.three_byte_chan("cntrl", Pm_Message(0xb2, 7, 100)); })
+          == "cntrl\tch 3\t7\t100\n");
+  REQUIRE(formatted([](Formatter &out) { out.two_byte("pchg", Pm_Message(0xc0, 42, 0)); })
+          == "pchg\tch 1\t42\n");
+  REQUIRE(formatted([](Formatter &out) { out.four_bytes(0xf7017e43); })
+          == "  43 7e 01 f7\n");
+}
+
+TEST_CASE("formatter hexdump", CATCH_CATEGORY) {
+  byte bytes[16] = {
+    0xf0, 0x42, 0x30, 0x41, 0x42, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x00
+  };
+
+  REQUIRE(formatted([&](Formatter &out) { out.hexdump_line(0x20, bytes, 16); })
+          == "00000020: f0 42 30 41 42 43 44 45   46 47 48 49 4a 4b 4c 00  .B0ABCDE  FGHIJKL.\n");
+  REQUIRE(formatted([&](Formatter &out) { out.hexdump_line(0, bytes, 3); })
+          == "00000000: f0 42 30  .B0\n");
+}
+
+TEST_CASE("formatter records", CATCH_CATEGORY) {
+  byte bytes[3] = {0x90, 60, 127};
+  PmEvent event;
+  event.timestamp = 0x01020304;
+  event.message = Pm_Message(0x90, 60, 127);
+
+  REQUIRE(formatted([&](Formatter &out) { out.json_event(10234, "on", bytes, 3); })
+          == "{\"time\":10234,\"type\":\"on\",\"bytes\":[144,60,127]}\n");
+  REQUIRE(formatted([&](Formatter &out) { out.binary_event(event); })
+          == string("\x04\x03\x02\x01\x90\x3c\x7f\x00", 8));
+}
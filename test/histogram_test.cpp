@@ -0,0 +1,44 @@
+#include <catch2/catch_all.hpp>
+#include "../src/histogram.h"
+
+#define CATCH_CATEGORY "[histogram]"
+
+TEST_CASE("histogram buckets", CATCH_CATEGORY) {
+  // exact below 64
+  REQUIRE(Histogram::bucket_index(0) == 0);
+  REQUIRE(Histogram::bucket_index(63) == 63);
+  REQUIRE(Histogram::bucket_high(63) == 63);
+
+  // then 32 buckets per power of two
+  REQUIRE(Histogram::bucket_index(64) == Histogram::bucket_index(65));
+  REQUIRE(Histogram::bucket_index(66) == Histogram::bucket_index(64) + 1);
+  REQUIRE(Histogram::bucket_high(Histogram::bucket_index(1000)) >= 1000);
+  REQUIRE(Histogram::bucket_high(Histogram::bucket_index(1000)) < 1032);
+  REQUIRE(Histogram::bucket_index(UINT64_MAX) == HISTOGRAM_BUCKETS - 1);
+}
+
+TEST_CASE("histogram percentiles", CATCH_CATEGORY) {
+  Histogram h;
+
+  REQUIRE(h.count() == 0);
+  REQUIRE(h.percentile(50) == 0);
+
+  for (int i = 1; i <= 100; ++i)
+    h.record(i);
+  REQUIRE(h.count() == 100);
+  REQUIRE(h.min() == 1);
+  REQUIRE(h.max() == 100);
+  REQUIRE(h.mean() == 50.5);
+  REQUIRE(h.percentile(50) == 50);
+  REQUIRE(h.percentile(90) >= 90);
+  REQUIRE(h.percentile(90) <= 91);
+  REQUIRE(h.percentile(100) == 100);
+
+  h.record(5000, 100);
+  REQUIRE(h.count() == 200);
+  REQUIRE(h.percentile(99) == 5000);
+
+  h.reset();
+  REQUIRE(h.count() == 0);
+  REQUIRE(h.max() == 0);
+}
@@ -0,0 +1,228 @@
+#include <catch2/catch_all.hpp>
+#include <chrono>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include "../src/input_reader.h"
+#include "../src/loopback_backend.h"
+#include "../src/server.h"
+#include "../src/sysex_assembler.h"
+#include "porttime.h"
+
+#define CATCH_CATEGORY "[loopback]"
+
+using std::vector;
+
+extern sig_atomic_t monitoring;
+
+static void sleep_ms(long millisecs) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(millisecs));
+}
+
+TEST_CASE("parse generator streams", CATCH_CATEGORY) {
+  GeneratorStream stream;
+
+  REQUIRE(parse_generator_stream("cc", &stream));
+  REQUIRE(stream.type == GENERATOR_CC);
+  REQUIRE(stream.rate == 1000);
+
+  REQUIRE(parse_generator_stream("clock:96", &stream));
+  REQUIRE(stream.type == GENERATOR_CLOCK);
+  REQUIRE(stream.rate == 96);
+
+  REQUIRE(parse_generator_stream("sysex:0:4m", &stream));
+  REQUIRE(stream.type == GENERATOR_SYSEX);
+  REQUIRE(stream.rate == 0);
+  REQUIRE(stream.size == 4 * 1024 * 1024);
+
+  REQUIRE(!parse_generator_stream("notes", &stream));
+  REQUIRE(!parse_generator_stream("cc:fast", &stream));
+  REQUIRE(!parse_generator_stream("clock:24:100", &stream));
+}
+
+TEST_CASE("loopback", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  PortMidiStream *input, *output;
+  PmEvent events[8];
+
+  REQUIRE(midi.open_input(&input, LOOPBACK_INPUT, 128) == pmNoError);
+  REQUIRE(midi.open_output(&output, LOOPBACK_OUTPUT, 128, 0) == pmNoError);
+  REQUIRE(midi.open_input(&input, LOOPBACK_OUTPUT, 128) == pmInvalidDeviceId);
+  REQUIRE(midi.device_info(LOOPBACK_INPUT)->opened);
+
+  byte sysex[] = {0xf0, 0x7d, 0x01, 0x02, 0x03, 0xf7};
+  midi.write_short(output, 0, Pm_Message(0x90, 60, 100));
+  midi.write_sysex(output, 0, sysex);
+  REQUIRE(midi.read(input, events, 8) == 3);
+  REQUIRE(events[0].message == Pm_Message(0x90, 60, 100));
+  REQUIRE(events[1].message == 0x02017df0);
+  REQUIRE(events[2].message == 0x0000f703);
+  REQUIRE(midi.read(input, events, 8) == 0);
+
+  // whole sysex messages are filtered, and active sensing by default
+  midi.set_filter(input, PM_FILT_SYSEX | PM_FILT_ACTIVE);
+  midi.write_sysex(output, 0, sysex);
+  midi.write_short(output, 0, Pm_Message(0xfe, 0, 0));
+  midi.write_short(output, 0, Pm_Message(0x91, 60, 100));
+  midi.set_channel_mask(input, Pm_Channel(0));
+  midi.write_short(output, 0, Pm_Message(0x90, 60, 100));
+  REQUIRE(midi.read(input, events, 8) == 1);
+  REQUIRE(events[0].message == Pm_Message(0x90, 60, 100));
+
+  REQUIRE(midi.close(input) == pmNoError);
+  REQUIRE(midi.close(input) == pmBadPtr);
+  REQUIRE(!midi.device_info(LOOPBACK_INPUT)->opened);
+}
+
+TEST_CASE("generator", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  PortMidiStream *input;
+  PmEvent events[256];
+
+  SECTION("flat out cc and sysex") {
+    midi.add_generator_stream({GENERATOR_CC, 0, 0});
+    midi.add_generator_stream({GENERATOR_SYSEX, 0, 1000});
+    REQUIRE(midi.open_input(&input, LOOPBACK_GENERATOR, 128) == pmNoError);
+
+    // sysex messages arrive whole, with no cc in the middle of them
+    int num_sysex = 0, num_cc = 0;
+    SysexAssembler assembler;
+    for (int i = 0; i < 20; ++i) {
+      int n = midi.read(input, events, 256);
+      REQUIRE(n == 256);
+      for (int j = 0; j < n; ++j) {
+        if ((Pm_MessageStatus(events[j].message) & 0xf0) == 0xb0) {
+          REQUIRE(assembler.partial() == nullptr);
+          ++num_cc;
+          continue;
+        }
+        assembler.add(&events[j], 1);
+        SysexMessage *message = assembler.next();
+        if (message != nullptr) {
+          REQUIRE(message->bytes.size() == 1000);
+          ++num_sysex;
+          assembler.release(message);
+        }
+      }
+    }
+    REQUIRE(num_sysex > 0);
+    REQUIRE(num_cc > 0);
+  }
+
+  SECTION("clock during sysex") {
+    midi.add_generator_stream({GENERATOR_CLOCK, 0, 0});
+    midi.add_generator_stream({GENERATOR_SYSEX, 0, 1000});
+    REQUIRE(midi.open_input(&input, LOOPBACK_GENERATOR, 128) == pmNoError);
+
+    // clocks arrive between a message's events and are left out of it
+    SysexAssembler assembler;
+    int num_sysex = 0;
+    for (int i = 0; i < 20; ++i) {
+      assembler.add(events, midi.read(input, events, 256));
+      SysexMessage *message;
+      while ((message = assembler.next()) != nullptr) {
+        REQUIRE(message->bytes.size() == 1000);
+        REQUIRE(message->bytes.back() == 0xf7);
+        ++num_sysex;
+        assembler.release(message);
+      }
+    }
+    REQUIRE(num_sysex > 1);
+    REQUIRE(assembler.cut_short() == 0);
+  }
+
+  SECTION("falling behind overflows") {
+    midi.add_generator_stream({GENERATOR_CLOCK, 1000, 0});
+    REQUIRE(midi.open_input(&input, LOOPBACK_GENERATOR, 16) == pmNoError);
+    Pt_Sleep(50);
+    REQUIRE(midi.read(input, events, 256) == pmBufferOverflow);
+
+    // then a full buffer, unless another millisecond overflowed it again
+    int n = pmBufferOverflow;
+    for (int i = 0; i < 3 && n == pmBufferOverflow; ++i)
+      n = midi.read(input, events, 256);
+    REQUIRE(n >= 16);
+    REQUIRE(events[0].message == Pm_Message(0xf8, 0, 0));
+  }
+}
+
+TEST_CASE("failed reads are counted", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  InputReader reader(&midi, 64);
+  PortMidiStream *output;
+
+  // Reading from an output fails with pmBadPtr every time
+  REQUIRE(midi.open_output(&output, LOOPBACK_OUTPUT, 128, 0) == pmNoError);
+  reader.add(output, 0);
+  for (int i = 0; i < 1000 && reader.read_errors() == 0; ++i)
+    sleep_ms(1);
+  reader.stop();
+  midi.close(output);
+
+  REQUIRE(reader.read_errors() > 0);
+  REQUIRE(reader.overflows() == 0);
+}
+
+TEST_CASE("rescan keeps unread input", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  PmEvent events[8];
+  int port_ids[8];
+  char status[] = "90", key[] = "3c", velocity[] = "7f";
+  char *words[] = {status, key, velocity, nullptr};
+
+  REQUIRE(server.open_input("loopback", nullptr) == pmNoError);
+  REQUIRE(server.open_output("loopback", nullptr) == pmNoError);
+  server.send_file_or_bytes(words);
+  for (int i = 0; i < 1000 && !server.has_input(); ++i)
+    sleep_ms(1);
+  REQUIRE(server.has_input());
+
+  server.rescan_devices();
+  REQUIRE(server.read_input(events, port_ids, 8) == 1);
+  REQUIRE(events[0].message == Pm_Message(0x90, 0x3c, 0x7f));
+  REQUIRE(port_ids[0] == server.input_port_id("in"));
+}
+
+// Hotplug is only watched for on Linux
+#if defined(__linux__)
+TEST_CASE("route with its only input unplugged", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  char dir[] = "/tmp/pmserver_hotplug_XXXXXX";
+
+  REQUIRE(mkdtemp(dir) != nullptr);
+  REQUIRE(server.watch_hotplug(dir));
+  REQUIRE(server.open_input("loopback", nullptr) == pmNoError);
+  std::thread routing([&server]{ server.route_midi(); });
+
+  // Unplug it, and have a device node go away as it would
+  midi.set_plugged_in(LOOPBACK_INPUT, false);
+  std::string node = std::string(dir) + "/midiC1D0";
+  fclose(fopen(node.c_str(), "w"));
+  unlink(node.c_str());
+  for (int i = 0; i < 5000 && midi.device_info(LOOPBACK_INPUT) != nullptr; ++i)
+    sleep_ms(1);
+  REQUIRE(midi.device_info(LOOPBACK_INPUT) == nullptr);
+  sleep_ms(50);
+
+  // With no input to read, routing should sleep, not spin
+  clockid_t clock;
+  struct timespec start, end;
+  REQUIRE(pthread_getcpuclockid(routing.native_handle(), &clock) == 0);
+  clock_gettime(clock, &start);
+  sleep_ms(500);
+  clock_gettime(clock, &end);
+  long cpu_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+  monitoring = 0;
+  routing.join();
+  rmdir(dir);
+  REQUIRE(cpu_ms < 100);
+}
+#endif
@@ -0,0 +1,26 @@
+#include <catch2/catch_all.hpp>
+#include "../src/midi_message.h"
+
+#define CATCH_CATEGORY "[midi_message]"
+
+TEST_CASE("next message", CATCH_CATEGORY) {
+  size_t len;
+
+  byte note[] = {0x90, 0x40, 0x7f, 0x80};
+  REQUIRE(next_message(note, sizeof(note), &len) == MESSAGE_SHORT);
+  REQUIRE(len == 3);
+  REQUIRE(next_message(note + 3, 1, &len) == MESSAGE_INCOMPLETE);
+
+  byte program[] = {0xc0, 0x05};
+  REQUIRE(next_message(program, sizeof(program), &len) == MESSAGE_SHORT);
+  REQUIRE(len == 2);
+
+  byte sysex[] = {0xf0, 0x42, 0x30, 0xf7, 0xf8};
+  REQUIRE(next_message(sysex, sizeof(sysex), &len) == MESSAGE_SYSEX);
+  REQUIRE(len == 4);
+  REQUIRE(next_message(sysex, 3, &len) == MESSAGE_NO_EOX);
+
+  byte data[] = {0x40};
+  REQUIRE(next_message(data, 1, &len) == MESSAGE_BAD_STATUS);
+  REQUIRE(len == 1);
+}
@@ -0,0 +1,457 @@
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <catch2/catch_all.hpp>
+#include "../src/capture_store.h"
+#include "../src/formatter.h"
+#include "../src/hex.h"
+#include "../src/input_reader.h"
+#include "../src/loopback_backend.h"
+#include "../src/midi_message.h"
+#include "../src/server.h"
+#include "../src/seven_bit.h"
+#include "../src/sysex_assembler.h"
+
+// Benchmarks are hidden so that they only run when asked for, for example
+// with `./pmserver_test "[benchmark]"`.
+#define CATCH_CATEGORY "[.benchmark]"
+
+using std::string;
+using std::vector;
+
+// ================ helpers ================
+
+// Synthetic hex file text: `num_bytes` bytes, 16 per line
+static string hex_text(size_t num_bytes, bool run_together) {
+  static const char digits[] = "0123456789abcdef";
+  string text;
+  text.reserve(num_bytes * 3);
+  for (size_t i = 0; i < num_bytes; ++i) {
+    byte b = (byte)(i * 7);
+    text += digits[b >> 4];
+    text += digits[b & 0x0f];
+    if ((i & 15) == 15)
+      text += '\n';
+    else if (!run_together)
+      text += ' ';
+  }
+  return text;
+}
+
+// The switch-based decoder hex_decode_word replaced, for comparison
+static byte switch_char_to_nibble(const char ch) {
+  switch (ch) {
+  case '0': case '1': case '2': case '3': case '4':
+  case '5': case '6': case '7': case '8': case '9':
+    return (byte)(ch - '0');
+  case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
+    return (byte)(ch - 'a' + 10);
+  case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
+    return (byte)(ch - 'A' + 10);
+  default:
+    throw "error";
+  }
+}
+
+static void switch_decode(const string &text, vector<byte> &bytes) {
+  const char *p = text.c_str();
+  while (*p) {
+    if (*p == ' ' || *p == '\n') {
+      ++p;
+      continue;
+    }
+    while (*p && *p != ' ' && *p != '\n') {
+      bytes.push_back((switch_char_to_nibble(p[0]) << 4) + switch_char_to_nibble(p[1]));
+      p += 2;
+    }
+  }
+}
+
+// Synthetic monitor input: mostly notes, some controllers and clocks
+static vector<PmMessage> monitor_messages(size_t num_messages) {
+  vector<PmMessage> messages;
+  messages.reserve(num_messages);
+  for (size_t i = 0; i < num_messages; ++i) {
+    switch (i % 4) {
+    case 0: case 1:
+      messages.push_back(Pm_Message(0x90 + (i & 0x0f), (i * 5) & 0x7f, i & 0x7f));
+      break;
+    case 2:
+      messages.push_back(Pm_Message(0xb0 + (i & 0x0f), 7, i & 0x7f));
+      break;
+    default:
+      messages.push_back(Pm_Message(0xf8, 0, 0));
+      break;
+    }
+  }
+  return messages;
+}
+
+// A send's worth of bytes: notes, controllers and pitch bend, with a 256
+// byte sysex message every 1000 short messages
+static vector<byte> message_bytes(size_t num_short_messages) {
+  vector<byte> bytes;
+  bytes.reserve(num_short_messages * 3 + num_short_messages / 4);
+  for (size_t i = 0; i < num_short_messages; ++i) {
+    static const byte statuses[] = {0x90, 0x80, 0xb0, 0xe0, 0xc0};
+    byte status = statuses[i % 5] | (i & 0x0f);
+    bytes.push_back(status);
+    bytes.push_back((byte)(i & 0x7f));
+    if ((status & 0xf0) != 0xc0)
+      bytes.push_back((byte)((i >> 7) & 0x7f));
+    if (i % 1000 == 999) {
+      bytes.push_back(0xf0);
+      for (int j = 0; j < 254; ++j)
+        bytes.push_back((byte)(j & 0x7f));
+      bytes.push_back(0xf7);
+    }
+  }
+  return bytes;
+}
+
+// A sysex dump of `num_bytes` bytes as PortMidi delivers it, four bytes
+// per event, with a clock byte in every 64th event
+static vector<PmEvent> sysex_events(size_t num_bytes) {
+  vector<PmEvent> events;
+  vector<byte> bytes;
+
+  bytes.push_back(0xf0);
+  for (size_t i = 2; i < num_bytes; ++i) {
+    bytes.push_back((byte)(i & 0x7f));
+    if ((i & 255) == 0)
+      bytes.push_back(0xf8);
+  }
+  bytes.push_back(0xf7);
+  while (bytes.size() % 4 != 0)
+    bytes.push_back(0);
+
+  for (size_t i = 0; i < bytes.size(); i += 4) {
+    PmEvent event;
+    event.timestamp = (PmTimestamp)(i / 32);
+    event.message = bytes[i] | (bytes[i+1] << 8) | (bytes[i+2] << 16) | (bytes[i+3] << 24);
+    events.push_back(event);
+  }
+  return events;
+}
+
+// ================ benchmarks ================
+
+TEST_CASE("hex decoding", CATCH_CATEGORY) {
+  string spaced = hex_text(1024 * 1024, false);
+  string packed = hex_text(1024 * 1024, true);
+
+  BENCHMARK("switch decoder, 1 MB spaced") {
+    vector<byte> bytes;
+    switch_decode(spaced, bytes);
+    return bytes.size();
+  };
+  BENCHMARK("hex_decode_buffer, 1 MB spaced") {
+    vector<byte> bytes;
+    hex_decode_buffer(spaced.data(), spaced.size(), bytes);
+    return bytes.size();
+  };
+  BENCHMARK("switch decoder, 1 MB run together") {
+    vector<byte> bytes;
+    switch_decode(packed, bytes);
+    return bytes.size();
+  };
+  BENCHMARK("hex_decode_buffer, 1 MB run together") {
+    vector<byte> bytes;
+    hex_decode_buffer(packed.data(), packed.size(), bytes);
+    return bytes.size();
+  };
+}
+
+// A file with a delay after every message. Each delay stops
+// hex_decode_buffer, which is then called again with the rest of the
+// buffer, as the hex file reader does.
+TEST_CASE("hex file with delays", CATCH_CATEGORY) {
+  string text;
+  for (int i = 0; i < 100000; ++i)
+    text += "90 3c 7f +1\n";
+
+  BENCHMARK("hex_decode_buffer, 100k delays in 1.2 MB") {
+    vector<byte> bytes;
+    const char *p = text.data();
+    size_t len = text.size();
+    long num_stops = 0;
+    while (len > 0) {
+      HexResult result = hex_decode_buffer(p, len, bytes);
+      if (result.status == HEX_OK)
+        break;
+      p += result.word_end;
+      len -= result.word_end;
+      ++num_stops;
+    }
+    return num_stops;
+  };
+}
+
+TEST_CASE("monitor output", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  vector<PmMessage> messages = monitor_messages(100000);
+  vector<PmEvent> events(messages.size());
+  FILE *null_file = fopen("/dev/null", "w");
+
+  for (size_t i = 0; i < messages.size(); ++i)
+    events[i] = {messages[i], (PmTimestamp)i};
+
+  // A reader's batch at a time, as the monitor formats them
+  BENCHMARK("format_events text, 100k messages") {
+    Formatter out(null_file);
+    for (size_t i = 0; i < events.size(); i += INPUT_READ_BUFSIZ) {
+      int n = (int)std::min((size_t)INPUT_READ_BUFSIZ, events.size() - i);
+      server.format_events(out, &events[i], n, MONITOR_TEXT);
+      out.flush_if_due(false);
+    }
+    out.flush();
+    return events.size();
+  };
+  BENCHMARK("format_events json, 100k messages") {
+    Formatter out(null_file);
+    for (size_t i = 0; i < events.size(); i += INPUT_READ_BUFSIZ) {
+      int n = (int)std::min((size_t)INPUT_READ_BUFSIZ, events.size() - i);
+      server.format_events(out, &events[i], n, MONITOR_JSON);
+      out.flush_if_due(false);
+    }
+    out.flush();
+    return events.size();
+  };
+
+  fclose(null_file);
+}
+
+TEST_CASE("message splitting", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  vector<byte> bytes = message_bytes(300000);
+  vector<SendDelay> no_delays;
+
+  // Nothing reads the loopback input, so the writes are dropped
+  REQUIRE(server.open_output("loopback", nullptr) == pmNoError);
+  BENCHMARK("Server::send, 300k messages") {
+    server.send(bytes, no_delays);
+    return bytes.size();
+  };
+}
+
+// A 100k controller sweep sent from a file, one Pm_WriteShort per
+// message against one Pm_Write per batch
+TEST_CASE("batched sends", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  char path[] = "/tmp/pmserver_cc_XXXXXX";
+  int fd = mkstemp(path);
+  REQUIRE(fd >= 0);
+  FILE *fp = fdopen(fd, "w");
+  for (int i = 0; i < 100000; ++i)
+    fprintf(fp, "b%x 07 %02x\n", i & 0x0f, i & 0x7f);
+  fclose(fp);
+  string word = string("@") + path;
+  char *words[] = {&word[0], nullptr};
+  vector<byte> bytes;
+  vector<SendDelay> delays;
+  REQUIRE(server.load_file_or_bytes(words, bytes, delays));
+  unlink(path);
+  REQUIRE(server.open_output("loopback", nullptr) == pmNoError);
+
+  BENCHMARK("send_bytes, 100k CC, batch size 1") {
+    server.set_batch_size(1);
+    server.send(bytes, delays);
+    return bytes.size();
+  };
+  BENCHMARK("send_bytes, 100k CC, batch size 256") {
+    server.set_batch_size(256);
+    server.send(bytes, delays);
+    return bytes.size();
+  };
+}
+
+TEST_CASE("sysex reassembly", CATCH_CATEGORY) {
+  vector<PmEvent> events = sysex_events(1024 * 1024);
+  vector<PmEvent> small = sysex_events(256);
+  vector<PmEvent> dump;
+  SysexAssembler assembler;
+
+  for (int i = 0; i < 4096; ++i)
+    dump.insert(dump.end(), small.begin(), small.end());
+
+  // What the receive commands do, a batch of 256 events at a time
+  BENCHMARK("SysexAssembler, one 1 MB message") {
+    size_t total = 0;
+    for (size_t i = 0; i < events.size(); i += 256) {
+      int n = events.size() - i < 256 ? (int)(events.size() - i) : 256;
+      assembler.add(&events[i], n);
+    }
+    SysexMessage *message = assembler.next();
+    total = message->bytes.size();
+    assembler.release(message);
+    return total;
+  };
+
+  // A librarian dump: after the first run the pool has warmed up and
+  // nothing is allocated
+  BENCHMARK("SysexAssembler, 4096 256-byte messages") {
+    size_t total = 0;
+    for (size_t i = 0; i < dump.size(); i += 256) {
+      int n = dump.size() - i < 256 ? (int)(dump.size() - i) : 256;
+      assembler.add(&dump[i], n);
+      SysexMessage *message;
+      while ((message = assembler.next()) != nullptr) {
+        total += message->bytes.size();
+        assembler.release(message);
+      }
+    }
+    return total;
+  };
+}
+
+TEST_CASE("capture store", CATCH_CATEGORY) {
+  char dir[] = "/tmp/pmserver_bench_XXXXXX";
+  REQUIRE(mkdtemp(dir) != nullptr);
+  string store_dir = dir;
+  string out_path = store_dir + "/out.syx";
+  CaptureStore store;
+  Capture capture;
+  vector<vector<byte>> messages(4096, vector<byte>(1024));
+
+  for (size_t i = 0; i < messages.size(); ++i) {
+    vector<byte> &message = messages[i];
+    for (size_t j = 0; j < message.size(); ++j)
+      message[j] = (byte)((i * 31 + j * 7) & 0x7f);
+    message.front() = 0xf0;
+    message.back() = 0xf7;
+  }
+  REQUIRE(store.open(store_dir.c_str()));
+  store.begin(capture);
+  for (vector<byte> &message : messages)
+    store.add(capture, message.data(), message.size());
+  REQUIRE(store.finish(capture, "first"));
+
+  // The nightly case: every message is already stored
+  BENCHMARK("CaptureStore, 4 MB dump, all seen before") {
+    store.begin(capture);
+    for (vector<byte> &message : messages)
+      store.add(capture, message.data(), message.size());
+    return store.finish(capture, "again");
+  };
+
+  BENCHMARK("CaptureStore, extract 4 MB capture") {
+    return store.extract("again", out_path.c_str());
+  };
+
+  store.close();
+  REQUIRE(system(("rm -rf " + store_dir).c_str()) == 0);
+}
+
+// The byte-at-a-time decoder SevenBitDecoder replaced, for comparison
+static void scalar_unpack(const vector<byte> &packed, vector<byte> &out) {
+  out.clear();
+  for (size_t i = 0; i < packed.size(); i += 8) {
+    byte tops = packed[i];
+    for (size_t j = 1; j < 8 && i + j < packed.size(); ++j)
+      out.push_back(packed[i + j] | (((tops >> (j - 1)) & 1) << 7));
+  }
+}
+
+TEST_CASE("7-bit unpacking", CATCH_CATEGORY) {
+  vector<byte> data(4 * 1024 * 1024);
+  for (size_t i = 0; i < data.size(); ++i)
+    data[i] = (byte)(i * 37);
+  vector<byte> packed(seven_bit_packed_size(data.size()));
+  seven_bit_pack(data.data(), data.size(), packed.data());
+  vector<byte> out;
+  out.reserve(data.size());
+  SevenBitDecoder decoder;
+
+  BENCHMARK("scalar, 4 MB") {
+    scalar_unpack(packed, out);
+    return out.size();
+  };
+
+  // As a dump arrives: 1 KB at a time
+  BENCHMARK("SevenBitDecoder, 4 MB in 1 KB pieces") {
+    out.clear();
+    decoder.reset();
+    for (size_t i = 0; i < packed.size(); i += 1024)
+      decoder.add(&packed[i], std::min((size_t)1024, packed.size() - i), out);
+    decoder.finish(out);
+    return out.size();
+  };
+
+  BENCHMARK("seven_bit_pack, 4 MB") {
+    seven_bit_pack(data.data(), data.size(), packed.data());
+    return packed[0];
+  };
+}
+
+TEST_CASE("hexdump output", CATCH_CATEGORY) {
+  vector<byte> bytes(256 * 1024);
+  FILE *null_file = fopen("/dev/null", "w");
+
+  for (size_t i = 0; i < bytes.size(); ++i)
+    bytes[i] = (byte)(i * 7);
+
+  // The way the sysex dump used to print
+  BENCHMARK("printf, 256 KB") {
+    for (size_t line = 0; line < bytes.size(); line += 16) {
+      fprintf(null_file, "%08lx:", (unsigned long)line);
+      for (int i = 0; i < 16; ++i)
+        fprintf(null_file, "%s %02x", i == 8 ? "  " : "", bytes[line + i]);
+      fprintf(null_file, "  ");
+      for (int i = 0; i < 16; ++i) {
+        byte b = bytes[line + i];
+        fprintf(null_file, "%s%c", i == 8 ? "  " : "", (b >= 32 && b <= 127) ? b : '.');
+      }
+      fprintf(null_file, "\n");
+    }
+    return bytes.size();
+  };
+  BENCHMARK("Formatter, 256 KB") {
+    Formatter out(null_file);
+    for (size_t line = 0; line < bytes.size(); line += 16)
+      out.hexdump_line(line, &bytes[line], 16);
+    out.flush();
+    return bytes.size();
+  };
+
+  fclose(null_file);
+}
+
+TEST_CASE("loopback monitor", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  PmEvent events[INPUT_READ_BUFSIZ];
+  int port_ids[INPUT_READ_BUFSIZ];
+  FILE *null_file = fopen("/dev/null", "w");
+
+  // The monitor's read and print path, with input arriving as fast as it
+  // can be taken
+  midi.add_generator_stream({GENERATOR_CC, 0, 0});
+  midi.add_generator_stream({GENERATOR_CLOCK, 0, 0});
+  REQUIRE(server.open_input("generator", nullptr) == pmNoError);
+
+  BENCHMARK("generator to format_events, 100k events") {
+    Formatter out(null_file);
+    long num_events = 0;
+    while (num_events < 100000) {
+      if (!server.has_input()) {
+        std::this_thread::yield();
+        continue;
+      }
+      int n = server.read_input(events, port_ids, INPUT_READ_BUFSIZ);
+      server.format_events(out, events, n, MONITOR_TEXT);
+      out.flush_if_due(!server.has_input());
+      num_events += n;
+    }
+    out.flush();
+    return num_events;
+  };
+
+  fclose(null_file);
+}
@@ -1,9 +1,11 @@
 #include <iostream>
+#include <string>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
 #include <catch2/catch_all.hpp>
+#include "../src/hex.h"
 #include "../src/server.h"
 
 #define CATCH_CATEGORY "[hex]"
@@ -57,4 +59,74 @@ TEST_CASE("hex word to bytes", CATCH_CATEGORY) {
 
   cerr << "expect to see an error message here about odd # digits" << endl;
   hex_word_test("1234a", bytes, 2);
+
+  cerr << "expect to see error messages here about bad hex digits" << endl;
+  hex_word_test("g", bytes, 0);
+  hex_word_test("12x4", bytes, 1);
+  hex_word_test("+10", bytes, 0);
+
+  // long enough to be decoded 32 digits at a time
+  const char *long_word = "000102030405060708090a0b0c0d0e0f"
+    "101112131415161718191A1B1C1D1E1F" "f7";
+  for (int i = 0; i < 32; ++i)
+    bytes[i] = i;
+  bytes[32] = 0xf7;
+  hex_word_test(long_word, bytes, 33);
+}
+
+TEST_CASE("hex decode buffer", CATCH_CATEGORY) {
+  const char *text = "f0 42\t30 # a comment 99\n68 37 0d 0 f7\n+10 90 3c";
+  vector<byte> bytes;
+
+  HexResult result = hex_decode_buffer(text, strlen(text), bytes);
+  REQUIRE(result.status == HEX_NOT_HEX);
+  REQUIRE(strncmp(text + result.word_start, "+10", result.word_end - result.word_start) == 0);
+  REQUIRE(bytes.size() == 8);
+  REQUIRE(bytes[2] == 0x30);
+  REQUIRE(bytes[3] == 0x68);
+  REQUIRE(bytes[6] == 0x00);
+  REQUIRE(bytes[7] == 0xf7);
+
+  size_t rest = result.word_end;
+  result = hex_decode_buffer(text + rest, strlen(text) - rest, bytes);
+  REQUIRE(result.status == HEX_OK);
+  REQUIRE(bytes.size() == 10);
+  REQUIRE(bytes[9] == 0x3c);
+
+  // long enough to be decoded sixteen words at a time, with one word that
+  // isn't two digits long in the middle
+  std::string lines;
+  char word[8];
+  for (int i = 0; i < 100; ++i) {
+    snprintf(word, 8, i == 70 ? "%x" : "%02x", i);
+    lines += word;
+    lines += (i & 15) == 15 ? '\n' : ' ';
+  }
+  bytes.clear();
+  result = hex_decode_buffer(lines.data(), lines.size(), bytes);
+  REQUIRE(result.status == HEX_OK);
+  REQUIRE(bytes.size() == 100);
+  for (int i = 0; i < 100; ++i)
+    REQUIRE(bytes[i] == i);
+
+  bytes.clear();
+  result = hex_decode_buffer("12 3z 45", 8, bytes);
+  REQUIRE(result.status == HEX_BAD_DIGIT);
+  REQUIRE(result.word_start == 3);
+  REQUIRE(bytes.size() == 1);
+}
+
+TEST_CASE("packed bytes in braces", CATCH_CATEGORY) {
+  MockServer server;
+  vector<byte> bytes;
+  vector<SendDelay> delays;
+  char words_text[] = "f0 42 30 68 { 80 01 ff } f7";
+  char *words[16];
+  int n = 0;
+
+  for (char *word = strtok(words_text, " "); word != nullptr; word = strtok(nullptr, " "))
+    words[n++] = word;
+  words[n] = nullptr;
+  REQUIRE(server.load_file_or_bytes(words, bytes, delays));
+  REQUIRE(bytes == vector<byte>({0xf0, 0x42, 0x30, 0x68, 0x05, 0x00, 0x01, 0x7f, 0xf7}));
 }
@@ -0,0 +1,38 @@
+#include <catch2/catch_all.hpp>
+#include "../src/ring_buffer.h"
+
+#define CATCH_CATEGORY "[ring]"
+
+TEST_CASE("ring buffer push and pop", CATCH_CATEGORY) {
+  RingBuffer<int> ring(5);      // rounded up to 8
+  int in[10] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+  int out[10];
+
+  REQUIRE(ring.empty());
+  REQUIRE(ring.push(in, 10) == 8);
+  REQUIRE(ring.size() == 8);
+  REQUIRE(ring.push(in, 1) == 0);
+
+  REQUIRE(ring.pop(out, 3) == 3);
+  REQUIRE(out[0] == 0);
+  REQUIRE(out[2] == 2);
+
+  // wraps around the end
+  REQUIRE(ring.push(&in[8], 2) == 2);
+  REQUIRE(ring.pop(out, 10) == 7);
+  REQUIRE(out[0] == 3);
+  REQUIRE(out[4] == 7);
+  REQUIRE(out[5] == 8);
+  REQUIRE(out[6] == 9);
+  REQUIRE(ring.empty());
+}
+
+TEST_CASE("ring buffer clear", CATCH_CATEGORY) {
+  RingBuffer<int> ring(4);
+  int in[3] = {1, 2, 3};
+
+  ring.push(in, 3);
+  ring.clear();
+  REQUIRE(ring.empty());
+  REQUIRE(ring.push(in, 3) == 3);
+}
@@ -0,0 +1,82 @@
+#include <catch2/catch_all.hpp>
+#include "../src/router.h"
+
+#define CATCH_CATEGORY "[route]"
+
+static Route make_route(int channel, int transpose, unsigned int drop_types) {
+  Route route;
+  route.input_id = 0;
+  route.output_id = 0;
+  route.output = nullptr;
+  route.channel = channel;
+  route.transpose = transpose;
+  route.drop_types = drop_types;
+  route.in_sysex = false;
+  route.batch = 0;
+  return route;
+}
+
+TEST_CASE("route channel and transpose", CATCH_CATEGORY) {
+  Route route = make_route(9, 12, 0);
+  PmMessage msg;
+
+  msg = Pm_Message(0x90, 60, 100);
+  REQUIRE(route_message(route, msg));
+  REQUIRE(msg == Pm_Message(0x99, 72, 100));
+
+  // controllers aren't transposed
+  msg = Pm_Message(0xb3, 7, 127);
+  REQUIRE(route_message(route, msg));
+  REQUIRE(msg == Pm_Message(0xb9, 7, 127));
+
+  // transposed out of range
+  msg = Pm_Message(0x80, 120, 0);
+  REQUIRE_FALSE(route_message(route, msg));
+
+  msg = Pm_Message(0xf8, 0, 0);
+  REQUIRE(route_message(route, msg));
+  REQUIRE(msg == Pm_Message(0xf8, 0, 0));
+}
+
+TEST_CASE("route type filter", CATCH_CATEGORY) {
+  unsigned int drop;
+  REQUIRE(parse_route_types("cntrl,realtime,sysex", &drop));
+  REQUIRE(drop == (ROUTE_CONTROLLER | ROUTE_REALTIME | ROUTE_SYSEX));
+  REQUIRE_FALSE(parse_route_types("note,bogus", &drop));
+
+  Route route = make_route(ROUTE_KEEP_CHANNEL, 0, ROUTE_CONTROLLER | ROUTE_REALTIME | ROUTE_SYSEX);
+  PmMessage msg;
+
+  msg = Pm_Message(0x90, 60, 100);
+  REQUIRE(route_message(route, msg));
+  msg = Pm_Message(0xb0, 1, 2);
+  REQUIRE_FALSE(route_message(route, msg));
+  msg = Pm_Message(0xfe, 0, 0);
+  REQUIRE_FALSE(route_message(route, msg));
+
+  // sysex continuation events follow their start
+  msg = 0x304200f0;
+  REQUIRE_FALSE(route_message(route, msg));
+  REQUIRE(route.in_sysex);
+  msg = 0x00f70201;
+  REQUIRE_FALSE(route_message(route, msg));
+  REQUIRE_FALSE(route.in_sysex);
+}
+
+TEST_CASE("route sysex", CATCH_CATEGORY) {
+  Route route = make_route(ROUTE_KEEP_CHANNEL, 0, 0);
+  PmMessage msg;
+
+  // a stray continuation event without a start isn't forwarded
+  msg = 0x04030201;
+  REQUIRE_FALSE(route_message(route, msg));
+
+  msg = 0x304200f0;
+  REQUIRE(route_message(route, msg));
+  msg = 0x04030201;
+  REQUIRE(route_message(route, msg));
+  REQUIRE(msg == 0x04030201);
+  msg = 0x0000f705;
+  REQUIRE(route_message(route, msg));
+  REQUIRE_FALSE(route.in_sysex);
+}
@@ -0,0 +1,131 @@
+#include <catch2/catch_all.hpp>
+#include <chrono>
+#include "../src/loopback_backend.h"
+#include "../src/script.h"
+
+#define CATCH_CATEGORY "[script]"
+
+using namespace std::chrono;
+
+static int commands_run;
+
+static bool count_command(Server &, char **words) {
+  ++commands_run;
+  return words[0][0] != 'q';
+}
+
+static bool compile(Script &script, Server &server, const char *text) {
+  FILE *in = fmemopen((void *)text, strlen(text), "r");
+  bool ok = script.compile(in, server);
+  fclose(in);
+  return ok;
+}
+
+TEST_CASE("compile script", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  Script script;
+
+  REQUIRE(compile(script, server,
+                  "# set up\n"
+                  "o i loopback :keys\n"
+                  "o o loopback\n"
+                  "repeat 3\n"
+                  "  s :out 90 40 7f +10 80 40 00\n"
+                  "  wait 20\n"
+                  "end\n"
+                  "m :keys\n"));
+
+  const std::vector<ScriptStep> &steps = script.all_steps();
+  REQUIRE(steps.size() == 7);
+  REQUIRE(steps[0].type == STEP_OPEN);
+  REQUIRE(steps[0].input);
+  REQUIRE(steps[0].device == LOOPBACK_INPUT);
+  REQUIRE(steps[0].handles[0] == "keys");
+  REQUIRE(steps[1].type == STEP_OPEN);
+  REQUIRE(steps[1].device == LOOPBACK_OUTPUT);
+  REQUIRE(steps[1].handles[0] == DEFAULT_OUTPUT_HANDLE);
+
+  REQUIRE(steps[2].type == STEP_REPEAT);
+  REQUIRE(steps[2].count == 3);
+  REQUIRE(steps[2].jump == 5);
+  REQUIRE(steps[3].type == STEP_SEND);
+  REQUIRE(steps[3].handles == std::vector<std::string>({"out"}));
+  REQUIRE(steps[3].bytes == std::vector<byte>({0x90, 0x40, 0x7f, 0x80, 0x40, 0x00}));
+  REQUIRE(steps[3].delays.size() == 1);
+  REQUIRE(steps[3].delays[0].offset == 3);
+  REQUIRE(steps[3].delays[0].millisecs == 10);
+  REQUIRE(steps[4].type == STEP_WAIT);
+  REQUIRE(steps[4].count == 20);
+  REQUIRE(steps[5].type == STEP_END);
+  REQUIRE(steps[5].jump == 2);
+
+  REQUIRE(steps[6].type == STEP_COMMAND);
+  REQUIRE(std::string(steps[6].words[0]) == "m");
+  REQUIRE(std::string(steps[6].words[1]) == ":keys");
+  REQUIRE(steps[6].words[2] == nullptr);
+}
+
+TEST_CASE("compile errors", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  Script script;
+
+  REQUIRE(!compile(script, server, "repeat 2\np hello\n"));
+  REQUIRE(!compile(script, server, "p hello\nend\n"));
+  REQUIRE(!compile(script, server, "repeat many\nend\n"));
+  REQUIRE(!compile(script, server, "wait\n"));
+  REQUIRE(!compile(script, server, "o o nothing\n"));
+  REQUIRE(!compile(script, server, "o o loopback\ns :synth 90 40 7f\n"));
+  REQUIRE(!compile(script, server, "o o loopback :synth\nc :synth\ns :synth 90 40 7f\n"));
+  REQUIRE(!compile(script, server, "s @/no/such/file\n"));
+
+  // Aliases defined in the script are used to find devices
+  REQUIRE(compile(script, server, "d alias synth loopback\no o synth :synth\ns :synth 90 40 7f\n"));
+  REQUIRE(script.all_steps()[1].device == LOOPBACK_OUTPUT);
+}
+
+TEST_CASE("run script", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  Script script;
+
+  commands_run = 0;
+  REQUIRE(compile(script, server,
+                  "repeat 2\n"
+                  "  p outer\n"
+                  "  repeat 3\n"
+                  "    p inner\n"
+                  "  end\n"
+                  "  repeat 0\n"
+                  "    p never\n"
+                  "  end\n"
+                  "end\n"));
+  REQUIRE(script.run(server, count_command));
+  REQUIRE(commands_run == 8);
+
+  commands_run = 0;
+  REQUIRE(compile(script, server, "p one\nq\np two\n"));
+  REQUIRE(!script.run(server, count_command));
+  REQUIRE(commands_run == 2);
+}
+
+TEST_CASE("waits keep to time", CATCH_CATEGORY) {
+  LoopbackBackend midi;
+  Server server(&midi);
+  Script script;
+
+  REQUIRE(compile(script, server,
+                  "o o loopback\n"
+                  "repeat 10\n"
+                  "  s 90 40 7f 80 40 00\n"
+                  "  wait 5\n"
+                  "end\n"));
+  steady_clock::time_point start = steady_clock::now();
+  REQUIRE(script.run(server, count_command));
+  long elapsed_ms = duration_cast<milliseconds>(steady_clock::now() - start).count();
+
+  REQUIRE(script.timing().waits == 10);
+  REQUIRE(elapsed_ms >= 50);
+  REQUIRE(elapsed_ms < 100);
+}
@@ -0,0 +1,75 @@
+#include <catch2/catch_all.hpp>
+#include <vector>
+#include "../src/seven_bit.h"
+
+#define CATCH_CATEGORY "[seven_bit]"
+
+using std::vector;
+
+// A byte at a time, straight from the description of the format
+static vector<byte> reference_pack(const vector<byte> &data) {
+  vector<byte> packed;
+  for (size_t i = 0; i < data.size(); i += 7) {
+    size_t top_index = packed.size();
+    packed.push_back(0);
+    for (size_t j = 0; j < 7 && i + j < data.size(); ++j) {
+      packed[top_index] |= (data[i + j] >> 7) << j;
+      packed.push_back(data[i + j] & 0x7f);
+    }
+  }
+  return packed;
+}
+
+static vector<byte> test_data(size_t n) {
+  vector<byte> data(n);
+  for (size_t i = 0; i < n; ++i)
+    data[i] = (byte)(i * 37 + (i >> 3));
+  return data;
+}
+
+TEST_CASE("pack and unpack", CATCH_CATEGORY) {
+  byte data[] = {0x80, 0x01, 0xff, 0x7f, 0x00, 0xc3, 0x42, 0x99};
+  byte packed[] = {0x25, 0x00, 0x01, 0x7f, 0x7f, 0x00, 0x43, 0x42, 0x01, 0x19};
+  byte out[10];
+
+  REQUIRE(seven_bit_packed_size(8) == 10);
+  REQUIRE(seven_bit_unpacked_size(10) == 8);
+  REQUIRE(seven_bit_packed_size(0) == 0);
+  REQUIRE(seven_bit_unpacked_size(0) == 0);
+
+  seven_bit_pack(data, sizeof(data), out);
+  REQUIRE(vector<byte>(out, out + 10) == vector<byte>(packed, packed + 10));
+  seven_bit_unpack(packed, sizeof(packed), out);
+  REQUIRE(vector<byte>(out, out + 8) == vector<byte>(data, data + 8));
+}
+
+// Long enough to go through the vector code, with every length of tail
+TEST_CASE("pack and unpack any length", CATCH_CATEGORY) {
+  for (size_t n = 0; n < 200; ++n) {
+    vector<byte> data = test_data(n);
+    vector<byte> expected = reference_pack(data);
+
+    vector<byte> packed(seven_bit_packed_size(n));
+    seven_bit_pack(data.data(), n, packed.data());
+    REQUIRE(packed == expected);
+
+    vector<byte> unpacked(seven_bit_unpacked_size(packed.size()));
+    seven_bit_unpack(packed.data(), packed.size(), unpacked.data());
+    REQUIRE(unpacked == data);
+  }
+}
+
+TEST_CASE("unpack in pieces", CATCH_CATEGORY) {
+  vector<byte> data = test_data(1000);
+  vector<byte> packed = reference_pack(data);
+  SevenBitDecoder decoder;
+
+  for (size_t piece : {1, 3, 8, 13, 64, 1000}) {
+    vector<byte> out;
+    decoder.reset();
+    for (size_t i = 0; i < packed.size(); i += piece)
+      decoder.add(&packed[i], std::min(piece, packed.size() - i), out);
+    decoder.finish(out);
+    REQUIRE(out == data);
+  }
+}
@@ -0,0 +1,83 @@
+#include <string>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <catch2/catch_all.hpp>
+#include "../src/smf_recorder.h"
+
+#define CATCH_CATEGORY "[smf]"
+
+using std::string;
+
+static PmEvent event(PmTimestamp timestamp, PmMessage message) {
+  PmEvent e;
+  e.timestamp = timestamp;
+  e.message = message;
+  return e;
+}
+
+static string read_file(const char *path) {
+  string bytes;
+  char buf[256];
+  size_t n;
+  FILE *fp = fopen(path, "rb");
+
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    bytes.append(buf, n);
+  fclose(fp);
+  return bytes;
+}
+
+static string temp_path() {
+  char path[] = "/tmp/smf_recorder_test_XXXXXX";
+  int fd = mkstemp(path);
+  close(fd);
+  return path;
+}
+
+TEST_CASE("record type 0", CATCH_CATEGORY) {
+  string path = temp_path();
+  SmfRecorder recorder;
+
+  REQUIRE(recorder.open(path.c_str(), 0, 1000));
+  recorder.record(event(1010, Pm_Message(0x90, 60, 100)));
+  recorder.record(event(1010, Pm_Message(0xf8, 0, 0))); // clock is dropped
+  recorder.record(event(1200, Pm_Message(0x90, 60, 0)));  // running status
+  recorder.record(event(1300, 0x304200f0));             // f0 00 42 30
+  recorder.record(event(1300, 0x00f70201));             // 01 02 f7
+  REQUIRE(recorder.close());
+  REQUIRE(recorder.events() == 3);
+
+  string expected(
+    "MThd\0\0\0\x06\0\0\0\x01\x01\xf4"
+    "MTrk\0\0\0\x1c"
+    "\0\xff\x51\x03\x07\xa1\x20"          // tempo 500000
+    "\x0a\x90\x3c\x64"                    // +10 ms note on
+    "\x81\x3e\x3c\x00"                    // +190 ms, running status
+    "\x64\xf0\x06\x00\x42\x30\x01\x02\xf7" // +100 ms sysex
+    "\0\xff\x2f\x00", 50);
+  REQUIRE(read_file(path.c_str()) == expected);
+  unlink(path.c_str());
+}
+
+TEST_CASE("record type 1", CATCH_CATEGORY) {
+  string path = temp_path();
+  SmfRecorder recorder;
+
+  REQUIRE(recorder.open(path.c_str(), 1, 0));
+  recorder.record(event(5, Pm_Message(0x91, 60, 100)));
+  recorder.record(event(7, Pm_Message(0xc0, 3, 0)));
+  REQUIRE(recorder.close());
+
+  string bytes = read_file(path.c_str());
+  REQUIRE(bytes.substr(0, 14) == string("MThd\0\0\0\x06\0\x01\0\x03\x01\xf4", 14));
+  // conductor track, then channel 1, then channel 2
+  size_t ch1 = bytes.find("ch 1");
+  size_t ch2 = bytes.find("ch 2");
+  REQUIRE(ch1 != string::npos);
+  REQUIRE(ch2 != string::npos);
+  REQUIRE(ch1 < ch2);
+  REQUIRE(bytes.substr(ch1 + 4, 3) == string("\x07\xc0\x03", 3));
+  REQUIRE(bytes.substr(ch2 + 4, 4) == string("\x05\x91\x3c\x64", 4));
+  unlink(path.c_str());
+}
@@ -0,0 +1,103 @@
+#include <catch2/catch_all.hpp>
+#include "../src/sysex_assembler.h"
+
+#define CATCH_CATEGORY "[sysex_assembler]"
+
+static PmEvent event(PmMessage message) {
+  PmEvent e = {message, 0};
+  return e;
+}
+
+static std::vector<byte> bytes(std::initializer_list<byte> list) {
+  return std::vector<byte>(list);
+}
+
+TEST_CASE("assembles across batches", CATCH_CATEGORY) {
+  SysexAssembler assembler;
+  // A clock before the sysex, one embedded in it and one in an event of
+  // its own in the middle of it
+  PmEvent events[] = {
+    event(Pm_Message(0xf8, 0, 0)),
+    event(0x30f842f0),
+    event(Pm_Message(0xf8, 0, 0)),
+    event(0x0000f701)
+  };
+
+  assembler.add(events, 3);
+  REQUIRE(assembler.next() == nullptr);
+  REQUIRE(assembler.partial() != nullptr);
+  REQUIRE(assembler.partial()->bytes == bytes({0xf0, 0x42, 0x30}));
+
+  assembler.add(events + 3, 1);
+  REQUIRE(assembler.partial() == nullptr);
+  SysexMessage *message = assembler.next();
+  REQUIRE(message != nullptr);
+  REQUIRE(message->bytes == bytes({0xf0, 0x42, 0x30, 0x01, 0xf7}));
+  assembler.release(message);
+  REQUIRE(assembler.next() == nullptr);
+}
+
+TEST_CASE("several messages in a batch", CATCH_CATEGORY) {
+  SysexAssembler assembler;
+  PmEvent events[] = {
+    event(0xf7037df0),
+    event(Pm_Message(0x90, 60, 100)),
+    event(0x02017df0),
+    event(0x0000f703),
+    event(0x0000f7f0)
+  };
+
+  assembler.add(events, 5);
+  SysexMessage *first = assembler.next();
+  SysexMessage *second = assembler.next();
+  SysexMessage *third = assembler.next();
+  REQUIRE(assembler.next() == nullptr);
+  REQUIRE(first->bytes == bytes({0xf0, 0x7d, 0x03, 0xf7}));
+  REQUIRE(second->bytes == bytes({0xf0, 0x7d, 0x01, 0x02, 0x03, 0xf7}));
+  REQUIRE(third->bytes == bytes({0xf0, 0xf7}));
+  REQUIRE(second->number == first->number + 1);
+  assembler.release(first);
+  assembler.release(second);
+  assembler.release(third);
+}
+
+TEST_CASE("status bytes cut messages short", CATCH_CATEGORY) {
+  SysexAssembler assembler;
+  PmEvent events[] = {
+    event(0x02017df0),
+    event(Pm_Message(0x90, 60, 100)), // ends the first message
+    event(0x03027df0),
+    event(0x04037df0),                // starts over
+    event(0x0000f705)
+  };
+
+  assembler.add(events, 5);
+  REQUIRE(assembler.cut_short() == 2);
+  SysexMessage *message = assembler.next();
+  REQUIRE(message->bytes == bytes({0xf0, 0x7d, 0x03, 0x04, 0x05, 0xf7}));
+  REQUIRE(assembler.next() == nullptr);
+  assembler.release(message);
+}
+
+TEST_CASE("buffers are reused", CATCH_CATEGORY) {
+  SysexAssembler assembler;
+  PmEvent events[] = {event(0x02017df0), event(0x0000f703)};
+
+  assembler.add(events, 2);
+  SysexMessage *message = assembler.next();
+  const byte *data = message->bytes.data();
+  assembler.release(message);
+
+  assembler.add(events, 2);
+  message = assembler.next();
+  REQUIRE(message->bytes.data() == data);
+  REQUIRE(message->bytes.size() == 6);
+
+  // reset drops the message in progress and any not taken
+  assembler.add(events, 2);
+  assembler.add(events, 1);
+  assembler.reset();
+  REQUIRE(assembler.next() == nullptr);
+  REQUIRE(assembler.partial() == nullptr);
+  assembler.release(message);
+}
@@ -0,0 +1,84 @@
+#include <catch2/catch_all.hpp>
+#include "../src/transaction.h"
+
+#define CATCH_CATEGORY "[transaction]"
+
+using namespace std::chrono;
+
+TEST_CASE("parse reply pattern", CATCH_CATEGORY) {
+  ReplyPattern pattern;
+
+  REQUIRE(parse_reply_pattern("f042??68==", &pattern));
+  REQUIRE(pattern == ReplyPattern({0xf0, 0x42, PATTERN_ANY, 0x68, PATTERN_SAME}));
+  REQUIRE(parse_reply_pattern("", &pattern));
+  REQUIRE(pattern.empty());
+
+  REQUIRE(!parse_reply_pattern("f04", &pattern));
+  REQUIRE(!parse_reply_pattern("f0zz", &pattern));
+}
+
+TEST_CASE("reply matches", CATCH_CATEGORY) {
+  ReplyPattern pattern;
+  byte request[] = {0xf0, 0x41, 0x10, 0x11, 0x20, 0x01, 0xf7};
+  byte reply[] = {0xf0, 0x41, 0x10, 0x12, 0x20, 0x01, 0x55, 0xf7};
+
+  REQUIRE(parse_reply_pattern("f041??12====", &pattern));
+  REQUIRE(reply_matches(pattern, request, sizeof(request), reply, sizeof(reply)));
+
+  reply[5] = 0x02;
+  REQUIRE(!reply_matches(pattern, request, sizeof(request), reply, sizeof(reply)));
+  reply[5] = 0x01;
+  reply[3] = 0x11;
+  REQUIRE(!reply_matches(pattern, request, sizeof(request), reply, sizeof(reply)));
+  REQUIRE(!reply_matches(pattern, request, sizeof(request), reply, 4));
+  REQUIRE(reply_matches(ReplyPattern(), request, sizeof(request), reply, sizeof(reply)));
+}
+
+TEST_CASE("transaction queue", CATCH_CATEGORY) {
+  ReplyPattern pattern;
+  steady_clock::time_point start = steady_clock::now();
+  std::vector<size_t> expired;
+
+  // Three requests for parameters 1, 2 and 3, with a note in between
+  byte requests[] = {
+    0xf0, 0x7d, 0x01, 0xf7,
+    0x90, 0x40, 0x7f,
+    0xf0, 0x7d, 0x02, 0xf7,
+    0xf0, 0x7d, 0x03, 0xf7
+  };
+  REQUIRE(parse_reply_pattern("f07d==", &pattern));
+  TransactionQueue queue(2, 100, pattern);
+  REQUIRE(queue.add_requests(requests, sizeof(requests)) == 3);
+  REQUIRE(queue.request_length(1) == 4);
+  REQUIRE(queue.request(1)[2] == 0x02);
+
+  // the window holds two
+  REQUIRE(queue.next_to_send(start) == 0);
+  REQUIRE(queue.next_to_send(start) == 1);
+  REQUIRE(queue.next_to_send(start) == -1);
+
+  // replies correlate by parameter, not arrival order
+  byte reply2[] = {0xf0, 0x7d, 0x02, 0x10, 0xf7};
+  byte reply9[] = {0xf0, 0x7d, 0x09, 0x10, 0xf7};
+  REQUIRE(queue.answer(reply9, sizeof(reply9), start) == -1);
+  REQUIRE(queue.answer(reply2, sizeof(reply2), start + milliseconds(5)) == 1);
+  REQUIRE(queue.transaction(1).state == TRANSACTION_ANSWERED);
+  REQUIRE(queue.transaction(1).round_trip_us == 5000);
+  REQUIRE(queue.answer(reply2, sizeof(reply2), start) == -1);
+
+  REQUIRE(queue.next_to_send(start + milliseconds(50)) == 2);
+  REQUIRE(!queue.done());
+
+  // request 0 times out first, then request 2
+  queue.expire(start + milliseconds(99), expired);
+  REQUIRE(expired.empty());
+  queue.expire(start + milliseconds(100), expired);
+  REQUIRE(expired == std::vector<size_t>({0}));
+  REQUIRE(queue.transaction(0).state == TRANSACTION_TIMED_OUT);
+  queue.expire(start + milliseconds(150), expired);
+  REQUIRE(expired == std::vector<size_t>({0, 2}));
+
+  REQUIRE(queue.done());
+  REQUIRE(queue.answered() == 1);
+  REQUIRE(queue.timed_out() == 2);
+}